@@ -0,0 +1,90 @@
+#include "gguf_metadata.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <ggml.h>
+
+using namespace std::string_literals;
+
+// Maximum supported GGUF version
+static constexpr int GGUF_VER_MAX = 3;
+
+static GGUFMetadataCache *s_metadataCache = nullptr;
+
+gguf_metadata parse_gguf_metadata(const std::string &modelPath) {
+    gguf_metadata md;
+    ggml_context *meta = nullptr;
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &meta,
+    };
+    gguf_context *ctx = gguf_init_from_file(modelPath.c_str(), params);
+    if (!ctx)
+        return md;
+
+    const int kid = gguf_find_key(ctx, "general.architecture");
+    if (gguf_get_version(ctx) > GGUF_VER_MAX) {
+        std::cerr << __func__ << ": unsupported gguf version: " << gguf_get_version(ctx) << "\n";
+    } else if (kid != -1 && gguf_get_kv_type(ctx, kid) == GGUF_TYPE_STRING) {
+        md.valid = true;
+        md.arch = gguf_get_val_str(ctx, kid);
+
+        auto get_u32 = [ctx, &md](const char *key, uint32_t fallback) -> uint32_t {
+            const int keyidx = gguf_find_key(ctx, (md.arch + "." + key).c_str());
+            // some models have per-layer arrays here, which the estimates don't need to be exact about
+            if (keyidx == -1 || gguf_get_kv_type(ctx, keyidx) != GGUF_TYPE_UINT32)
+                return fallback;
+            return gguf_get_val_u32(ctx, keyidx);
+        };
+        md.has_pooling_type = gguf_find_key(ctx, (md.arch + ".pooling_type").c_str()) != -1;
+        md.context_length = get_u32("context_length", -1);
+        md.block_count = get_u32("block_count", -1);
+        md.n_embd = get_u32("embedding_length", 0);
+        md.n_head = get_u32("attention.head_count", 0);
+        md.n_ff = get_u32("feed_forward_length", 4 * md.n_embd);
+        const uint32_t n_head_kv = get_u32("attention.head_count_kv", md.n_head);
+        const uint32_t n_embd_head = md.n_head ? md.n_embd / md.n_head : 0;
+        md.n_embd_k = get_u32("attention.key_length", n_embd_head) * n_head_kv;
+        md.n_embd_v = get_u32("attention.value_length", n_embd_head) * n_head_kv;
+
+        const int tokensidx = gguf_find_key(ctx, "tokenizer.ggml.tokens");
+        md.n_vocab = tokensidx == -1 ? 0 : gguf_get_arr_n(ctx, tokensidx);
+
+        // check for known bad models
+        const int nameidx = gguf_find_key(ctx, "general.name");
+        md.blacklisted = nameidx != -1 && gguf_get_val_str(ctx, nameidx) == "open-orca_mistral-7b-openorca"s
+            && md.n_vocab == 32002
+            && gguf_get_arr_str(ctx, tokensidx, 32000) == "<dummy32000>"s; // should be <|im_end|>
+
+        md.layer_weights.assign(std::max(md.block_count, 0), 0);
+        for (int i = 0; i < gguf_get_n_tensors(ctx); i++) {
+            const char *name = gguf_get_tensor_name(ctx, i);
+            const uint64_t size = ggml_nbytes(ggml_get_tensor(meta, name));
+            md.weights += size;
+            unsigned layer;
+            if (sscanf(name, "blk.%u.", &layer) == 1 && layer < md.layer_weights.size())
+                md.layer_weights[layer] += size;
+            else if (strncmp(name, "output", 6) == 0)
+                md.output_weights += size;
+        }
+    }
+
+    gguf_free(ctx);
+    ggml_free(meta);
+    return md;
+}
+
+
+void set_gguf_metadata_cache(GGUFMetadataCache *cache) {
+    s_metadataCache = cache;
+}
+
+std::shared_ptr<const gguf_metadata> cached_gguf_metadata(const std::string &modelPath) {
+    if (s_metadataCache)
+        return s_metadataCache->get(modelPath, parse_gguf_metadata);
+    return std::make_shared<const gguf_metadata>(parse_gguf_metadata(modelPath));
+}
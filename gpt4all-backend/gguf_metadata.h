@@ -0,0 +1,47 @@
+#ifndef GGUF_METADATA_H
+#define GGUF_METADATA_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// What the preflight calls need from the header of a model file, which is only parsed once per
+// version of the file
+struct gguf_metadata {
+    bool valid = false;             // a GGUF file with an architecture
+    bool blacklisted = false;
+    std::string arch;
+    bool has_pooling_type = false;
+    int32_t context_length = -1;
+    int32_t block_count = -1;
+    uint32_t n_embd = 0;
+    uint32_t n_head = 0;
+    uint32_t n_ff = 0;
+    uint32_t n_embd_k = 0;          // of all KV heads
+    uint32_t n_embd_v = 0;
+    uint64_t n_vocab = 0;
+    uint64_t weights = 0;           // bytes of all tensors
+    uint64_t output_weights = 0;    // bytes of the tensors after the last layer
+    std::vector<uint64_t> layer_weights;
+};
+
+// Process-wide cache of gguf_metadata keyed by path, size and modification time. There is one, owned
+// by llmodel, which hands it to each implementation library through its set_metadata_cache hook.
+// Parsing is left to the implementations, since only they link against ggml.
+class GGUFMetadataCache {
+public:
+    using Parser = gguf_metadata (*)(const std::string &modelPath);
+    virtual std::shared_ptr<const gguf_metadata> get(const std::string &modelPath, Parser parse) = 0;
+
+protected:
+    ~GGUFMetadataCache() = default;
+};
+
+// Implemented in gguf_metadata.cpp, which is built into the implementation libraries
+gguf_metadata parse_gguf_metadata(const std::string &modelPath);
+void set_gguf_metadata_cache(GGUFMetadataCache *cache);
+// Goes through the cache once it has been set, a library used on its own parses every time
+std::shared_ptr<const gguf_metadata> cached_gguf_metadata(const std::string &modelPath);
+
+#endif // GGUF_METADATA_H
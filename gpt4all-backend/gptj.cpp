@@ -1,6 +1,7 @@
 #define GPTJ_H_I_KNOW_WHAT_I_AM_DOING_WHEN_INCLUDING_THIS_FILE
 #include "gptj_impl.h"
 
+#include "gguf_metadata.h"
 #include "utils.h"
 #include "llmodel_shared.h"
 
@@ -27,6 +28,8 @@
 #include <sstream>
 #include <unordered_set>
 #include <ggml.h>
+#include <ggml-alloc.h>
+#include <ggml-backend.h>
 
 
 namespace {
@@ -85,11 +88,14 @@ struct gptj_model {
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
 
-    llm_buffer eval_buf;
-    llm_buffer scr0_buf;
-    llm_buffer scr1_buf;
+    llm_buffer eval_buf;         // graph metadata, the tensors themselves live in the compute buffer
+    llm_buffer work_buf;         // scratch for ggml_graph_compute
+    ggml_gallocr_t galloc = nullptr; // compute buffer, reserved for the largest graph
 
     ~gptj_model() {
+        if (galloc) {
+            ggml_gallocr_free(galloc);
+        }
         if (ctx) {
             ggml_free(ctx);
         }
@@ -221,6 +227,19 @@ bool gptj_model_load(const std::string &fname, gptj_model & model, gpt_vocab & v
             vocab.token_to_id[word] = i;
             vocab.id_to_token[i] = word;
         }
+
+        std::vector<std::string> merges;
+        int merges_keyidx = gguf_find_key(ggufctx, "tokenizer.ggml.merges");
+        if (merges_keyidx != -1) {
+            const int n_merges = gguf_get_arr_n(ggufctx, merges_keyidx);
+            merges.reserve(n_merges);
+            for (int i = 0; i < n_merges; i++)
+                merges.push_back(gguf_get_arr_str(ggufctx, merges_keyidx, i));
+        }
+        if (!gpt_vocab_init_bpe(vocab, merges)) {
+            fprintf(stderr, "%s: gpt2 tokenizer has no byte-level merges, using greedy matching\n", __func__);
+            gpt_vocab_build_trie(vocab);
+        }
     }
 
     auto & ctx = model.ctx;
@@ -286,60 +305,58 @@ bool gptj_model_load(const std::string &fname, gptj_model & model, gpt_vocab & v
         printf("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
     }
 
-    model.scr0_buf.resize(256u * 1024 * 1024);
-    model.scr1_buf.resize(256u * 1024 * 1024);
-
     return true;
 }
 
-// evaluate the transformer
-//
-//   - model:     the model
-//   - n_threads: number of threads to use
-//   - n_past:    the context size so far
-//   - embd_inp:  the embeddings of the tokens in the context
-//   - embd_w:    the predicted logits for the next token
+struct gptj_graph {
+    struct ggml_context * ctx;
+    struct ggml_cgraph  * gf;
+
+    // inputs
+    struct ggml_tensor * embd;
+    struct ggml_tensor * KQ_pos;
+    struct ggml_tensor * KQ_mask; // only when the kv cache ring buffer has wrapped
+
+    // output, the logits of the last token
+    struct ggml_tensor * logits;
+};
+
+// build the graph that evaluates N tokens after n_past, with the ring buffer at the given shift
 //
-// The GPT-J model requires about 16MB of memory per input token.
+// The new tokens must not wrap around the end of the kv cache ring buffer.
 //
-bool gptj_eval(
+static gptj_graph gptj_build_graph(
         gptj_model & model,
-        const int n_threads,
         const int n_past,
-        const std::vector<gpt_vocab::id> & embd_inp,
-              std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
-    const int N = embd_inp.size();
-
+        const int N,
+        const int shift) {
     const auto & hparams = model.hparams;
 
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
     const int n_ctx   = hparams.n_ctx;
     const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
     const int n_rot   = hparams.n_rot;
 
-    const size_t init_buf_size = 1024_MiB;
-    if (!model.eval_buf.addr || model.eval_buf.size < init_buf_size)
-        model.eval_buf.resize(init_buf_size);
+    if (!model.eval_buf.addr)
+        model.eval_buf.resize(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
 
-    if (mem_per_token > 0 && mem_per_token*N > model.eval_buf.size) {
-        const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, model.eval_buf.size, buf_size_new);
+    // slots of the kv cache ring buffer
+    const int n_kv  = n_past + N;                 // cache entries attended to
+    const int first = shift % n_ctx;              // slot of position 0
+    const int head  = (shift + n_past) % n_ctx;   // slot of the first new token
+    assert(head + N <= n_ctx);
 
-        // reallocate
-        model.eval_buf.resize(buf_size_new);
-        if (model.eval_buf.addr == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.eval_buf.size);
-            return false;
-        }
-    }
+    // once the valid entries wrap around we attend to the whole cache and mask out the stale slots
+    const bool wrapped = first + n_kv > n_ctx;
+    const int  n_keys  = wrapped ? n_ctx : n_kv;
+    const int  k_first = wrapped ? 0 : first;
 
+    // the tensors are only described here, gptj_eval fills in the inputs once they are allocated
     struct ggml_init_params params = {
         .mem_size   = model.eval_buf.size,
         .mem_buffer = model.eval_buf.addr,
-        .no_alloc = false
+        .no_alloc = true
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
@@ -347,20 +364,23 @@ bool gptj_eval(
 
     // KQ_pos - contains the positions
     struct ggml_tensor * KQ_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    int * data = (int *) KQ_pos->data;
-    for (int i = 0; i < N; ++i) {
-        data[i] = n_past + i;
+    ggml_set_input(KQ_pos);
+
+    // KQ_mask - hides the slots each token must not attend to when the ring buffer has wrapped
+    struct ggml_tensor * KQ_mask = nullptr;
+    if (wrapped) {
+        KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_ctx, N);
+        ggml_set_input(KQ_mask);
     }
 
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+    ggml_set_input(embd);
 
     // wte
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, embd);
 
     for (int il = 0; il < n_layer; ++il) {
         struct ggml_tensor * cur;
-        ggml_set_scratch(ctx0, {0, model.scr0_buf.size, model.scr0_buf.addr, });
         // norm
         {
             cur = ggml_norm(ctx0, inpL, model.hparams.norm_eps);
@@ -390,10 +410,10 @@ bool gptj_eval(
             {
                 struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_mul_mat(ctx0, model.layers[il].c_attn_v_proj_w, cur));
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + head));
                 struct ggml_tensor * v = ggml_view_2d(ctx0, model.kv_self.v, N, n_embd,
                         (   n_ctx)*ggml_element_size(model.kv_self.v),
-                        (il*n_ctx)*ggml_element_size(model.kv_self.v)*n_embd + n_past*ggml_element_size(model.kv_self.v));
+                        (il*n_ctx)*ggml_element_size(model.kv_self.v)*n_embd + head*ggml_element_size(model.kv_self.v));
 
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
@@ -402,12 +422,12 @@ bool gptj_eval(
             // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
             struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
 
-            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
+            // K = Kmem.view(n_embd/n_head, n_head, n_keys).permute(0, 2, 1, 3)
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.k)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
+                            ggml_view_1d(ctx0, model.kv_self.k, n_keys*n_embd, (il*n_ctx + k_first)*ggml_element_size(model.kv_self.k)*n_embd),
+                            n_embd/n_head, n_head, n_keys),
                         0, 2, 1, 3);
 
             // K * Q
@@ -417,18 +437,20 @@ bool gptj_eval(
             struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, 1.0f/sqrt(float(n_embd)/n_head));
 
             // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+            struct ggml_tensor * KQ_masked = wrapped
+                ? ggml_add(ctx0, KQ_scaled, ggml_repeat(ctx0, KQ_mask, KQ_scaled))
+                : ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
 
             // KQ = soft_max(KQ_masked)
             struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
 
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
+            // V_trans = Vmem.view(n_embd/n_head, n_head, n_keys).permute(1, 2, 0, 3).contiguous()
             struct ggml_tensor * V =
                 ggml_view_3d(ctx0, model.kv_self.v,
-                        n_past + N, n_embd/n_head, n_head,
+                        n_keys, n_embd/n_head, n_head,
                         n_ctx*ggml_element_size(model.kv_self.v),
                         n_ctx*ggml_element_size(model.kv_self.v)*n_embd/n_head,
-                        il*n_ctx*ggml_element_size(model.kv_self.v)*n_embd);
+                        il*n_ctx*ggml_element_size(model.kv_self.v)*n_embd + k_first*ggml_element_size(model.kv_self.v));
 
             // KQV = transpose(V) * KQ_soft_max
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -449,7 +471,6 @@ bool gptj_eval(
 
         struct ggml_tensor * inpFF = cur;
 
-        ggml_set_scratch(ctx0, {0, model.scr1_buf.size, model.scr1_buf.addr, });
         // feed-forward network
         // this is independent of the self-attention result, so it could be done in parallel to the self-attention
         {
@@ -483,7 +504,8 @@ bool gptj_eval(
         inpL = ggml_add(ctx0, cur, inpL);
     }
 
-    ggml_set_scratch(ctx0, {0, model.scr0_buf.size, model.scr0_buf.addr, });
+    // only the last token's logits are returned, so the rest don't need to go through the head
+    inpL = ggml_view_2d(ctx0, inpL, n_embd, 1, inpL->nb[1], (N - 1)*inpL->nb[1]);
 
     // norm
     {
@@ -497,8 +519,6 @@ bool gptj_eval(
                 ggml_repeat(ctx0, model.ln_f_b, inpL));
     }
 
-    ggml_set_scratch(ctx0, { 0, 0, nullptr, });
-
     // lm_head
     {
         inpL = ggml_mul_mat(ctx0, model.lmh_g, inpL);
@@ -511,58 +531,120 @@ bool gptj_eval(
     // logits -> probs
     //inpL = ggml_soft_max(ctx0, inpL);
 
+    ggml_set_output(inpL);
     ggml_build_forward_expand(gf, inpL);
 
-    // run the computation
-    {
-        std::unique_ptr<uint8_t []> data;
-        auto plan = ggml_graph_plan(gf, n_threads);
-        if (plan.work_size > 0) {
-            data.reset(new uint8_t[plan.work_size]);
-            plan.work_data = data.get();
+    return { ctx0, gf, embd, KQ_pos, KQ_mask, inpL };
+}
+
+// reserve the compute buffer for the largest graph: a full batch attending to the whole, wrapped cache
+static bool gptj_reserve_compute(gptj_model & model) {
+    const int n_ctx = model.hparams.n_ctx;
+    const int N = std::min(LLMODEL_MAX_PROMPT_BATCH, n_ctx);
+
+    model.galloc = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    gptj_graph graph = gptj_build_graph(model, n_ctx - N, N, N);
+    const bool ok = ggml_gallocr_reserve(model.galloc, graph.gf);
+    ggml_free(graph.ctx);
+    if (!ok) {
+        fprintf(stderr, "%s: failed to reserve the compute buffer\n", __func__);
+        return false;
+    }
+
+    printf("%s: compute buffer size = %7.2f MB\n", __func__, ggml_gallocr_get_buffer_size(model.galloc, 0) / 1024.0 / 1024.0);
+    return true;
+}
+
+// evaluate the transformer
+//
+//   - model:     the model
+//   - n_threads: number of threads to use
+//   - n_past:    the context size so far
+//   - embd_inp:  the embeddings of the tokens in the context
+//   - embd_w:    the predicted logits for the next token
+//
+// The new tokens must not wrap around the end of the kv cache ring buffer.
+//
+bool gptj_eval(
+        gptj_model & model,
+        const int n_threads,
+        const int n_past,
+        const std::vector<gpt_vocab::id> & embd_inp,
+              std::vector<float>         & embd_w) {
+    const int N = embd_inp.size();
+
+    const int n_ctx   = model.hparams.n_ctx;
+    const int n_vocab = model.hparams.n_vocab;
+    const int shift   = model.kv_self.shift;
+
+    gptj_graph graph = gptj_build_graph(model, n_past, N, shift);
+
+    // the compute buffer is reallocated if this graph doesn't fit, which shouldn't happen after reserving
+    if (!ggml_gallocr_alloc_graph(model.galloc, graph.gf)) {
+        fprintf(stderr, "%s: failed to allocate the compute buffer\n", __func__);
+        ggml_free(graph.ctx);
+        return false;
+    }
+
+    memcpy(graph.embd->data, embd_inp.data(), N*ggml_element_size(graph.embd));
+
+    int * pos = (int *) graph.KQ_pos->data;
+    for (int i = 0; i < N; ++i) {
+        pos[i] = shift + n_past + i;
+    }
+
+    if (graph.KQ_mask) {
+        const int first = shift % n_ctx;
+        float * mask = (float *) graph.KQ_mask->data;
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < n_ctx; ++j) {
+                const int p = (j - first + n_ctx) % n_ctx;
+                mask[i*n_ctx + j] = p <= n_past + i ? 0.0f : -INFINITY;
+            }
         }
-        ggml_graph_compute(gf, &plan);
     }
 
+    // run the computation
+    ggml_graph_compute_g4a(model.work_buf, graph.gf, n_threads);
+
     //if (n_past%100 == 0) {
     //    ggml_graph_print   (gf);
     //    ggml_graph_dump_dot(gf, NULL, "gpt-2.dot");
     //}
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
-
-    // return result for just the last token
     embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
-
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
-    }
-    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
+    memcpy(embd_w.data(), ggml_get_data(graph.logits), sizeof(float)*n_vocab);
 
-    ggml_free(ctx0);
+    ggml_free(graph.ctx);
 
     return true;
 }
 
 #define GPTJ_MAX_RNG_STATE 64*1024
 
+// the state starts with a magic that changes whenever its layout does, so that a state saved by
+// another version is refused instead of being read as garbage
+static constexpr uint32_t GPTJ_STATE_MAGIC = 0x676a7332; // "gjs2"
+
 size_t gptj_get_state_size(const gptj_model &model)
 {
     // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
     // for reference, std::mt19937(1337) serializes to 6701 bytes.
+    const size_t s_magic           = sizeof(uint32_t);
     const size_t s_rng_size        = sizeof(size_t);
     const size_t s_rng             = GPTJ_MAX_RNG_STATE;
     const size_t s_kv_size         = sizeof(size_t);
     const size_t s_kv_ntok         = sizeof(int);
     const size_t s_kv              = model.kv_self.buf.size;
+    const size_t s_kv_shift        = sizeof(int);
     const size_t s_total = (
+        + s_magic
         + s_rng_size
         + s_rng
         + s_kv_size
         + s_kv_ntok
         + s_kv
+        + s_kv_shift
     );
     fflush(stdout);
     return s_total;
@@ -572,6 +654,8 @@ size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, ui
 {
     uint8_t * out = dest;
     fflush(stdout);
+    memcpy(out, &GPTJ_STATE_MAGIC, sizeof(GPTJ_STATE_MAGIC)); out += sizeof(GPTJ_STATE_MAGIC);
+
     // copy rng
     {
         std::stringstream rng_ss;
@@ -598,6 +682,9 @@ size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, ui
         if (kv_size) {
             memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
         }
+
+        const int kv_shift = model.kv_self.shift;
+        memcpy(out, &kv_shift, sizeof(kv_shift)); out += sizeof(kv_shift);
     }
 
     const size_t written  = out - dest;
@@ -606,36 +693,61 @@ size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, ui
     return written;
 }
 
-size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src)
+// returns 0 without touching the model if the state wasn't saved by this version from a model
+// with the same KV cache
+size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src, size_t size)
 {
+    if (size != gptj_get_state_size(*model)) {
+        fprintf(stderr, "%s: saved state has the wrong size\n", __func__);
+        return 0;
+    }
+
     const uint8_t * in = src;
 
-    // set rng
+    uint32_t magic;
+    memcpy(&magic, in, sizeof(magic)); in += sizeof(magic);
+    if (magic != GPTJ_STATE_MAGIC) {
+        fprintf(stderr, "%s: saved state is from another version\n", __func__);
+        return 0;
+    }
+
+    // read rng
+    std::mt19937 saved_rng;
     {
         size_t rng_size;
-        char   rng_buf[GPTJ_MAX_RNG_STATE];
-
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, GPTJ_MAX_RNG_STATE); in += GPTJ_MAX_RNG_STATE;
+        memcpy(&rng_size, in, sizeof(rng_size)); in += sizeof(rng_size);
+        if (rng_size > GPTJ_MAX_RNG_STATE) {
+            fprintf(stderr, "%s: saved state has an invalid rng\n", __func__);
+            return 0;
+        }
 
         std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
+        rng_ss.str(std::string(reinterpret_cast<const char *>(in), rng_size));
+        rng_ss >> saved_rng;
+        in += GPTJ_MAX_RNG_STATE;
 
-        assert(rng_ss.fail() == false);
+        if (rng_ss.fail()) {
+            fprintf(stderr, "%s: saved state has an invalid rng\n", __func__);
+            return 0;
+        }
     }
 
-    // set kv cache
-    {
-        size_t kv_size;
-        int kv_ntok;
+    // check the kv cache before overwriting it
+    size_t kv_size;
+    int kv_ntok, kv_shift;
+    memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
+    memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
+    memcpy(&kv_shift, in + kv_size, sizeof(kv_shift));
+    if (kv_size != model->kv_self.buf.size || kv_ntok < 0 || kv_ntok > model->hparams.n_ctx || kv_shift < 0) {
+        fprintf(stderr, "%s: saved state does not match this model\n", __func__);
+        return 0;
+    }
 
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
+    *rng = saved_rng;
 
+    // set kv cache
+    {
         if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
-
             void * k_data = model->kv_self.k->data; // remember data pointers
             void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
 
@@ -647,10 +759,12 @@ size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *
         }
 
         model->kv_self.n = kv_ntok;
+        model->kv_self.shift = kv_shift;
+        in += sizeof(kv_shift);
     }
 
     const size_t nread    = in - src;
-    assert(nread == gptj_get_state_size(*model));
+    assert(nread == size);
     fflush(stdout);
     return nread;
 }
@@ -661,8 +775,9 @@ struct GPTJPrivate {
     gpt_vocab vocab;
     gptj_model *model = nullptr;
     int64_t n_threads = 0;
-    size_t mem_per_token = 0;
+    int64_t n_threads_batch = 0;
     std::mt19937 rng;
+    gpt_sample_buffers sampler;
 };
 
 GPTJ::GPTJ()
@@ -672,9 +787,10 @@ GPTJ::GPTJ()
     d_ptr->modelLoaded = false;
 }
 
-size_t GPTJ::requiredMem(const std::string &modelPath, int n_ctx, int ngl) {
+size_t GPTJ::requiredMem(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) {
     (void)n_ctx;
     (void)ngl;
+    (void)kvType;
     gptj_model dummy_model;
     gpt_vocab dummy_vocab;
     size_t mem_req;
@@ -682,16 +798,18 @@ size_t GPTJ::requiredMem(const std::string &modelPath, int n_ctx, int ngl) {
     return mem_req;
 }
 
-bool GPTJ::loadModel(const std::string &modelPath, int n_ctx, int ngl) {
+bool GPTJ::loadModel(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) {
     (void)n_ctx;
     (void)ngl;
+    if (kvType != KVCacheType::F16)
+        std::cerr << "GPT-J WARNING: quantized KV cache is not supported, using f16\n";
     d_ptr->modelLoaded = false;
 
     std::mt19937 rng(time(NULL));
     d_ptr->rng = rng;
 
     // load the model
-    bool ok = gptj_model_load(modelPath, *d_ptr->model, d_ptr->vocab);
+    bool ok = gptj_model_load(modelPath, *d_ptr->model, d_ptr->vocab) && gptj_reserve_compute(*d_ptr->model);
     fflush(stdout);
     if (!ok) {
         std::cerr << "GPT-J ERROR: failed to load model from " <<  modelPath;
@@ -699,12 +817,15 @@ bool GPTJ::loadModel(const std::string &modelPath, int n_ctx, int ngl) {
     }
 
     d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    d_ptr->n_threads_batch = d_ptr->n_threads;
+    buildTokenTextTable(d_ptr->vocab.id_to_token.size());
     d_ptr->modelLoaded = true;
     return true;
 }
 
 void GPTJ::setThreadCount(int32_t n_threads) {
     d_ptr->n_threads = n_threads;
+    d_ptr->n_threads_batch = n_threads;
 }
 
 int32_t GPTJ::threadCount() const
@@ -712,6 +833,15 @@ int32_t GPTJ::threadCount() const
     return d_ptr->n_threads;
 }
 
+void GPTJ::setBatchThreadCount(int32_t n_threads) {
+    d_ptr->n_threads_batch = n_threads;
+}
+
+int32_t GPTJ::batchThreadCount() const
+{
+    return d_ptr->n_threads_batch;
+}
+
 GPTJ::~GPTJ()
 {
     delete d_ptr->model;
@@ -732,9 +862,9 @@ size_t GPTJ::saveState(uint8_t *dest) const
     return gptj_copy_state_data(*d_ptr->model, d_ptr->rng, dest);
 }
 
-size_t GPTJ::restoreState(const uint8_t *src)
+size_t GPTJ::restoreState(const uint8_t *src, size_t size)
 {
-    return gptj_set_state_data(d_ptr->model, &d_ptr->rng, src);
+    return gptj_set_state_data(d_ptr->model, &d_ptr->rng, src, size);
 }
 
 std::vector<LLModel::Token> GPTJ::tokenize(PromptContext &ctx, const std::string &str, bool special) const
@@ -750,10 +880,10 @@ LLModel::Token GPTJ::sampleToken(PromptContext &promptCtx) const
     return gpt_sample_top_k_top_p(d_ptr->model->hparams.n_vocab,
         promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
         n_prev_toks,
-        promptCtx.logits,
+        promptCtx.logits.data(),
         promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
         promptCtx.repeat_penalty,
-        d_ptr->rng);
+        d_ptr->rng, d_ptr->sampler);
 }
 
 std::string GPTJ::tokenToString(Token id) const
@@ -763,15 +893,34 @@ std::string GPTJ::tokenToString(Token id) const
 
 bool GPTJ::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
 {
-    // determine the required inference memory per token:
-    static bool initialized = false;
-    if (!initialized) {
-        gptj_eval(*d_ptr->model, d_ptr->n_threads, 0, { 0, 1, 2, 3 }, ctx.logits,
-            d_ptr->mem_per_token);
-        initialized = true;
+    auto &kv_self = d_ptr->model->kv_self;
+    if (ctx.n_past == 0)
+        kv_self.shift = 0; // new context, start at the beginning of the ring buffer
+
+    // split the batch where it wraps around the end of the ring buffer
+    const int32_t n_ctx = d_ptr->model->hparams.n_ctx;
+    const size_t n_head = n_ctx - (kv_self.shift + ctx.n_past) % n_ctx;
+    const int n_threads = tokens.size() > 1 ? d_ptr->n_threads_batch : d_ptr->n_threads;
+    if (tokens.size() > n_head) {
+        const std::vector<int32_t> head(tokens.begin(), tokens.begin() + n_head);
+        const std::vector<int32_t> tail(tokens.begin() + n_head, tokens.end());
+        return gptj_eval(*d_ptr->model, n_threads, ctx.n_past, head, ctx.logits)
+            && gptj_eval(*d_ptr->model, n_threads, ctx.n_past + n_head, tail, ctx.logits);
     }
 
-    return gptj_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token);
+    return gptj_eval(*d_ptr->model, n_threads, ctx.n_past, tokens, ctx.logits);
+}
+
+bool GPTJ::shiftContext(PromptContext &ctx, int32_t n_keep, int32_t n_discard) const
+{
+    (void)ctx;
+    if (n_keep != 0)
+        return false; // only the oldest entries can be dropped from the ring buffer
+
+    // the dropped entries are overwritten as new tokens come in, the rotary embeddings only depend on
+    // relative positions so the remaining keys stay valid
+    d_ptr->model->kv_self.shift += n_discard;
+    return true;
 }
 
 int32_t GPTJ::contextLength() const
@@ -785,16 +934,6 @@ const std::vector<LLModel::Token> &GPTJ::endTokens() const
     return fres;
 }
 
-std::string get_arch_name(gguf_context *ctx_gguf) {
-    std::string arch_name;
-    const int kid = gguf_find_key(ctx_gguf, "general.architecture");
-    enum gguf_type ktype = gguf_get_kv_type(ctx_gguf, kid);
-    if (ktype != GGUF_TYPE_STRING) {
-        throw std::runtime_error("ERROR: Can't get general architecture from gguf file.");
-    }
-    return gguf_get_val_str(ctx_gguf, kid);
-}
-
 #if defined(_WIN32)
 #define DLL_EXPORT __declspec(dllexport)
 #else
@@ -815,20 +954,12 @@ DLL_EXPORT const char *get_build_variant() {
 }
 
 DLL_EXPORT bool magic_match(const char * fname) {
-    struct ggml_context * ctx_meta = NULL;
-    struct gguf_init_params params = {
-        /*.no_alloc = */ true,
-        /*.ctx      = */ &ctx_meta,
-    };
-    gguf_context *ctx_gguf = gguf_init_from_file(fname, params);
-    if (!ctx_gguf)
-        return false;
-
-    bool isValid = gguf_get_version(ctx_gguf) <= 3;
-    isValid = isValid && get_arch_name(ctx_gguf) == "gptj";
+    auto md = cached_gguf_metadata(fname);
+    return md && md->valid && md->arch == "gptj";
+}
 
-    gguf_free(ctx_gguf);
-    return isValid;
+DLL_EXPORT void set_metadata_cache(GGUFMetadataCache *cache) {
+    set_gguf_metadata_cache(cache);
 }
 
 DLL_EXPORT LLModel *construct() {
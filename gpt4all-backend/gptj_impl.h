@@ -17,14 +17,16 @@ public:
 
     bool supportsEmbedding() const override { return false; }
     bool supportsCompletion() const override { return true; }
-    bool loadModel(const std::string &modelPath, int n_ctx, int ngl) override;
+    bool loadModel(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) override;
     bool isModelLoaded() const override;
-    size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl) override;
+    size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) override;
     size_t stateSize() const override;
     size_t saveState(uint8_t *dest) const override;
-    size_t restoreState(const uint8_t *src) override;
+    size_t restoreState(const uint8_t *src, size_t size) override;
     void setThreadCount(int32_t n_threads) override;
     int32_t threadCount() const override;
+    void setBatchThreadCount(int32_t n_threads) override;
+    int32_t batchThreadCount() const override;
 
 private:
     GPTJPrivate *d_ptr;
@@ -34,6 +36,7 @@ protected:
     Token sampleToken(PromptContext &ctx) const override;
     std::string tokenToString(Token id) const override;
     bool evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const override;
+    bool shiftContext(PromptContext &ctx, int32_t n_keep, int32_t n_discard) const override;
     int32_t contextLength() const override;
     const std::vector<Token> &endTokens() const override;
     bool shouldAddBOS() const override { return false; }
@@ -1,21 +1,28 @@
 #define LLAMAMODEL_H_I_KNOW_WHAT_I_AM_DOING_WHEN_INCLUDING_THIS_FILE
 #include "llamamodel_impl.h"
 
+#include "gguf_metadata.h"
+
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <initializer_list>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <random>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -27,11 +34,11 @@
 
 using namespace std::string_literals;
 
-// Maximum supported GGUF version
-static constexpr int GGUF_VER_MAX = 3;
-
 static const char * const modelType_ = "LLaMA";
 
+// Maximum number of sequences decoded together by promptParallel
+static constexpr int32_t MAX_SEQUENCES = 8;
+
 static const std::vector<const char *> KNOWN_ARCHES {
     "baichuan", "bert", "bloom", "codeshell", "falcon", "gemma", "gpt2", "llama", "mpt", "nomic-bert", "orion",
     "persimmon", "phi2", "plamo", "qwen", "qwen2", "refact", "stablelm", "starcoder"
@@ -67,14 +74,23 @@ struct gpt_params {
 
     std::string prompt = "";
 
-    enum ggml_type kv_type = GGML_TYPE_F16; // use f16 instead of f32 for memory kv
-
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
 };
 
+// Logits are scanned in blocks of this many, which are skipped without looking at each logit when
+// none of them can make the top k
+static constexpr int SAMPLE_BLOCK_SIZE = 16;
+
+// Reused across tokens so that sampling doesn't allocate
+struct llama_sampler_buffers {
+    std::vector<llama_token_data> candidates; // min-heap of the top k while selecting
+    std::vector<llama_token_data> penalized;  // original logits of the penalized tokens
+};
+
 static int llama_sample_top_p_top_k(
         llama_context *ctx,
+        llama_sampler_buffers &buffers,
         const llama_token *last_n_tokens_data,
         int last_n_tokens_size,
         int top_k,
@@ -83,77 +99,85 @@ static int llama_sample_top_p_top_k(
         float temp,
         float repeat_penalty,
         int32_t pos) {
-    auto logits = llama_get_logits_ith(ctx, pos);
-    auto n_vocab = llama_n_vocab(llama_get_model(ctx));
-    // Populate initial list of all candidates
-    std::vector<llama_token_data> candidates;
-    candidates.reserve(n_vocab);
-    for (int token_id = 0; token_id < n_vocab; token_id++) {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
-    llama_token_data_array candidates_p = {candidates.data(), candidates.size(), false};
-    // Sample repeat penalty
-    llama_sample_repetition_penalties(nullptr, &candidates_p, last_n_tokens_data, last_n_tokens_size, repeat_penalty, 0.0f, 0.0f);
-    // Temperature sampling
-    llama_sample_top_k(ctx, &candidates_p, top_k, 1);
-    llama_sample_tail_free(ctx, &candidates_p, 1.0f, 1);
-    llama_sample_typical(ctx, &candidates_p, 1.0f, 1);
-    llama_sample_top_p(ctx, &candidates_p, top_p, 1);
-    llama_sample_min_p(ctx, &candidates_p, min_p, 1);
-    llama_sample_temp(ctx, &candidates_p, temp);
-    return llama_sample_token(ctx, &candidates_p);
-}
-
-std::string get_arch_name(gguf_context *ctx_gguf) {
-    std::string arch_name;
-    const int kid = gguf_find_key(ctx_gguf, "general.architecture");
-    enum gguf_type ktype = gguf_get_kv_type(ctx_gguf, kid);
-    if (ktype != (GGUF_TYPE_STRING)) {
-        throw std::runtime_error("ERROR: Can't get general architecture from gguf file.");
+    float *logits = llama_get_logits_ith(ctx, pos);
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    if (top_k <= 0 || top_k > n_vocab)
+        top_k = n_vocab;
+
+    // Take the penalized tokens out of the scan, they are added back with their penalty applied
+    auto &penalized = buffers.penalized;
+    penalized.clear();
+    if (repeat_penalty != 1.0f) {
+        for (int i = 0; i < last_n_tokens_size; i++) {
+            const llama_token id = last_n_tokens_data[i];
+            if (id < 0 || id >= n_vocab || logits[id] == -INFINITY)
+                continue;
+            penalized.push_back({id, logits[id], 0.0f});
+            logits[id] = -INFINITY;
+        }
     }
-    return gguf_get_val_str(ctx_gguf, kid);
-}
 
-static gguf_context *load_gguf(const char *fname) {
-    struct gguf_init_params params = {
-        /*.no_alloc = */ true,
-        /*.ctx      = */ nullptr,
+    // Select the top k with a min-heap, only looking into the blocks that have a logit above its minimum
+    auto &candidates = buffers.candidates;
+    candidates.clear();
+    candidates.reserve(top_k);
+    const auto greater = [](const llama_token_data &a, const llama_token_data &b) { return a.logit > b.logit; };
+    float threshold = -INFINITY;
+    const auto consider = [&](llama_token id, float logit) {
+        if (int(candidates.size()) < top_k) {
+            candidates.push_back({id, logit, 0.0f});
+            std::push_heap(candidates.begin(), candidates.end(), greater);
+            if (int(candidates.size()) == top_k)
+                threshold = candidates.front().logit;
+        } else if (logit > threshold) {
+            std::pop_heap(candidates.begin(), candidates.end(), greater);
+            candidates.back() = {id, logit, 0.0f};
+            std::push_heap(candidates.begin(), candidates.end(), greater);
+            threshold = candidates.front().logit;
+        }
     };
-    gguf_context *ctx = gguf_init_from_file(fname, params);
-    if (!ctx) {
-        std::cerr << __func__ << ": gguf_init_from_file failed\n";
-        return nullptr;
+
+    int id = 0;
+    for (; id + SAMPLE_BLOCK_SIZE <= n_vocab; id += SAMPLE_BLOCK_SIZE) {
+        const float *block = logits + id;
+        bool any = false;
+        for (int j = 0; j < SAMPLE_BLOCK_SIZE; j++)
+            any |= block[j] > threshold;
+        if (!any && int(candidates.size()) == top_k)
+            continue;
+        for (int j = 0; j < SAMPLE_BLOCK_SIZE; j++)
+            consider(id + j, block[j]);
     }
+    for (; id < n_vocab; id++)
+        consider(id, logits[id]);
 
-    int gguf_ver = gguf_get_version(ctx);
-    if (gguf_ver > GGUF_VER_MAX) {
-        std::cerr << __func__ << ": unsupported gguf version: " << gguf_ver << "\n";
-        gguf_free(ctx);
-        return nullptr;
+    // Same penalty as llama_sample_repetition_penalties
+    for (const llama_token_data &token : penalized) {
+        logits[token.id] = token.logit;
+        consider(token.id, token.logit <= 0 ? token.logit * repeat_penalty : token.logit / repeat_penalty);
     }
 
-    return ctx;
-}
+    std::sort_heap(candidates.begin(), candidates.end(), greater);
+    llama_token_data_array candidates_p = {candidates.data(), candidates.size(), true /*sorted*/};
+    if (temp <= 0.0f)
+        return candidates.front().id;
 
-static int32_t get_arch_key_u32(std::string const &modelPath, std::string const &archKey) {
-    auto * ctx = load_gguf(modelPath.c_str());
-    if (!ctx)
-        return -1;
-    std::string arch = get_arch_name(ctx);
+    // Tail free and typical sampling are disabled, so they are skipped
+    if (top_p < 1.0f)
+        llama_sample_top_p(ctx, &candidates_p, top_p, 1);
+    if (min_p > 0.0f)
+        llama_sample_min_p(ctx, &candidates_p, min_p, 1);
+    llama_sample_temp(ctx, &candidates_p, temp);
+    return llama_sample_token(ctx, &candidates_p);
+}
 
-    int32_t value = -1;
-    if (ctx) {
-        auto key = arch + "." + archKey;
-        int keyidx = gguf_find_key(ctx, key.c_str());
-        if (keyidx != -1) {
-            value = gguf_get_val_u32(ctx, keyidx);
-        } else {
-            std::cerr << __func__ << ": " << key << "not found in " << modelPath << "\n";
-        }
+static std::shared_ptr<const gguf_metadata> get_gguf_metadata(const std::string &modelPath) {
+    auto md = cached_gguf_metadata(modelPath);
+    if (!md || !md->valid) {
+        std::cerr << __func__ << ": failed to load GGUF from " << modelPath << "\n";
+        return nullptr;
     }
-
-    gguf_free(ctx);
-    return value;
+    return md;
 }
 
 struct LLamaPrivate {
@@ -161,114 +185,99 @@ struct LLamaPrivate {
     bool modelLoaded;
     int device = -1;
     llama_model *model = nullptr;
+    std::shared_ptr<llama_model> sharedModel; // owns model, shared with the contexts created from it
     llama_context *ctx = nullptr;
     llama_model_params model_params;
     llama_context_params ctx_params;
     int64_t n_threads = 0;
+    int64_t n_threads_batch = 0;
     std::vector<LLModel::Token> end_tokens;
+    llama_sampler_buffers sampler;
+    ggml_type kv_type = GGML_TYPE_F16;
 };
 
+static ggml_type kv_cache_type(LLModel::KVCacheType type)
+{
+    switch (type) {
+    case LLModel::KVCacheType::Q8_0: return GGML_TYPE_Q8_0;
+    case LLModel::KVCacheType::Q4_0: return GGML_TYPE_Q4_0;
+    default:                         return GGML_TYPE_F16;
+    }
+}
+
 LLamaModel::LLamaModel()
     : d_ptr(new LLamaPrivate) {
     d_ptr->modelLoaded = false;
 }
 
-// default hparams (LLaMA 7B)
-struct llama_file_hparams {
-    uint32_t n_vocab = 32000;
-    uint32_t n_embd  = 4096;
-    uint32_t n_mult  = 256;
-    uint32_t n_head  = 32;
-    uint32_t n_layer = 32;
-    uint32_t n_rot   = 64;
-    enum llama_ftype ftype = LLAMA_FTYPE_MOSTLY_F16;
-};
-
-size_t LLamaModel::requiredMem(const std::string &modelPath, int n_ctx, int ngl) {
-    // TODO(cebtenzzre): update to GGUF
-    (void)ngl; // FIXME(cetenzzre): use this value
-    auto fin = std::ifstream(modelPath, std::ios::binary);
-    fin.seekg(0, std::ios_base::end);
-    size_t filesize = fin.tellg();
-    fin.seekg(0, std::ios_base::beg);
-    uint32_t magic = 0;
-    fin.read(reinterpret_cast<char*>(&magic), sizeof(magic));
-    if (magic != 0x67676a74) return 0;
-    uint32_t version = 0;
-    fin.read(reinterpret_cast<char*>(&version), sizeof(version));
-    llama_file_hparams hparams;
-    fin.read(reinterpret_cast<char*>(&hparams.n_vocab), sizeof(hparams.n_vocab));
-    fin.read(reinterpret_cast<char*>(&hparams.n_embd), sizeof(hparams.n_embd));
-    fin.read(reinterpret_cast<char*>(&hparams.n_head), sizeof(hparams.n_head));
-    fin.read(reinterpret_cast<char*>(&hparams.n_layer), sizeof(hparams.n_layer));
-    fin.read(reinterpret_cast<char*>(&hparams.n_rot), sizeof(hparams.n_rot));
-    fin.read(reinterpret_cast<char*>(&hparams.ftype), sizeof(hparams.ftype));
-    const size_t kvcache_element_size = 2; // fp16
-    const size_t est_kvcache_size = hparams.n_embd * hparams.n_layer * 2u * n_ctx * kvcache_element_size;
-    return filesize + est_kvcache_size;
+size_t LLamaModel::requiredMem(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) {
+    MemoryEstimate estimate;
+    return estimateMemory(modelPath, n_ctx, ngl, kvType, estimate) ? estimate.total() : 0;
 }
 
-bool LLamaModel::isModelBlacklisted(const std::string &modelPath) const {
-    auto * ctx = load_gguf(modelPath.c_str());
-    if (!ctx) {
-        std::cerr << __func__ << ": failed to load " << modelPath << "\n";
+bool LLamaModel::estimateMemory(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType,
+                                MemoryEstimate &estimate) {
+    auto md = get_gguf_metadata(modelPath);
+    if (!md)
         return false;
-    }
-
-    auto get_key = [ctx, &modelPath](const char *name) {
-        int keyidx = gguf_find_key(ctx, name);
-        if (keyidx == -1) {
-            throw std::logic_error(name + " not found in "s + modelPath);
-        }
-        return keyidx;
-    };
 
-    bool res = false;
-    try {
-        std::string name(gguf_get_val_str(ctx, get_key("general.name")));
-        int token_idx = get_key("tokenizer.ggml.tokens");
-        int n_vocab = gguf_get_arr_n(ctx, token_idx);
-
-        // check for known bad models
-        if (name == "open-orca_mistral-7b-openorca"
-            && n_vocab == 32002
-            && gguf_get_arr_str(ctx, token_idx, 32000) == "<dummy32000>"s // should be <|im_end|>
-        ) {
-            res = true;
-        }
-    } catch (const std::logic_error &e) {
-        std::cerr << __func__ << ": " << e.what() << "\n";
+    const uint32_t n_layer = std::max(md->block_count, 0);
+    if (!n_layer || !md->n_embd || !md->n_head) {
+        std::cerr << __func__ << ": missing hyperparameters in " << modelPath << "\n";
+        return false;
     }
 
-    gguf_free(ctx);
-    return res;
+    estimate = MemoryEstimate();
+    estimate.weights = md->weights;
+    estimate.layers.assign(md->layer_weights.begin(), md->layer_weights.end());
+
+    // only K is quantized, V stays fp16
+    const ggml_type type_k = kv_cache_type(kvType);
+    const size_t kv_layer = size_t(n_ctx) * (md->n_embd_k * ggml_type_size(type_k) / ggml_blck_size(type_k)
+                                             + md->n_embd_v * ggml_type_size(GGML_TYPE_F16));
+    estimate.kvCache = kv_layer * n_layer;
+    for (auto &layer : estimate.layers)
+        layer += kv_layer;
+
+    // the largest activations of a batch are the attention scores of every head, the feed forward
+    // and the logits, and only the logits of the last token are kept
+    const size_t n_batch = std::min<size_t>(llama_context_default_params().n_batch, n_ctx);
+    estimate.compute = n_batch * (size_t(md->n_head) * n_ctx + 4 * md->n_embd + 2 * md->n_ff + md->n_vocab)
+                       * sizeof(float);
+    estimate.logits = md->n_vocab * sizeof(float);
+
+    // llama.cpp offloads the last ngl layers, and the output only once all layers are
+    const uint32_t n_gpu = std::min(uint32_t(std::max(ngl, 0)), n_layer);
+    for (uint32_t i = n_layer - n_gpu; i < n_layer; i++)
+        estimate.gpu += estimate.layers[i];
+    if (uint32_t(std::max(ngl, 0)) > n_layer)
+        estimate.gpu += md->output_weights;
+    if (n_gpu)
+        estimate.gpu += estimate.compute;
+    return true;
 }
 
-bool LLamaModel::isEmbeddingModel(const std::string &modelPath) const {
-    auto *ctx_gguf = load_gguf(modelPath.c_str());
-    if (!ctx_gguf) {
-        std::cerr << __func__ << ": failed to load GGUF from " <<  modelPath << "\n";
-        return false;
-    }
+bool LLamaModel::isModelBlacklisted(const std::string &modelPath) const {
+    auto md = get_gguf_metadata(modelPath);
+    return md && md->blacklisted;
+}
 
-    std::string arch = get_arch_name(ctx_gguf);
-    gguf_free(ctx_gguf);
-    return is_embedding_arch(arch);
+bool LLamaModel::isEmbeddingModel(const std::string &modelPath) const {
+    auto md = get_gguf_metadata(modelPath);
+    return md && is_embedding_arch(md->arch);
 }
 
-bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
+bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType)
 {
     d_ptr->modelLoaded = false;
 
     // clean up after previous loadModel()
-    if (d_ptr->model) {
-        llama_free_model(d_ptr->model);
-        d_ptr->model = nullptr;
-    }
     if (d_ptr->ctx) {
         llama_free(d_ptr->ctx);
         d_ptr->ctx = nullptr;
     }
+    d_ptr->sharedModel.reset();
+    d_ptr->model = nullptr;
 
     if (n_ctx < 8) {
         std::cerr << "warning: minimum context size is 8, using minimum size.\n";
@@ -317,6 +326,7 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
         std::cerr << "LLAMA ERROR: failed to load model from " << modelPath << std::endl;
         return false;
     }
+    d_ptr->sharedModel.reset(d_ptr->model, llama_free_model);
 
     // -- initialize the context --
 
@@ -335,16 +345,22 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
 
     d_ptr->ctx_params.n_ctx   = n_ctx;
     d_ptr->ctx_params.seed    = params.seed;
-    d_ptr->ctx_params.type_k  = params.kv_type;
-    d_ptr->ctx_params.type_v  = params.kv_type;
 
-    // The new batch API provides space for n_vocab*n_tokens logits. Tell llama.cpp early
-    // that we want this many logits so the state serializes consistently.
-    d_ptr->ctx_params.logits_all = true;
+    // llama.cpp stores V transposed, which it can only do for non-block types, so only K is quantized
+    d_ptr->kv_type = kv_cache_type(kvType);
+#ifdef GGML_USE_KOMPUTE
+    if (d_ptr->device != -1 && d_ptr->kv_type != GGML_TYPE_F16) {
+        std::cerr << "warning: quantized KV cache is not supported by Vulkan, using f16\n";
+        d_ptr->kv_type = GGML_TYPE_F16;
+    }
+#endif
+    d_ptr->ctx_params.type_k  = d_ptr->kv_type;
+    d_ptr->ctx_params.type_v  = GGML_TYPE_F16;
 
     d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    d_ptr->n_threads_batch = d_ptr->n_threads;
     d_ptr->ctx_params.n_threads       = d_ptr->n_threads;
-    d_ptr->ctx_params.n_threads_batch = d_ptr->n_threads;
+    d_ptr->ctx_params.n_threads_batch = d_ptr->n_threads_batch;
 
     if (isEmbedding)
         d_ptr->ctx_params.embeddings = true;
@@ -353,7 +369,7 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
     if (!d_ptr->ctx) {
         fflush(stdout);
         std::cerr << "LLAMA ERROR: failed to init context for model " <<  modelPath << std::endl;
-        llama_free_model(d_ptr->model);
+        d_ptr->sharedModel.reset();
         d_ptr->model = nullptr;
         d_ptr->device = -1;
         return false;
@@ -369,6 +385,8 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
 
     m_supportsEmbedding = isEmbedding;
     m_supportsCompletion = !isEmbedding;
+    if (m_supportsCompletion)
+        buildTokenTextTable(llama_n_vocab(d_ptr->model));
 
     fflush(stdout);
     d_ptr->modelLoaded = true;
@@ -377,9 +395,20 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
 
 void LLamaModel::setThreadCount(int32_t n_threads) {
     d_ptr->n_threads = n_threads;
+    d_ptr->n_threads_batch = n_threads;
     llama_set_n_threads(d_ptr->ctx, n_threads, n_threads);
 }
 
+void LLamaModel::setBatchThreadCount(int32_t n_threads) {
+    // llama.cpp uses these for batches of 32 tokens or more
+    d_ptr->n_threads_batch = n_threads;
+    llama_set_n_threads(d_ptr->ctx, d_ptr->n_threads, n_threads);
+}
+
+int32_t LLamaModel::batchThreadCount() const {
+    return d_ptr->n_threads_batch;
+}
+
 int32_t LLamaModel::threadCount() const {
     return d_ptr->n_threads;
 }
@@ -389,7 +418,7 @@ LLamaModel::~LLamaModel()
     if (d_ptr->ctx) {
         llama_free(d_ptr->ctx);
     }
-    llama_free_model(d_ptr->model);
+    // the weights are freed with the last context using them
 }
 
 bool LLamaModel::isModelLoaded() const
@@ -397,25 +426,141 @@ bool LLamaModel::isModelLoaded() const
     return d_ptr->modelLoaded;
 }
 
+// What a new context needs from the model it shares the weights of, copied when the snapshot is taken
+struct LLamaModel::ContextSnapshot : LLModel::ContextFactory {
+    int device;
+    std::shared_ptr<llama_model> sharedModel;
+    llama_model_params model_params;
+    llama_context_params ctx_params;
+    std::vector<LLModel::Token> end_tokens;
+    ggml_type kv_type;
+    const Implementation *implementation;
+    bool supportsEmbedding;
+    bool supportsCompletion;
+    std::string tokenText;
+    std::vector<uint32_t> tokenTextEnd;
+
+    LLModel *createContext() const override
+    {
+        auto *model = new LLamaModel;
+        LLamaPrivate &d = *model->d_ptr;
+        d.device = device;
+        d.model = sharedModel.get();
+        d.sharedModel = sharedModel;
+        d.model_params = model_params;
+        d.ctx_params = ctx_params;
+        d.n_threads = ctx_params.n_threads;
+        d.n_threads_batch = ctx_params.n_threads_batch;
+        d.end_tokens = end_tokens;
+        d.kv_type = kv_type;
+
+        d.ctx = llama_new_context_with_model(d.model, d.ctx_params);
+        if (!d.ctx) {
+            std::cerr << "LLAMA ERROR: failed to init another context for the model\n";
+            delete model;
+            return nullptr;
+        }
+
+        model->m_implementation = implementation;
+        model->m_supportsEmbedding = supportsEmbedding;
+        model->m_supportsCompletion = supportsCompletion;
+        model->m_tokenText = tokenText;
+        model->m_tokenTextEnd = tokenTextEnd;
+        d.modelLoaded = true;
+        return model;
+    }
+};
+
+std::shared_ptr<const LLModel::ContextFactory> LLamaModel::contextFactory() const
+{
+    if (!d_ptr->modelLoaded)
+        return nullptr;
+#ifdef GGML_USE_KOMPUTE
+    // the Kompute backend only runs one context at a time
+    if (d_ptr->device != -1)
+        return nullptr;
+#endif
+
+    auto snapshot = std::make_shared<ContextSnapshot>();
+    snapshot->device = d_ptr->device;
+    snapshot->sharedModel = d_ptr->sharedModel;
+    snapshot->model_params = d_ptr->model_params;
+    snapshot->model_params.progress_callback = nullptr;
+    snapshot->model_params.progress_callback_user_data = nullptr;
+    snapshot->ctx_params = d_ptr->ctx_params;
+    snapshot->end_tokens = d_ptr->end_tokens;
+    snapshot->kv_type = d_ptr->kv_type;
+    snapshot->implementation = m_implementation;
+    snapshot->supportsEmbedding = m_supportsEmbedding;
+    snapshot->supportsCompletion = m_supportsCompletion;
+    snapshot->tokenText = m_tokenText;
+    snapshot->tokenTextEnd = m_tokenTextEnd;
+    return snapshot;
+}
+
+// The state is prefixed with a header describing the context it was saved from, so that a state
+// saved with another model, context size or KV cache type is refused instead of being read as garbage.
+// Only the logits that were requested are saved, so stateSize() is an upper bound, and the header
+// records how much llama.cpp wrote so that a truncated state is refused too.
+struct llama_state_header {
+    uint32_t magic;
+    int32_t  kv_type;
+    int32_t  n_ctx;
+    int32_t  n_vocab;
+    int32_t  n_embd;
+    int32_t  n_layer;
+    uint64_t n_data;
+};
+
+static constexpr uint32_t LLAMA_STATE_MAGIC = 0x67347332; // "g4s2"
+
+static llama_state_header state_header(const LLamaPrivate &d, uint64_t n_data)
+{
+    return {
+        LLAMA_STATE_MAGIC,
+        d.kv_type,
+        int32_t(llama_n_ctx(d.ctx)),
+        llama_n_vocab(d.model),
+        llama_n_embd(d.model),
+        llama_n_layer(d.model),
+        n_data,
+    };
+}
+
 size_t LLamaModel::stateSize() const
 {
-    return llama_get_state_size(d_ptr->ctx);
+    return sizeof(llama_state_header) + llama_get_state_size(d_ptr->ctx);
 }
 
 size_t LLamaModel::saveState(uint8_t *dest) const
 {
-    return llama_copy_state_data(d_ptr->ctx, dest);
+    const size_t n_data = llama_copy_state_data(d_ptr->ctx, dest + sizeof(llama_state_header));
+    const llama_state_header header = state_header(*d_ptr, n_data);
+    memcpy(dest, &header, sizeof(header));
+    return sizeof(header) + n_data;
 }
 
-size_t LLamaModel::restoreState(const uint8_t *src)
+size_t LLamaModel::restoreState(const uint8_t *src, size_t size)
 {
+    if (size < sizeof(llama_state_header) || size > stateSize()) {
+        std::cerr << "LLAMA ERROR: saved state has the wrong size\n";
+        return 0;
+    }
+    const llama_state_header expected = state_header(*d_ptr, size - sizeof(llama_state_header));
+    llama_state_header header;
+    memcpy(&header, src, sizeof(header));
+    if (memcmp(&header, &expected, sizeof(header)) != 0) {
+        std::cerr << "LLAMA ERROR: saved state does not match this model, context size or KV cache type\n";
+        return 0;
+    }
     // const_cast is required, see: https://github.com/ggerganov/llama.cpp/pull/1540
-    return llama_set_state_data(d_ptr->ctx, const_cast<uint8_t*>(src));
+    return sizeof(header) + llama_set_state_data(d_ptr->ctx, const_cast<uint8_t*>(src + sizeof(header)));
 }
 
 std::vector<LLModel::Token> LLamaModel::tokenize(PromptContext &ctx, const std::string &str, bool special) const
 {
-    const bool wantBOS = ctx.n_past == 0 && ctx.tokens.empty();
+    // a context that holds nothing but a restored prefix starts over like an empty one
+    const bool wantBOS = ctx.n_past == 0 && ctx.tokens.size() == size_t(std::max(ctx.n_cached, 0));
     const bool useBOS = wantBOS && shouldAddBOS();
     auto strCat = wantBOS && !special ? " " + str : str; // insert leading space ourselves, llama.cpp fork doesn't anymore
     std::vector<LLModel::Token> fres(strCat.size()+4);
@@ -432,15 +577,39 @@ std::string LLamaModel::tokenToString(Token id) const
 LLModel::Token LLamaModel::sampleToken(PromptContext &promptCtx) const
 {
     const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return llama_sample_top_p_top_k(d_ptr->ctx,
+    return llama_sample_top_p_top_k(d_ptr->ctx, d_ptr->sampler,
         promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
         n_prev_toks, promptCtx.top_k, promptCtx.top_p, promptCtx.min_p, promptCtx.temp,
         promptCtx.repeat_penalty, promptCtx.n_last_batch_tokens - 1);
 }
 
-bool LLamaModel::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
+void llama_batch_add(
+                 struct llama_batch & batch,
+                        llama_token   id,
+                          llama_pos   pos,
+    const std::vector<llama_seq_id> & seq_ids,
+                               bool   logits) {
+    batch.token   [batch.n_tokens] = id;
+    batch.pos     [batch.n_tokens] = pos;
+    batch.n_seq_id[batch.n_tokens] = seq_ids.size();
+    for (size_t i = 0; i < seq_ids.size(); ++i) {
+        batch.seq_id[batch.n_tokens][i] = seq_ids[i];
+    }
+    batch.logits  [batch.n_tokens] = logits;
+
+    batch.n_tokens++;
+}
+
+static void batch_add_seq(llama_batch &batch, const std::vector<LLModel::Token> &tokens, int seq_id) {
+    for (unsigned i = 0; i < tokens.size(); i++) {
+        llama_batch_add(batch, tokens[i], i, { seq_id }, i == tokens.size() - 1);
+    }
+}
+
+static bool decode_tokens(llama_context *lctx, LLModel::PromptContext &ctx, const std::vector<int32_t> &tokens,
+                          bool all_logits)
 {
-    llama_kv_cache_seq_rm(d_ptr->ctx, 0, ctx.n_past, -1);
+    llama_kv_cache_seq_rm(lctx, ctx.seq_id, ctx.n_past, -1);
 
     llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
 
@@ -451,18 +620,82 @@ bool LLamaModel::evalTokens(PromptContext &ctx, const std::vector<int32_t> &toke
         batch.token   [i] = tokens[i];
         batch.pos     [i] = ctx.n_past + i;
         batch.n_seq_id[i] = 1;
-        batch.seq_id  [i][0] = 0;
-        batch.logits  [i] = false;
+        batch.seq_id  [i][0] = ctx.seq_id;
+        batch.logits  [i] = all_logits;
     }
 
     // llama_decode will output logits only for the last token of the prompt
     batch.logits[batch.n_tokens - 1] = true;
 
+    int res = llama_decode(lctx, batch);
+    llama_batch_free(batch);
+    return res == 0;
+}
+
+bool LLamaModel::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
+{
+    return decode_tokens(d_ptr->ctx, ctx, tokens, false);
+}
+
+bool LLamaModel::evalTokensWithLogits(PromptContext &ctx, const std::vector<int32_t> &tokens) const
+{
+    return decode_tokens(d_ptr->ctx, ctx, tokens, true);
+}
+
+bool LLamaModel::shiftContext(PromptContext &ctx, int32_t n_keep, int32_t n_discard) const
+{
+    // llama.cpp can't re-rotate quantized keys, the context is recomputed instead
+    if (d_ptr->kv_type != GGML_TYPE_F16)
+        return false;
+
+    // drop the oldest span of this sequence and move the rest down, llama.cpp re-rotates the keys
+    // on the next decode
+    llama_kv_cache_seq_rm   (d_ptr->ctx, ctx.seq_id, n_keep, n_keep + n_discard);
+    llama_kv_cache_seq_shift(d_ptr->ctx, ctx.seq_id, n_keep + n_discard, ctx.n_past, -n_discard);
+    return true;
+}
+
+int32_t LLamaModel::maxSequences() const
+{
+    return m_supportsCompletion ? MAX_SEQUENCES : 1;
+}
+
+bool LLamaModel::evalSequences(std::vector<SequenceTokens> &seqs) const
+{
+    size_t n_tokens = 0;
+    for (auto &seq : seqs)
+        n_tokens += seq.tokens.size();
+
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+
+    for (auto &seq : seqs) {
+        auto &ctx = *seq.ctx;
+        llama_kv_cache_seq_rm(d_ptr->ctx, ctx.seq_id, ctx.n_past, -1);
+        for (size_t i = 0; i < seq.tokens.size(); i++)
+            llama_batch_add(batch, seq.tokens[i], ctx.n_past + i, { ctx.seq_id }, i == seq.tokens.size() - 1);
+        // sampleToken reads the logits of the last token this sequence added to the batch
+        ctx.n_last_batch_tokens = batch.n_tokens;
+    }
+
     int res = llama_decode(d_ptr->ctx, batch);
     llama_batch_free(batch);
     return res == 0;
 }
 
+void LLamaModel::assignSequence(PromptContext &ctx, int32_t seq_id) const
+{
+    if (ctx.seq_id == seq_id) {
+        llama_kv_cache_seq_rm(d_ptr->ctx, seq_id, ctx.n_past, -1);
+        return;
+    }
+
+    // carry over what the context has already decoded
+    llama_kv_cache_seq_rm(d_ptr->ctx, seq_id, -1, -1);
+    if (ctx.n_past > 0)
+        llama_kv_cache_seq_cp(d_ptr->ctx, ctx.seq_id, seq_id, 0, ctx.n_past);
+    ctx.seq_id = seq_id;
+}
+
 int32_t LLamaModel::contextLength() const
 {
     return llama_n_ctx(d_ptr->ctx);
@@ -481,12 +714,14 @@ bool LLamaModel::shouldAddBOS() const
 
 int32_t LLamaModel::maxContextLength(std::string const &modelPath) const
 {
-    return get_arch_key_u32(modelPath, "context_length");
+    auto md = get_gguf_metadata(modelPath);
+    return md ? md->context_length : -1;
 }
 
 int32_t LLamaModel::layerCount(std::string const &modelPath) const
 {
-    return get_arch_key_u32(modelPath, "block_count");
+    auto md = get_gguf_metadata(modelPath);
+    return md ? md->block_count : -1;
 }
 
 std::vector<LLModel::GPUDevice> LLamaModel::availableGPUDevices(size_t memoryRequired) const
@@ -573,29 +808,6 @@ bool LLamaModel::usingGPUDevice()
 #endif
 }
 
-void llama_batch_add(
-                 struct llama_batch & batch,
-                        llama_token   id,
-                          llama_pos   pos,
-    const std::vector<llama_seq_id> & seq_ids,
-                               bool   logits) {
-    batch.token   [batch.n_tokens] = id;
-    batch.pos     [batch.n_tokens] = pos;
-    batch.n_seq_id[batch.n_tokens] = seq_ids.size();
-    for (size_t i = 0; i < seq_ids.size(); ++i) {
-        batch.seq_id[batch.n_tokens][i] = seq_ids[i];
-    }
-    batch.logits  [batch.n_tokens] = logits;
-
-    batch.n_tokens++;
-}
-
-static void batch_add_seq(llama_batch &batch, const std::vector<LLModel::Token> &tokens, int seq_id) {
-    for (unsigned i = 0; i < tokens.size(); i++) {
-        llama_batch_add(batch, tokens[i], i, { seq_id }, i == tokens.size() - 1);
-    }
-}
-
 size_t LLamaModel::embeddingSize() const {
     return llama_n_embd(d_ptr->model);
 }
@@ -859,23 +1071,33 @@ void LLamaModel::embedInternal(
         }
     };
 
-    // break into batches
-    for (auto &inp: batches) {
-        // encode if at capacity
-        if (batch.n_tokens + inp.batch.size() > n_batch) {
-            decode();
-            batch.n_tokens = 0;
-            queued_indices.clear();
+    // pack the sequences into as few batches as possible: each batch starts with the longest sequence
+    // left and is topped up with the longest ones that still fit
+    std::vector<size_t> order(batches.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&batches](size_t a, size_t b) {
+        return batches[a].batch.size() > batches[b].batch.size();
+    });
+
+    while (!order.empty()) {
+        batch.n_tokens = 0;
+        queued_indices.clear();
+
+        auto it = order.begin();
+        while (it != order.end() && batch.n_tokens < n_batch) {
+            auto &inp = batches[*it];
+            if (batch.n_tokens + inp.batch.size() > n_batch) {
+                ++it;
+                continue;
+            }
+            batch_add_seq(batch, inp.batch, queued_indices.size());
+            queued_indices.push_back(inp.idx);
+            it = order.erase(it);
         }
 
-        // add to batch
-        batch_add_seq(batch, inp.batch, queued_indices.size());
-        queued_indices.push_back(inp.idx);
+        decode();
     }
 
-    // final batch
-    decode();
-
     for (unsigned i = 0; i < texts.size(); i++) {
         auto *embd = &embeddingsSum[i * n_embd];
         auto *embd_end = embd + dimensionality;
@@ -911,24 +1133,24 @@ DLL_EXPORT const char *get_build_variant() {
 }
 
 DLL_EXPORT bool magic_match(const char *fname) {
-    auto * ctx = load_gguf(fname);
-    std::string arch = get_arch_name(ctx);
-
-    bool valid = true;
+    auto md = cached_gguf_metadata(fname);
+    if (!md || !md->valid)
+        return false;
 
-    if (std::find(KNOWN_ARCHES.begin(), KNOWN_ARCHES.end(), arch) == KNOWN_ARCHES.end()) {
+    if (std::find(KNOWN_ARCHES.begin(), KNOWN_ARCHES.end(), md->arch) == KNOWN_ARCHES.end()) {
         // not supported by this version of llama.cpp
-        if (arch != "gptj") { // we support this via another module
-            std::cerr << __func__ << ": unsupported model architecture: " << arch << "\n";
+        if (md->arch != "gptj") { // we support this via another module
+            std::cerr << __func__ << ": unsupported model architecture: " << md->arch << "\n";
         }
-        valid = false;
+        return false;
     }
 
-    if (valid && is_embedding_arch(arch) && gguf_find_key(ctx, (arch + ".pooling_type").c_str()) < 0)
-        valid = false; // old pre-llama.cpp embedding model, e.g. all-MiniLM-L6-v2-f16.gguf
+    // old pre-llama.cpp embedding model, e.g. all-MiniLM-L6-v2-f16.gguf
+    return !is_embedding_arch(md->arch) || md->has_pooling_type;
+}
 
-    gguf_free(ctx);
-    return valid;
+DLL_EXPORT void set_metadata_cache(GGUFMetadataCache *cache) {
+    set_gguf_metadata_cache(cache);
 }
 
 DLL_EXPORT LLModel *construct() {
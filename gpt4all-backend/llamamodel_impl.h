@@ -20,21 +20,27 @@ public:
 
     bool supportsEmbedding() const override { return m_supportsEmbedding; }
     bool supportsCompletion() const override { return m_supportsCompletion; }
-    bool loadModel(const std::string &modelPath, int n_ctx, int ngl) override;
+    bool loadModel(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) override;
     bool isModelBlacklisted(const std::string &modelPath) const override;
     bool isEmbeddingModel(const std::string &modelPath) const override;
     bool isModelLoaded() const override;
-    size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl) override;
+    std::shared_ptr<const ContextFactory> contextFactory() const override;
+    size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) override;
+    bool estimateMemory(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType,
+                        MemoryEstimate &estimate) override;
     size_t stateSize() const override;
     size_t saveState(uint8_t *dest) const override;
-    size_t restoreState(const uint8_t *src) override;
+    size_t restoreState(const uint8_t *src, size_t size) override;
     void setThreadCount(int32_t n_threads) override;
     int32_t threadCount() const override;
+    void setBatchThreadCount(int32_t n_threads) override;
+    int32_t batchThreadCount() const override;
     std::vector<GPUDevice> availableGPUDevices(size_t memoryRequired) const override;
     bool initializeGPUDevice(size_t memoryRequired, const std::string &name) const override;
     bool initializeGPUDevice(int device, std::string *unavail_reason = nullptr) const override;
     bool hasGPUDevice() override;
     bool usingGPUDevice() override;
+    int32_t maxSequences() const override;
 
     size_t embeddingSize() const override;
     // user-specified prefix
@@ -45,6 +51,7 @@ public:
                bool doMean = true, bool atlas = false) override;
 
 private:
+    struct ContextSnapshot;
     std::unique_ptr<LLamaPrivate> d_ptr;
     bool m_supportsEmbedding = false;
     bool m_supportsCompletion = false;
@@ -54,6 +61,11 @@ protected:
     std::string tokenToString(Token id) const override;
     Token sampleToken(PromptContext &ctx) const override;
     bool evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const override;
+    bool supportsSpeculation() const override { return m_supportsCompletion; }
+    bool evalTokensWithLogits(PromptContext &ctx, const std::vector<int32_t> &tokens) const override;
+    bool shiftContext(PromptContext &ctx, int32_t n_keep, int32_t n_discard) const override;
+    bool evalSequences(std::vector<SequenceTokens> &seqs) const override;
+    void assignSequence(PromptContext &ctx, int32_t seq_id) const override;
     int32_t contextLength() const override;
     const std::vector<Token> &endTokens() const override;
     bool shouldAddBOS() const override;
@@ -1,5 +1,6 @@
 #include "llmodel.h"
 #include "dlhandle.h"
+#include "gguf_metadata.h"
 #include "sysinfo.h"
 
 #include <cassert>
@@ -8,9 +9,12 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #ifdef _MSC_VER
@@ -47,6 +51,126 @@ static bool requires_avxonly() {
 #endif
 }
 
+static const char *GGUF_METADATA_MAGIC = "gguf-metadata 1";
+
+// The GGUFMetadataCache of the process, optionally backed by a sidecar file so that it survives
+// restarts. It is leaked like the implementation list and only written by flushMetadataCache.
+class SidecarMetadataCache final : public GGUFMetadataCache {
+public:
+    static SidecarMetadataCache &instance() {
+        static auto *cache = new SidecarMetadataCache;
+        return *cache;
+    }
+
+    std::shared_ptr<const gguf_metadata> get(const std::string &modelPath, Parser parse) override {
+        std::error_code ec;
+        const uint64_t size = std::filesystem::file_size(modelPath, ec);
+        if (ec)
+            return nullptr;
+        const int64_t mtime = std::filesystem::last_write_time(modelPath, ec).time_since_epoch().count();
+        if (ec)
+            return nullptr;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(modelPath);
+        if (it != m_entries.end() && it->second.size == size && it->second.mtime == mtime)
+            return it->second.metadata;
+
+        auto md = std::make_shared<const gguf_metadata>(parse(modelPath));
+        m_entries[modelPath] = { size, mtime, md };
+        m_dirty = true;
+        return md;
+    }
+
+    void setSidecarPath(const std::string &path) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_sidecarPath = path;
+        load();
+    }
+
+    // writes the entries parsed since the last flush, once after a scan rather than on every miss
+    void flush() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_dirty)
+            save();
+    }
+
+private:
+    struct Entry {
+        uint64_t size;
+        int64_t mtime;
+        std::shared_ptr<const gguf_metadata> metadata;
+    };
+
+    // entries already cached take precedence over the file
+    void load() {
+        std::ifstream in(m_sidecarPath);
+        std::string line;
+        if (!std::getline(in, line) || line != GGUF_METADATA_MAGIC)
+            return;
+
+        std::string path;
+        while (std::getline(in, path) && std::getline(in, line)) {
+            std::istringstream fields(line);
+            Entry entry;
+            gguf_metadata md;
+            size_t n_layers = 0;
+            fields >> entry.size >> entry.mtime >> md.valid >> md.blacklisted >> md.has_pooling_type
+                   >> md.context_length >> md.block_count >> md.n_embd >> md.n_head >> md.n_ff >> md.n_embd_k
+                   >> md.n_embd_v >> md.n_vocab >> md.weights >> md.output_weights >> n_layers;
+            md.layer_weights.resize(n_layers);
+            for (auto &w : md.layer_weights)
+                fields >> w;
+            fields >> md.arch;
+            if (fields.fail())
+                return;
+            if (md.arch == "-")
+                md.arch.clear();
+            entry.metadata = std::make_shared<const gguf_metadata>(std::move(md));
+            m_entries.emplace(path, std::move(entry));
+        }
+    }
+
+    // merges with the file first, other processes may share it
+    void save() {
+        if (m_sidecarPath.empty())
+            return;
+        load();
+
+        // every process writes its own file, the last rename wins
+        std::ostringstream tmpPath;
+        tmpPath << m_sidecarPath << "." << std::hex << std::random_device()() << ".tmp";
+        std::ofstream out(tmpPath.str(), std::ios::trunc);
+        out << GGUF_METADATA_MAGIC << "\n";
+        for (const auto &[path, entry] : m_entries) {
+            if (path.find('\n') != std::string::npos)
+                continue;
+            const gguf_metadata &md = *entry.metadata;
+            out << path << "\n" << entry.size << " " << entry.mtime << " " << md.valid << " " << md.blacklisted
+                << " " << md.has_pooling_type << " " << md.context_length << " " << md.block_count << " "
+                << md.n_embd << " " << md.n_head << " " << md.n_ff << " " << md.n_embd_k << " " << md.n_embd_v
+                << " " << md.n_vocab << " " << md.weights << " " << md.output_weights << " "
+                << md.layer_weights.size();
+            for (auto w : md.layer_weights)
+                out << " " << w;
+            out << " " << (md.arch.empty() ? "-" : md.arch) << "\n";
+        }
+        out.close();
+
+        std::error_code ec;
+        if (out.fail() || (std::filesystem::rename(tmpPath.str(), m_sidecarPath, ec), ec)) {
+            std::cerr << "WARNING: failed to write " << m_sidecarPath << "\n";
+            std::filesystem::remove(tmpPath.str(), ec);
+        }
+        m_dirty = false;
+    }
+
+    std::mutex m_mutex;
+    std::string m_sidecarPath;
+    bool m_dirty = false;
+    std::unordered_map<std::string, Entry> m_entries;
+};
+
 LLModel::Implementation::Implementation(Dlhandle &&dlhandle_)
     : m_dlhandle(new Dlhandle(std::move(dlhandle_))) {
     auto get_model_type = m_dlhandle->get<const char *()>("get_model_type");
@@ -59,6 +183,9 @@ LLModel::Implementation::Implementation(Dlhandle &&dlhandle_)
     assert(m_magicMatch);
     m_construct = m_dlhandle->get<LLModel *()>("construct");
     assert(m_construct);
+    auto setMetadataCache = m_dlhandle->get<void(GGUFMetadataCache *)>("set_metadata_cache"); // optional
+    if (setMetadataCache)
+        setMetadataCache(&SidecarMetadataCache::instance());
 }
 
 LLModel::Implementation::Implementation(Implementation &&o)
@@ -156,10 +283,9 @@ LLModel *LLModel::Implementation::construct(const std::string &modelPath, std::s
             if(impl) {
                 LLModel* metalimpl = impl->m_construct();
                 metalimpl->m_implementation = impl;
-                /* TODO(cebtenzzre): after we fix requiredMem, we should change this to happen at
-                 * load time, not construct time. right now n_ctx is incorrectly hardcoded 2048 in
-                 * most (all?) places where this is called, causing underestimation of required
-                 * memory. */
+                /* TODO(cebtenzzre): we should change this to happen at load time, not construct
+                 * time. right now n_ctx is incorrectly hardcoded 2048 in most (all?) places where
+                 * this is called, causing underestimation of required memory. */
                 size_t req_mem = metalimpl->requiredMem(modelPath, n_ctx, 100);
                 float req_to_total = (float) req_mem / (float) total_mem;
                 // on a 16GB M2 Mac a 13B q4_0 (0.52) works for me but a 13B q4_K_M (0.55) does not
@@ -240,3 +366,11 @@ void LLModel::Implementation::setImplementationsSearchPath(const std::string& pa
 const std::string& LLModel::Implementation::implementationsSearchPath() {
     return s_implementations_search_path;
 }
+
+void LLModel::Implementation::setMetadataCachePath(const std::string &path) {
+    SidecarMetadataCache::instance().setSidecarPath(path);
+}
+
+void LLModel::Implementation::flushMetadataCache() {
+    SidecarMetadataCache::instance().flush();
+}
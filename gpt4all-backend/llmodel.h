@@ -1,13 +1,16 @@
 #ifndef LLMODEL_H
 #define LLMODEL_H
 
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <functional>
 #include <limits>
+#include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 #define LLMODEL_MAX_PROMPT_BATCH 128
@@ -17,6 +20,9 @@ class LLModel {
 public:
     using Token = int32_t;
 
+    // Element type of the KV cache, the quantized types trade some quality for memory
+    enum class KVCacheType { F16, Q8_0, Q4_0 };
+
     struct GPUDevice {
         int index;
         int type;
@@ -48,6 +54,10 @@ public:
         static bool isEmbeddingModel(const std::string &modelPath);
         static void setImplementationsSearchPath(const std::string &path);
         static const std::string &implementationsSearchPath();
+        // File in which implementations may keep what they parsed from model headers across runs
+        static void setMetadataCachePath(const std::string &path);
+        // Writes what was parsed since the last flush to that file, nothing else writes it
+        static void flushMetadataCache();
 
     private:
         static LLModel *constructDefaultLlama();
@@ -60,10 +70,63 @@ public:
         Dlhandle *m_dlhandle;
     };
 
+    // The tokens of a context window. Used like a std::vector, but erasing a range moves whichever
+    // side of it is shorter: dropping the oldest tokens, as a full window does for every new one,
+    // only advances the start of the live range, and the storage is compacted once that has passed
+    // half of it. The tokens stay contiguous, so the repeat penalty and the C API can point at them.
+    class TokenHistory {
+    public:
+        using value_type = Token;
+        using iterator = std::vector<Token>::iterator;
+        using const_iterator = std::vector<Token>::const_iterator;
+
+        TokenHistory() = default;
+        TokenHistory(std::vector<Token> tokens): m_tokens(std::move(tokens)) {}
+        operator std::vector<Token>() const { return { begin(), end() }; }
+
+        size_t size() const { return m_tokens.size() - m_head; }
+        bool empty() const { return size() == 0; }
+        Token *data() { return m_tokens.data() + m_head; }
+        const Token *data() const { return m_tokens.data() + m_head; }
+        iterator begin() { return m_tokens.begin() + m_head; }
+        iterator end() { return m_tokens.end(); }
+        const_iterator begin() const { return m_tokens.begin() + m_head; }
+        const_iterator end() const { return m_tokens.end(); }
+        Token &operator[](size_t i) { return m_tokens[m_head + i]; }
+        const Token &operator[](size_t i) const { return m_tokens[m_head + i]; }
+        Token back() const { return m_tokens.back(); }
+
+        void clear() { m_tokens.clear(); m_head = 0; }
+        void push_back(Token t) { m_tokens.push_back(t); }
+        void resize(size_t n) { m_tokens.resize(m_head + n); }
+
+        iterator erase(const_iterator first, const_iterator last)
+        {
+            const size_t before = first - begin(), n = last - first;
+            if (before >= size_t(end() - last))
+                return m_tokens.erase(first, last);
+
+            const iterator dest = m_tokens.begin() + m_head + n;
+            std::move_backward(begin(), begin() + before, dest + before);
+            m_head += n;
+            if (m_head > m_tokens.size() / 2) {
+                m_tokens.erase(m_tokens.begin(), begin());
+                m_head = 0;
+            }
+            return begin() + before;
+        }
+        iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+    private:
+        std::vector<Token> m_tokens;
+        size_t m_head = 0; // number of erased tokens at the start of m_tokens
+    };
+
     struct PromptContext {
         std::vector<float> logits;      // logits of current context
-        std::vector<int32_t> tokens;    // current tokens in the context window
+        TokenHistory tokens;            // current tokens in the context window
         int32_t n_past = 0;             // number of tokens in past conversation
+        int32_t n_cached = 0;           // tokens past n_past restored into the KV cache, reused by the next prompt
         int32_t n_ctx = 0;              // number of tokens possible in context window
         int32_t n_predict = 200;
         int32_t top_k = 40;
@@ -75,6 +138,21 @@ public:
         int32_t repeat_last_n = 64;     // last n tokens to penalize
         float   contextErase = 0.75f;   // percent of context to erase if we exceed the context window
         int32_t n_last_batch_tokens = 0;
+        int32_t seq_id = 0;             // sequence holding this context in the model's KV cache
+        LLModel *draft = nullptr;       // small model sharing the vocabulary that proposes tokens to verify
+        int32_t n_draft = 0;            // tokens to propose per step, 0 disables speculative decoding
+        int32_t n_draft_past = 0;       // number of these tokens the draft model has decoded
+        int32_t n_lookup_ngram = 0;     // without a draft, propose what followed the last n-gram in the context
+        std::vector<std::string> stop;  // sequences that end the response where they occur, not included in it
+    };
+
+    struct ParallelPrompt {
+        std::string prompt;
+        std::string promptTemplate;
+        std::function<bool(int32_t)> promptCallback;
+        std::function<bool(int32_t, const std::string&)> responseCallback;
+        PromptContext *ctx = nullptr;
+        bool special = false;
     };
 
     using ProgressCallback = std::function<bool(float progress)>;
@@ -84,17 +162,59 @@ public:
 
     virtual bool supportsEmbedding() const = 0;
     virtual bool supportsCompletion() const = 0;
-    virtual bool loadModel(const std::string &modelPath, int n_ctx, int ngl) = 0;
+    virtual bool loadModel(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType = KVCacheType::F16) = 0;
     virtual bool isModelBlacklisted(const std::string &modelPath) const { (void)modelPath; return false; };
     virtual bool isEmbeddingModel(const std::string &modelPath) const { (void)modelPath; return false; }
     virtual bool isModelLoaded() const = 0;
-    virtual size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl) = 0;
+    // Creates other models backed by the weights a model has loaded, each with its own context and KV
+    // cache and the settings the model was loaded with. It holds a copy of those settings and keeps the
+    // weights loaded, so it can be used from any thread, while the model is in use or after it is gone.
+    class ContextFactory {
+    public:
+        virtual ~ContextFactory() {}
+        virtual LLModel *createContext() const = 0;
+    };
+    // Returns nullptr if the model isn't loaded or the implementation can't share its weights
+    virtual std::shared_ptr<const ContextFactory> contextFactory() const { return nullptr; }
+    LLModel *createContext() const
+    {
+        auto factory = contextFactory();
+        return factory ? factory->createContext() : nullptr;
+    }
+    virtual size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl,
+                               KVCacheType kvType = KVCacheType::F16) = 0;
+
+    // Memory a model needs with the given settings, read from the file without loading it
+    struct MemoryEstimate {
+        size_t weights = 0;
+        size_t kvCache = 0;             // for n_ctx tokens of the chosen type
+        size_t compute = 0;             // scratch buffers of the compute graph
+        size_t logits = 0;              // output buffers
+        std::vector<size_t> layers;     // weights and KV cache of each repeating layer
+        size_t gpu = 0;                 // the part of the total offloaded with ngl layers
+
+        size_t total() const { return weights + kvCache + compute + logits; }
+    };
+    virtual bool estimateMemory(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType,
+                                MemoryEstimate &estimate)
+    {
+        (void)modelPath;
+        (void)n_ctx;
+        (void)ngl;
+        (void)kvType;
+        (void)estimate;
+        return false;
+    }
+    // stateSize is an upper bound, saveState returns the number of bytes actually written and
+    // restoreState returns 0 if the size bytes at src weren't saved from a compatible model and context
     virtual size_t stateSize() const { return 0; }
     virtual size_t saveState(uint8_t *dest) const { (void)dest; return 0; }
-    virtual size_t restoreState(const uint8_t *src) { (void)src; return 0; }
+    virtual size_t restoreState(const uint8_t *src, size_t size) { (void)src; (void)size; return 0; }
 
     // This method requires the model to return true from supportsCompletion otherwise it will throw
     // an error
+    // responseCallback is called with the text of generated tokens in whole UTF-8 characters, it is held
+    // back while it may begin a stop sequence and a token is skipped if its text goes with a later one
     virtual void prompt(const std::string &prompt,
                         const std::string &promptTemplate,
                         std::function<bool(int32_t)> promptCallback,
@@ -104,6 +224,24 @@ public:
                         bool special = false,
                         std::string *fakeReply = nullptr);
 
+    // Returns the tokens prompt() would decode for the user prompt on an empty context. A context
+    // restored from a saved state can hold some of them past n_past, prompt() then only decodes the
+    // tokens that don't match.
+    std::vector<Token> promptTokens(const std::string &prompt, const std::string &promptTemplate,
+                                    bool special = false);
+
+    // Number of sequences that can be decoded together in one context, see promptParallel
+    virtual int32_t maxSequences() const { return 1; }
+
+    // Continuous batching: runs several prompts at once and packs the pending tokens of every active
+    // sequence into a single decode per step. The context window is split evenly between up to
+    // maxSequences() sequences, and waiting prompts are admitted as soon as a sequence finishes.
+    // Falls back to calling prompt() for each one if the model can't decode sequences together.
+    // The n_ctx, n_predict and n_batch of each context are restored afterwards. A context starts over
+    // if its conversation doesn't fit its share of the window, and is reset once a later prompt takes
+    // over its sequence.
+    virtual void promptParallel(std::vector<ParallelPrompt> &prompts);
+
     virtual size_t embeddingSize() const {
         throw std::logic_error(std::string(implementation().modelType()) + " does not support embeddings");
     }
@@ -114,8 +252,19 @@ public:
     virtual void embed(const std::vector<std::string> &texts, float *embeddings, bool isRetrieval,
                        int dimensionality = -1, bool doMean = true, bool atlas = false);
 
+    // setThreadCount sets the threads used both to process prompts and to generate, setBatchThreadCount
+    // then overrides the former. Prompt processing scales with cores while generation is limited by
+    // memory bandwidth and often gets slower with too many threads.
     virtual void setThreadCount(int32_t n_threads) { (void)n_threads; }
     virtual int32_t threadCount() const { return 1; }
+    virtual void setBatchThreadCount(int32_t n_threads) { (void)n_threads; }
+    virtual int32_t batchThreadCount() const { return threadCount(); }
+
+    // Restricts the CPUs that inference runs on: one per physical core, so SMT siblings aren't shared,
+    // or an explicit set of cores. It is applied to the thread that prompts the model and inherited
+    // by the worker threads it starts. Not supported on macOS.
+    enum class AffinityPolicy { None, PhysicalCores, CoreSet };
+    void setThreadAffinity(AffinityPolicy policy, const std::vector<int> &cores = {});
 
     const Implementation &implementation() const {
         return *m_implementation;
@@ -168,6 +317,36 @@ protected:
         return -1;
     }
 
+    // These are only called when maxSequences() is greater than one. evalSequences decodes the tokens
+    // of all given sequences in one batch, assignSequence moves a context to the given sequence id.
+    struct SequenceTokens {
+        PromptContext *ctx;
+        std::vector<Token> tokens;
+    };
+    virtual bool evalSequences(std::vector<SequenceTokens> &seqs) const { (void)seqs; return false; }
+    virtual void assignSequence(PromptContext &ctx, int32_t seq_id) const { (void)ctx; (void)seq_id; }
+
+    // Speculative decoding. If supportsSpeculation is true, evalTokensWithLogits decodes like evalTokens
+    // but keeps the logits of every token, sampleToken then reads those of token i once
+    // ctx.n_last_batch_tokens is set to i + 1.
+    virtual bool supportsSpeculation() const { return false; }
+    virtual bool evalTokensWithLogits(PromptContext &ctx, const std::vector<int32_t> &tokens) const
+    {
+        (void)ctx;
+        (void)tokens;
+        return false;
+    }
+
+    // Drops n_discard tokens after the first n_keep from the model's memory of the context and moves
+    // the rest down in place. Returns false if the model can't, then the context is re-evaluated.
+    virtual bool shiftContext(PromptContext &ctx, int32_t n_keep, int32_t n_discard) const
+    {
+        (void)ctx;
+        (void)n_keep;
+        (void)n_discard;
+        return false;
+    }
+
     // This is a helper function called from the default implementation of 'prompt' but it can be
     // shared by all base classes so it isn't virtual
     void recalculateContext(PromptContext &promptCtx, std::function<bool(bool)> recalculate);
@@ -191,6 +370,26 @@ protected:
     void generateResponse(std::function<bool(int32_t, const std::string&)> responseCallback,
                           std::function<bool(bool)> recalculateCallback,
                           PromptContext &promptCtx);
+    void draftTokens(PromptContext &promptCtx, Token id, int32_t n_max, std::vector<Token> &batch);
+    void lookupTokens(const PromptContext &promptCtx, Token id, int32_t n_max, std::vector<Token> &batch) const;
+    bool tokenizePrompt(PromptContext &promptCtx, const std::string &prompt, const std::string &promptTemplate,
+                        bool special, std::vector<Token> &embd_inp, std::string &asstSuffix, std::string &err);
+    void applyThreadAffinity();
+
+    // Caches the text of every token for the response stream, the models call this once loaded
+    void buildTokenTextTable(int32_t n_vocab);
+    void appendTokenText(Token id, std::string &text) const;
+
+    // Turns generated tokens into response text, see llmodel_shared.cpp
+    class ResponseStream;
+
+    AffinityPolicy m_affinityPolicy = AffinityPolicy::None;
+    std::vector<int> m_affinityCores;
+    bool m_affinityChanged = false;
+    std::thread::id m_affinityThread; // the thread currently pinned, if any
+    std::vector<int> m_affinitySaved; // the CPUs of that thread before it was pinned
+    std::string m_tokenText;               // text of all tokens of the vocabulary, back to back
+    std::vector<uint32_t> m_tokenTextEnd;  // end of each token's text in m_tokenText
 
 private:
     friend class LLMImplementation;
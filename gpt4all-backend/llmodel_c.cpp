@@ -1,6 +1,7 @@
 #include "llmodel_c.h"
 #include "llmodel.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <iostream>
@@ -49,13 +50,56 @@ void llmodel_model_destroy(llmodel_model model) {
     delete static_cast<LLModelWrapper *>(model);
 }
 
+llmodel_model llmodel_model_create_context(llmodel_model model) {
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    LLModel *llModel = wrapper->llModel->createContext();
+    if (!llModel)
+        return nullptr;
+
+    auto *fres = new LLModelWrapper;
+    fres->llModel = llModel;
+    return fres;
+}
+
 size_t llmodel_required_mem(llmodel_model model, const char *model_path, int n_ctx, int ngl)
+{
+    return llmodel_required_mem2(model, model_path, n_ctx, ngl, LLMODEL_KV_CACHE_F16);
+}
+
+size_t llmodel_required_mem2(llmodel_model model, const char *model_path, int n_ctx, int ngl,
+                             llmodel_kv_cache_type kv_type)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->requiredMem(model_path, n_ctx, ngl, LLModel::KVCacheType(kv_type));
+}
+
+bool llmodel_estimate_memory(llmodel_model model, const char *model_path, int n_ctx, int ngl,
+                             llmodel_kv_cache_type kv_type, llmodel_memory_estimate *estimate,
+                             size_t *layers, size_t layers_size)
 {
     auto *wrapper = static_cast<LLModelWrapper *>(model);
-    return wrapper->llModel->requiredMem(model_path, n_ctx, ngl);
+    LLModel::MemoryEstimate est;
+    if (!wrapper->llModel->estimateMemory(model_path, n_ctx, ngl, LLModel::KVCacheType(kv_type), est))
+        return false;
+
+    estimate->weights = est.weights;
+    estimate->kv_cache = est.kvCache;
+    estimate->compute = est.compute;
+    estimate->logits = est.logits;
+    estimate->gpu = est.gpu;
+    estimate->n_layers = est.layers.size();
+    if (layers)
+        std::copy_n(est.layers.begin(), std::min(layers_size, est.layers.size()), layers);
+    return true;
 }
 
 bool llmodel_loadModel(llmodel_model model, const char *model_path, int n_ctx, int ngl)
+{
+    return llmodel_loadModel2(model, model_path, n_ctx, ngl, LLMODEL_KV_CACHE_F16);
+}
+
+bool llmodel_loadModel2(llmodel_model model, const char *model_path, int n_ctx, int ngl,
+                        llmodel_kv_cache_type kv_type)
 {
     auto *wrapper = static_cast<LLModelWrapper *>(model);
 
@@ -65,7 +109,7 @@ bool llmodel_loadModel(llmodel_model model, const char *model_path, int n_ctx, i
         auto basename = slash == std::string::npos ? modelPath : modelPath.substr(slash + 1);
         std::cerr << "warning: model '" << basename << "' is out-of-date, please check for an updated version\n";
     }
-    return wrapper->llModel->loadModel(modelPath, n_ctx, ngl);
+    return wrapper->llModel->loadModel(modelPath, n_ctx, ngl, LLModel::KVCacheType(kv_type));
 }
 
 bool llmodel_isModelLoaded(llmodel_model model)
@@ -86,10 +130,10 @@ uint64_t llmodel_save_state_data(llmodel_model model, uint8_t *dest)
     return wrapper->llModel->saveState(dest);
 }
 
-uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src)
+uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src, uint64_t size)
 {
     auto *wrapper = static_cast<LLModelWrapper *>(model);
-    return wrapper->llModel->restoreState(src);
+    return wrapper->llModel->restoreState(src, size);
 }
 
 void llmodel_prompt(llmodel_model model, const char *prompt,
@@ -152,6 +196,68 @@ void llmodel_prompt(llmodel_model model, const char *prompt,
     ctx->context_erase = wrapper->promptContext.contextErase;
 }
 
+void llmodel_prompt_parallel(llmodel_model model, const llmodel_parallel_prompt *prompts, size_t n_prompts,
+                             llmodel_parallel_response_callback response_callback)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+
+    // the prompts take over the sequences of the KV cache
+    wrapper->promptContext.tokens.clear();
+    wrapper->promptContext.n_past = 0;
+
+    std::vector<LLModel::PromptContext> contexts(n_prompts);
+    std::vector<LLModel::ParallelPrompt> parallel(n_prompts);
+    for (size_t i = 0; i < n_prompts; i++) {
+        const llmodel_prompt_context *ctx = prompts[i].ctx;
+        auto &promptCtx = contexts[i];
+        promptCtx.n_ctx = ctx->n_ctx;
+        promptCtx.n_predict = ctx->n_predict;
+        promptCtx.top_k = ctx->top_k;
+        promptCtx.top_p = ctx->top_p;
+        promptCtx.min_p = ctx->min_p;
+        promptCtx.temp = ctx->temp;
+        promptCtx.n_batch = ctx->n_batch;
+        promptCtx.repeat_penalty = ctx->repeat_penalty;
+        promptCtx.repeat_last_n = ctx->repeat_last_n;
+        promptCtx.contextErase = ctx->context_erase;
+        promptCtx.stop = wrapper->promptContext.stop;
+
+        auto &p = parallel[i];
+        p.prompt = prompts[i].prompt;
+        p.promptTemplate = prompts[i].prompt_template;
+        p.promptCallback = [](int32_t) { return true; };
+        p.responseCallback = [response_callback, i](int32_t token_id, const std::string &response) {
+            return response_callback(i, token_id, response.c_str());
+        };
+        p.ctx = &promptCtx;
+        p.special = prompts[i].special;
+    }
+
+    wrapper->llModel->promptParallel(parallel);
+}
+
+void llmodel_set_draft_model(llmodel_model model, llmodel_model draft, int32_t n_draft)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    wrapper->promptContext.draft = draft ? static_cast<LLModelWrapper *>(draft)->llModel : nullptr;
+    wrapper->promptContext.n_draft = n_draft;
+    wrapper->promptContext.n_draft_past = 0;
+}
+
+void llmodel_set_prompt_lookup(llmodel_model model, int32_t n_ngram, int32_t n_draft)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    wrapper->promptContext.n_lookup_ngram = n_ngram;
+    if (!wrapper->promptContext.draft)
+        wrapper->promptContext.n_draft = n_draft;
+}
+
+void llmodel_set_stop_sequences(llmodel_model model, const char **stop, size_t n_stop)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    wrapper->promptContext.stop.assign(stop, stop + n_stop);
+}
+
 float *llmodel_embed(
     llmodel_model model, const char **texts, size_t *embedding_size, const char *prefix, int dimensionality,
     bool do_mean, bool atlas, const char **error
@@ -209,6 +315,28 @@ int32_t llmodel_threadCount(llmodel_model model)
     return wrapper->llModel->threadCount();
 }
 
+void llmodel_setBatchThreadCount(llmodel_model model, int32_t n_threads)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    wrapper->llModel->setBatchThreadCount(n_threads);
+}
+
+int32_t llmodel_batchThreadCount(llmodel_model model)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    return wrapper->llModel->batchThreadCount();
+}
+
+void llmodel_setThreadAffinity(llmodel_model model, llmodel_thread_affinity policy, const int32_t *cores,
+                               size_t n_cores)
+{
+    auto *wrapper = static_cast<LLModelWrapper *>(model);
+    std::vector<int> coreSet;
+    if (cores)
+        coreSet.assign(cores, cores + n_cores);
+    wrapper->llModel->setThreadAffinity(LLModel::AffinityPolicy(policy), coreSet);
+}
+
 void llmodel_set_implementation_search_path(const char *path)
 {
     LLModel::Implementation::setImplementationsSearchPath(path);
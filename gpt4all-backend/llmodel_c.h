@@ -23,6 +23,24 @@ extern "C" {
  */
 typedef void *llmodel_model;
 
+/**
+ * Which CPUs the inference threads may run on.
+ */
+enum llmodel_thread_affinity {
+    LLMODEL_AFFINITY_NONE           = 0, // no restriction
+    LLMODEL_AFFINITY_PHYSICAL_CORES = 1, // one CPU per physical core, SMT siblings are left alone
+    LLMODEL_AFFINITY_CORE_SET       = 2, // an explicit set of CPUs
+};
+
+/**
+ * Element type of the KV cache. The quantized types use less memory at some cost in quality.
+ */
+enum llmodel_kv_cache_type {
+    LLMODEL_KV_CACHE_F16  = 0,
+    LLMODEL_KV_CACHE_Q8_0 = 1,
+    LLMODEL_KV_CACHE_Q4_0 = 2,
+};
+
 /**
  * llmodel_prompt_context structure for holding the prompt context.
  * NOTE: The implementation takes care of all the memory handling of the raw logits pointer and the
@@ -47,6 +65,17 @@ struct llmodel_prompt_context {
     float context_erase;    // percent of context to erase if we exceed the context window
 };
 
+/**
+ * A prompt answered by llmodel_prompt_parallel, without any earlier conversation. Only the
+ * sampling settings of ctx are used.
+ */
+struct llmodel_parallel_prompt {
+    const char *prompt;
+    const char *prompt_template;
+    llmodel_prompt_context *ctx;
+    bool special;
+};
+
 struct llmodel_gpu_device {
     int index = 0;
     int type = 0;           // same as VkPhysicalDeviceType
@@ -55,9 +84,23 @@ struct llmodel_gpu_device {
     const char * vendor;
 };
 
+/**
+ * Memory a model needs, as estimated by llmodel_estimate_memory.
+ */
+struct llmodel_memory_estimate {
+    size_t weights;         // all weights
+    size_t kv_cache;        // KV cache for n_ctx tokens
+    size_t compute;         // scratch buffers of the compute graph
+    size_t logits;          // output buffers
+    size_t gpu;             // the part of the total offloaded with ngl layers
+    size_t n_layers;        // number of repeating layers
+};
+
 #ifndef __cplusplus
 typedef struct llmodel_prompt_context llmodel_prompt_context;
+typedef struct llmodel_parallel_prompt llmodel_parallel_prompt;
 typedef struct llmodel_gpu_device llmodel_gpu_device;
+typedef struct llmodel_memory_estimate llmodel_memory_estimate;
 #endif
 
 /**
@@ -71,6 +114,8 @@ typedef bool (*llmodel_prompt_callback)(int32_t token_id);
  * Callback type for response.
  * @param token_id The token id of the response.
  * @param response The response string. NOTE: a token_id of -1 indicates the string is an error string.
+ * The text is only passed on in whole UTF-8 characters and is never empty. It is held back while it
+ * may begin a stop sequence, so a token whose text goes with a later one is not passed on by itself.
  * @return a bool indicating whether the model should keep generating.
  */
 typedef bool (*llmodel_response_callback)(int32_t token_id, const char *response);
@@ -82,6 +127,15 @@ typedef bool (*llmodel_response_callback)(int32_t token_id, const char *response
  */
 typedef bool (*llmodel_recalculate_callback)(bool is_recalculating);
 
+/**
+ * Callback type for the responses of llmodel_prompt_parallel.
+ * @param index The index of the prompt the response belongs to.
+ * @param token_id The token id of the response, -1 if the string is an error string.
+ * @param response The response string.
+ * @return a bool indicating whether the model should keep generating this response.
+ */
+typedef bool (*llmodel_parallel_response_callback)(size_t index, int32_t token_id, const char *response);
+
 /**
  * Create a llmodel instance.
  * Recognises correct model type from file at model_path
@@ -107,6 +161,15 @@ llmodel_model llmodel_model_create2(const char *model_path, const char *build_va
  */
 void llmodel_model_destroy(llmodel_model model);
 
+/**
+ * Create a llmodel instance backed by the weights another one has loaded, with its own context and KV
+ * cache. The weights stay loaded until all instances sharing them are destroyed.
+ * @param model A pointer to a loaded llmodel_model instance.
+ * @return A pointer to the new llmodel_model instance; NULL if the model isn't loaded or can't share its
+ * weights.
+ */
+llmodel_model llmodel_model_create_context(llmodel_model model);
+
 /**
  * Estimate RAM requirement for a model file
  * @param model A pointer to the llmodel_model instance.
@@ -117,6 +180,34 @@ void llmodel_model_destroy(llmodel_model model);
  */
 size_t llmodel_required_mem(llmodel_model model, const char *model_path, int n_ctx, int ngl);
 
+/**
+ * Estimate RAM requirement for a model file with the given KV cache type.
+ * @param model A pointer to the llmodel_model instance.
+ * @param model_path A string representing the path to the model file.
+ * @param n_ctx Maximum size of context window
+ * @param ngl Number of GPU layers to use (Vulkan)
+ * @param kv_type The element type of the KV cache.
+ * @return size greater than 0 if the model was parsed successfully, 0 if file could not be parsed.
+ */
+size_t llmodel_required_mem2(llmodel_model model, const char *model_path, int n_ctx, int ngl,
+                             enum llmodel_kv_cache_type kv_type);
+
+/**
+ * Estimate the memory a model file needs from its tensors, broken down by use and per layer.
+ * @param model A pointer to the llmodel_model instance.
+ * @param model_path A string representing the path to the model file.
+ * @param n_ctx Maximum size of context window
+ * @param ngl Number of GPU layers to use (Vulkan)
+ * @param kv_type The element type of the KV cache.
+ * @param estimate Receives the estimate.
+ * @param layers An optional array receiving the weights and KV cache of each layer, may be NULL.
+ * @param layers_size The number of entries layers has room for.
+ * @return true if the model could be estimated, false if this model type can't or the file could not be parsed.
+ */
+bool llmodel_estimate_memory(llmodel_model model, const char *model_path, int n_ctx, int ngl,
+                             enum llmodel_kv_cache_type kv_type, llmodel_memory_estimate *estimate,
+                             size_t *layers, size_t layers_size);
+
 /**
  * Load a model from a file.
  * @param model A pointer to the llmodel_model instance.
@@ -127,6 +218,18 @@ size_t llmodel_required_mem(llmodel_model model, const char *model_path, int n_c
  */
 bool llmodel_loadModel(llmodel_model model, const char *model_path, int n_ctx, int ngl);
 
+/**
+ * Load a model from a file with the given KV cache type.
+ * @param model A pointer to the llmodel_model instance.
+ * @param model_path A string representing the path to the model file.
+ * @param n_ctx Maximum size of context window
+ * @param ngl Number of GPU layers to use (Vulkan)
+ * @param kv_type The element type of the KV cache, models that don't support it fall back to f16.
+ * @return true if the model was loaded successfully, false otherwise.
+ */
+bool llmodel_loadModel2(llmodel_model model, const char *model_path, int n_ctx, int ngl,
+                        enum llmodel_kv_cache_type kv_type);
+
 /**
  * Check if a model is loaded.
  * @param model A pointer to the llmodel_model instance.
@@ -135,10 +238,10 @@ bool llmodel_loadModel(llmodel_model model, const char *model_path, int n_ctx, i
 bool llmodel_isModelLoaded(llmodel_model model);
 
 /**
- * Get the size of the internal state of the model.
+ * Get the maximum size of the internal state of the model.
  * NOTE: This state data is specific to the type of model you have created.
  * @param model A pointer to the llmodel_model instance.
- * @return the size in bytes of the internal state of the model
+ * @return an upper bound on the size in bytes of the internal state of the model
  */
 uint64_t llmodel_get_state_size(llmodel_model model);
 
@@ -146,7 +249,7 @@ uint64_t llmodel_get_state_size(llmodel_model model);
  * Saves the internal state of the model to the specified destination address.
  * NOTE: This state data is specific to the type of model you have created.
  * @param model A pointer to the llmodel_model instance.
- * @param dest A pointer to the destination.
+ * @param dest A pointer to the destination, at least llmodel_get_state_size bytes large.
  * @return the number of bytes copied
  */
 uint64_t llmodel_save_state_data(llmodel_model model, uint8_t *dest);
@@ -156,9 +259,38 @@ uint64_t llmodel_save_state_data(llmodel_model model, uint8_t *dest);
  * NOTE: This state data is specific to the type of model you have created.
  * @param model A pointer to the llmodel_model instance.
  * @param src A pointer to the src.
- * @return the number of bytes read
+ * @param size The number of bytes at src, as returned by llmodel_save_state_data.
+ * @return the number of bytes read, 0 if the state was saved from an incompatible model or context
  */
-uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src);
+uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src, uint64_t size);
+
+/**
+ * Use a draft model for speculative decoding: it proposes up to n_draft tokens at a time, which the
+ * model verifies in one pass. The draft must share the model's vocabulary and stay loaded while it is
+ * in use. Models that can't verify several tokens at once ignore it.
+ * @param model A pointer to the llmodel_model instance.
+ * @param draft A pointer to the draft llmodel_model instance, or NULL to stop using one.
+ * @param n_draft The number of tokens to propose per step, 0 disables speculative decoding.
+ */
+void llmodel_set_draft_model(llmodel_model model, llmodel_model draft, int32_t n_draft);
+
+/**
+ * Speculate without a draft model while none is set: propose up to n_draft tokens copied from what
+ * followed the last occurrence of the context's final n-gram. Suits responses that quote the prompt.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_ngram The longest n-gram to look up, 0 disables prompt lookup.
+ * @param n_draft The number of tokens to propose per step.
+ */
+void llmodel_set_prompt_lookup(llmodel_model model, int32_t n_ngram, int32_t n_draft);
+
+/**
+ * Set the stop sequences of the following prompts. The response ends where one of them occurs, the
+ * stop sequence itself is not passed to the response callback.
+ * @param model A pointer to the llmodel_model instance.
+ * @param stop An array of null-terminated UTF-8 strings.
+ * @param n_stop The number of strings in stop, 0 to clear them.
+ */
+void llmodel_set_stop_sequences(llmodel_model model, const char **stop, size_t n_stop);
 
 /**
  * Generate a response using the model.
@@ -181,6 +313,19 @@ void llmodel_prompt(llmodel_model model, const char *prompt,
                     bool special,
                     const char *fake_reply);
 
+/**
+ * Generate responses to several prompts at once. The tokens of all prompts that are being answered
+ * are decoded together, so a long prompt or response doesn't hold up the others. The context window
+ * is split evenly between the prompts answered at the same time, and the model's earlier conversation
+ * is discarded. Models that can't decode prompts together answer them one after the other.
+ * @param model A pointer to the llmodel_model instance.
+ * @param prompts An array of the prompts to answer.
+ * @param n_prompts The number of prompts.
+ * @param response_callback A callback function for handling the generated responses.
+ */
+void llmodel_prompt_parallel(llmodel_model model, const llmodel_parallel_prompt *prompts, size_t n_prompts,
+                             llmodel_parallel_response_callback response_callback);
+
 /**
  * Generate an embedding using the model.
  * NOTE: If given NULL pointers for the model or text, or an empty text, a NULL pointer will be
@@ -224,6 +369,31 @@ void llmodel_setThreadCount(llmodel_model model, int32_t n_threads);
  */
 int32_t llmodel_threadCount(llmodel_model model);
 
+/**
+ * Set the number of threads used to process prompts, after llmodel_setThreadCount which sets both.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_threads The number of threads to be used.
+ */
+void llmodel_setBatchThreadCount(llmodel_model model, int32_t n_threads);
+
+/**
+ * Get the number of threads used to process prompts.
+ * @param model A pointer to the llmodel_model instance.
+ * @return The number of threads used to process prompts.
+ */
+int32_t llmodel_batchThreadCount(llmodel_model model);
+
+/**
+ * Restrict the CPUs the model's inference threads run on. Takes effect on the next prompt, on the
+ * thread that calls it. Not supported on macOS.
+ * @param model A pointer to the llmodel_model instance.
+ * @param policy Which CPUs to use.
+ * @param cores The CPUs to use with LLMODEL_AFFINITY_CORE_SET, ignored otherwise.
+ * @param n_cores The number of entries in cores.
+ */
+void llmodel_setThreadAffinity(llmodel_model model, enum llmodel_thread_affinity policy, const int32_t *cores,
+                               size_t n_cores);
+
 /**
  * Set llmodel implementation search path.
  * Default is "."
@@ -1,18 +1,162 @@
 #include "llmodel.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <fstream>
 #include <iostream>
 #include <regex>
 #include <string>
-#include <unordered_set>
 
-// TODO(cebtenzzre): replace this with llama_kv_cache_seq_shift for llamamodel (GPT-J needs this as-is)
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+// The lowest numbered CPU of each physical core, empty if the topology can't be read
+static std::vector<int> physical_cores()
+{
+    std::vector<int> cores;
+#ifdef __linux__
+    const long n_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (int cpu = 0; cpu < n_cpus && cpu < CPU_SETSIZE; cpu++) {
+        // a list like "0,8" or "0-1", offline CPUs have none
+        std::ifstream siblings("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list");
+        int first;
+        if (siblings >> first && first == cpu)
+            cores.push_back(cpu);
+    }
+#elif defined(_WIN32)
+    DWORD size = 0;
+    GetLogicalProcessorInformation(nullptr, &size);
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(size / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (GetLogicalProcessorInformation(info.data(), &size)) {
+        for (auto &proc : info) {
+            if (proc.Relationship != RelationProcessorCore || !proc.ProcessorMask)
+                continue;
+            int cpu = 0;
+            while (!(proc.ProcessorMask & (ULONG_PTR(1) << cpu)))
+                cpu++;
+            cores.push_back(cpu);
+        }
+    }
+#endif
+    return cores;
+}
+
+// Restricts the calling thread to the given CPUs, or lets it run anywhere if there are none. The CPUs
+// it could run on before are stored in previous, if given.
+static bool set_thread_affinity(const std::vector<int> &cpus, std::vector<int> *previous = nullptr)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    if (previous) {
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+            return false;
+        previous->clear();
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                previous->push_back(cpu);
+        }
+    }
+    CPU_ZERO(&set);
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &set);
+    }
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    DWORD_PTR processMask, systemMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+        return false;
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < int(8 * sizeof(mask)))
+            mask |= DWORD_PTR(1) << cpu;
+    }
+    const DWORD_PTR oldMask = SetThreadAffinityMask(GetCurrentThread(), cpus.empty() ? processMask : mask & processMask);
+    if (!oldMask)
+        return false;
+    if (previous) {
+        previous->clear();
+        for (int cpu = 0; cpu < int(8 * sizeof(oldMask)); cpu++) {
+            if (oldMask & (DWORD_PTR(1) << cpu))
+                previous->push_back(cpu);
+        }
+    }
+    return true;
+#else
+    (void)cpus;
+    (void)previous;
+    return false;
+#endif
+}
+
+void LLModel::setThreadAffinity(AffinityPolicy policy, const std::vector<int> &cores)
+{
+    if (policy == m_affinityPolicy && cores == m_affinityCores)
+        return;
+    m_affinityPolicy = policy;
+    m_affinityCores = cores;
+    m_affinityChanged = true;
+}
+
+void LLModel::applyThreadAffinity()
+{
+    const auto thread = std::this_thread::get_id();
+    if (!m_affinityChanged && thread == m_affinityThread)
+        return;
+    m_affinityChanged = false;
+
+    // nothing to undo if this thread was never pinned
+    if (m_affinityPolicy == AffinityPolicy::None && thread != m_affinityThread)
+        return;
+
+    std::vector<int> cpus;
+    if (m_affinityPolicy == AffinityPolicy::PhysicalCores)
+        cpus = physical_cores();
+    else if (m_affinityPolicy == AffinityPolicy::CoreSet)
+        cpus = m_affinityCores;
+
+    if (m_affinityPolicy != AffinityPolicy::None && cpus.empty()) {
+        std::cerr << implementation().modelType() << " WARNING: no CPUs to pin the inference threads to\n";
+        return;
+    }
+    // the thread gets back the CPUs it had before it was first pinned
+    if (m_affinityPolicy == AffinityPolicy::None)
+        cpus = m_affinitySaved;
+    const bool firstPin = m_affinityPolicy != AffinityPolicy::None && thread != m_affinityThread;
+    if (!set_thread_affinity(cpus, firstPin ? &m_affinitySaved : nullptr)) {
+        std::cerr << implementation().modelType() << " WARNING: failed to set the thread affinity\n";
+        return;
+    }
+    m_affinityThread = m_affinityPolicy == AffinityPolicy::None ? std::thread::id() : thread;
+}
+
 void LLModel::recalculateContext(PromptContext &promptCtx, std::function<bool(bool)> recalculate) {
     int n_keep = shouldAddBOS();
     const int32_t n_discard = (promptCtx.n_ctx - n_keep) * promptCtx.contextErase;
 
+    // Slide the window in place if the model supports it, nothing needs to be recomputed
+    const int32_t n_shift = std::min(n_discard, promptCtx.n_past - n_keep);
+    if (int32_t(promptCtx.tokens.size()) == promptCtx.n_past && n_shift > 0
+        && shiftContext(promptCtx, n_keep, n_shift)) {
+        promptCtx.tokens.erase(promptCtx.tokens.begin() + n_keep, promptCtx.tokens.begin() + n_keep + n_shift);
+        promptCtx.n_past -= n_shift;
+        promptCtx.n_draft_past = 0;
+        return;
+    }
+
     // Erase the first percentage of context from the tokens
     std::cerr << implementation().modelType() << ": reached the end of the context window so resizing\n";
+    promptCtx.n_draft_past = 0;
     promptCtx.tokens.erase(promptCtx.tokens.begin() + n_keep, promptCtx.tokens.begin() + n_keep + n_discard);
 
     size_t i = n_keep;
@@ -58,42 +202,18 @@ static bool parsePromptTemplate(const std::string &tmpl, std::vector<std::smatch
     return true;
 }
 
-void LLModel::prompt(const std::string &prompt,
-                     const std::string &promptTemplate,
-                     std::function<bool(int32_t)> promptCallback,
-                     std::function<bool(int32_t, const std::string&)> responseCallback,
-                     std::function<bool(bool)> recalculateCallback,
-                     PromptContext &promptCtx,
-                     bool special,
-                     std::string *fakeReply)
+bool LLModel::tokenizePrompt(PromptContext &promptCtx, const std::string &prompt, const std::string &promptTemplate,
+                             bool special, std::vector<Token> &embd_inp, std::string &asstSuffix, std::string &err)
 {
-    if (!isModelLoaded()) {
-        std::cerr << implementation().modelType() << " ERROR: prompt won't work with an unloaded model!\n";
-        return;
-    }
-
-    if (!supportsCompletion()) {
-        std::string errorMessage = "ERROR: this model does not support text completion or chat!";
-        responseCallback(-1, errorMessage);
-        std::cerr << implementation().modelType() << " " << errorMessage << "\n";
-        return;
-    }
-
     // parse the prompt template
     std::vector<std::smatch> placeholders;
-    {
-        std::string err;
-        if (!parsePromptTemplate(promptTemplate, placeholders, err)) {
-            responseCallback(-1, err);
-            std::cerr << err << "\n";
-            return;
-        }
-    }
+    if (!parsePromptTemplate(promptTemplate, placeholders, err))
+        return false;
 
     auto old_n_past = promptCtx.n_past; // prepare to fake n_past for tokenize
 
     // tokenize the user prompt
-    std::vector<Token> embd_inp;
+    embd_inp.clear();
     if (placeholders.empty()) {
         // this is unusual, but well-defined
         std::cerr << __func__ << ": prompt template has no placeholder\n";
@@ -125,6 +245,89 @@ void LLModel::prompt(const std::string &prompt,
 
     promptCtx.n_past = old_n_past; // restore n_past so decodePrompt can increment it
 
+    // template: end of assistant prompt
+    if (placeholders.size() >= 2) {
+        size_t start = placeholders[1].position() + placeholders[1].length();
+        asstSuffix = promptTemplate.substr(start);
+    } else {
+        asstSuffix = "\n\n"; // default to a blank link, good for e.g. Alpaca
+    }
+    return true;
+}
+
+std::vector<LLModel::Token> LLModel::promptTokens(const std::string &prompt, const std::string &promptTemplate,
+                                                  bool special)
+{
+    PromptContext promptCtx;
+    std::vector<Token> embd_inp;
+    std::string asstSuffix;
+    std::string err;
+    if (!tokenizePrompt(promptCtx, prompt, promptTemplate, special, embd_inp, asstSuffix, err)) {
+        std::cerr << err << "\n";
+        return {};
+    }
+    return embd_inp;
+}
+
+void LLModel::prompt(const std::string &prompt,
+                     const std::string &promptTemplate,
+                     std::function<bool(int32_t)> promptCallback,
+                     std::function<bool(int32_t, const std::string&)> responseCallback,
+                     std::function<bool(bool)> recalculateCallback,
+                     PromptContext &promptCtx,
+                     bool special,
+                     std::string *fakeReply)
+{
+    if (!isModelLoaded()) {
+        std::cerr << implementation().modelType() << " ERROR: prompt won't work with an unloaded model!\n";
+        return;
+    }
+
+    if (!supportsCompletion()) {
+        std::string errorMessage = "ERROR: this model does not support text completion or chat!";
+        responseCallback(-1, errorMessage);
+        std::cerr << implementation().modelType() << " " << errorMessage << "\n";
+        return;
+    }
+
+    applyThreadAffinity();
+
+    // the caller may have rolled the context back since the draft model last saw it
+    promptCtx.n_draft_past = std::min(promptCtx.n_draft_past, promptCtx.n_past);
+
+    // tokenize the user prompt
+    std::vector<Token> embd_inp;
+    std::string asstSuffix;
+    {
+        std::string err;
+        if (!tokenizePrompt(promptCtx, prompt, promptTemplate, special, embd_inp, asstSuffix, err)) {
+            responseCallback(-1, err);
+            std::cerr << err << "\n";
+            return;
+        }
+    }
+
+    // a context restored from a saved state holds n_cached tokens past n_past in the KV cache, keep the
+    // ones that match the start of this prompt instead of decoding them again
+    size_t n_cached = 0;
+    if (promptCtx.tokens.size() > size_t(promptCtx.n_past)) {
+        n_cached = std::min(size_t(std::max(promptCtx.n_cached, 0)), promptCtx.tokens.size() - promptCtx.n_past);
+        promptCtx.tokens.resize(promptCtx.n_past + n_cached);
+    }
+    promptCtx.n_cached = 0;
+    if (n_cached && !embd_inp.empty()) {
+        auto cached = promptCtx.tokens.begin() + promptCtx.n_past;
+        size_t n_match = std::mismatch(cached, promptCtx.tokens.end(), embd_inp.begin(), embd_inp.end()).first - cached;
+        n_match = std::min(n_match, embd_inp.size() - 1); // the last token is decoded for its logits
+        promptCtx.tokens.resize(promptCtx.n_past + n_match);
+        for (size_t i = 0; i < n_match; i++) {
+            promptCtx.n_past += 1;
+            if (!promptCallback(embd_inp[i]))
+                return;
+        }
+        embd_inp.erase(embd_inp.begin(), embd_inp.begin() + n_match);
+    }
+
     // decode the user prompt
     decodePrompt(promptCallback, responseCallback, recalculateCallback, promptCtx, embd_inp);
 
@@ -137,14 +340,6 @@ void LLModel::prompt(const std::string &prompt,
     }
 
     // decode the rest of the prompt template
-    // template: end of assistant prompt
-    std::string asstSuffix;
-    if (placeholders.size() >= 2) {
-        size_t start = placeholders[1].position() + placeholders[1].length();
-        asstSuffix = promptTemplate.substr(start);
-    } else {
-        asstSuffix = "\n\n"; // default to a blank link, good for e.g. Alpaca
-    }
     if (!asstSuffix.empty()) {
         embd_inp = tokenize(promptCtx, asstSuffix, true);
         decodePrompt(promptCallback, responseCallback, recalculateCallback, promptCtx, embd_inp);
@@ -189,8 +384,10 @@ void LLModel::decodePrompt(std::function<bool(int32_t)> promptCallback,
 
         size_t tokens = batch_end - i;
         for (size_t t = 0; t < tokens; ++t) {
-            if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx)
+            if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx) {
                 promptCtx.tokens.erase(promptCtx.tokens.begin());
+                promptCtx.n_draft_past = 0;
+            }
             promptCtx.tokens.push_back(batch.at(t));
             promptCtx.n_past += 1;
             if (!promptCallback(batch.at(t)))
@@ -200,19 +397,243 @@ void LLModel::decodePrompt(std::function<bool(int32_t)> promptCallback,
     }
 }
 
+static const std::vector<std::string> reversePrompts
+    = { "### Instruction", "### Prompt", "### Response", "### Human", "### Assistant", "### Context" };
+
+// Aho-Corasick automaton over the bytes of a set of stop sequences, fed the response a byte at a time
+class StopMatcher {
+public:
+    explicit StopMatcher(const std::vector<std::string> &patterns)
+        : m_nodes(1)
+    {
+        for (const auto &pattern : patterns) {
+            int32_t node = 0;
+            for (unsigned char c : pattern) {
+                if (!m_nodes[node].next[c]) {
+                    m_nodes[node].next[c] = m_nodes.size();
+                    m_nodes.emplace_back();
+                    m_nodes.back().depth = m_nodes[node].depth + 1;
+                }
+                node = m_nodes[node].next[c];
+            }
+            m_nodes[node].match = pattern.size();
+        }
+
+        // breadth first, so that the node a failure link points to is complete
+        std::vector<int32_t> queue;
+        for (int32_t c = 0; c < 256; c++) {
+            if (m_nodes[0].next[c])
+                queue.push_back(m_nodes[0].next[c]);
+        }
+        for (size_t i = 0; i < queue.size(); i++) {
+            Node &node = m_nodes[queue[i]];
+            // the longest stop sequence ending here starts first
+            if (!node.match)
+                node.match = m_nodes[node.fail].match;
+            for (int32_t c = 0; c < 256; c++) {
+                const int32_t fallback = m_nodes[node.fail].next[c];
+                if (node.next[c]) {
+                    m_nodes[node.next[c]].fail = fallback;
+                    queue.push_back(node.next[c]);
+                } else {
+                    node.next[c] = fallback;
+                }
+            }
+        }
+    }
+
+    // Returns the length of the stop sequence the byte completes, 0 if none
+    uint32_t feed(char c)
+    {
+        m_state = m_nodes[m_state].next[static_cast<unsigned char>(c)];
+        return m_nodes[m_state].match;
+    }
+
+    // Number of the last bytes fed that could still begin a stop sequence
+    uint32_t pending() const { return m_nodes[m_state].depth; }
+
+private:
+    struct Node {
+        std::array<int32_t, 256> next {};
+        int32_t fail = 0;
+        uint32_t depth = 0;
+        uint32_t match = 0;
+    };
+    std::vector<Node> m_nodes;
+    int32_t m_state = 0;
+};
+
+// Length of the longest prefix of text that doesn't end in an incomplete UTF-8 sequence
+static size_t utf8CompletePrefix(std::string_view text)
+{
+    for (size_t i = 1; i <= std::min<size_t>(4, text.size()); i++) {
+        const unsigned char c = text[text.size() - i];
+        if ((c & 0xC0) == 0x80)
+            continue;
+        const size_t len = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return len > i ? text.size() - i : text.size();
+    }
+    return text.size(); // stray continuation bytes, nothing to wait for
+}
+
+// Passes generated tokens on to the response callback. The text of a token is held back while it
+// could still be the start of a stop sequence or ends in an incomplete UTF-8 sequence, and a token
+// whose text ends up with the next one isn't passed on by itself. Tokens from the start of a stop
+// sequence on are not passed on.
+class LLModel::ResponseStream {
+public:
+    ResponseStream(const LLModel &model, const std::vector<std::string> &stop,
+                   std::function<bool(int32_t, const std::string&)> callback)
+        : m_model(&model)
+        , m_matcher(withReversePrompts(stop))
+        , m_callback(std::move(callback))
+    {
+    }
+
+    // Adds a generated token, returns false once the response is complete
+    bool push(Token id)
+    {
+        const size_t start = m_text.size();
+        m_model->appendTokenText(id, m_text);
+        m_held.push_back({ id, m_text.size() });
+
+        for (size_t i = start; i < m_text.size(); i++) {
+            if (const uint32_t n = m_matcher.feed(m_text[i])) {
+                // the token the stop sequence starts in keeps the text before it
+                const size_t stopStart = i + 1 - n;
+                size_t n_keep = 0;
+                while (n_keep < m_held.size() && (n_keep ? m_held[n_keep - 1].end : 0) < stopStart)
+                    n_keep++;
+                m_dropped = m_held.size() - n_keep;
+                release(n_keep, stopStart);
+                return false;
+            }
+        }
+
+        const size_t settled = utf8CompletePrefix(std::string_view(m_text).substr(0, m_text.size() - m_matcher.pending()));
+        size_t n = 0;
+        while (n < m_held.size() && m_held[n].end <= settled)
+            n++;
+        return release(n, settled, false /*all*/);
+    }
+
+    // Passes on the held back tokens once generation stops for another reason
+    void flush() { release(m_held.size(), m_text.size()); }
+
+    // Number of tokens dropped at the end of the response because a stop sequence starts in them
+    size_t dropped() const { return m_dropped; }
+
+private:
+    static std::vector<std::string> withReversePrompts(std::vector<std::string> stop)
+    {
+        stop.insert(stop.end(), reversePrompts.begin(), reversePrompts.end());
+        return stop;
+    }
+
+    // Passes on the first n held tokens with the text up to limit, if all is false the text of each
+    // ends at its last complete character
+    bool release(size_t n, size_t limit, bool all = true)
+    {
+        bool keepGoing = true;
+        size_t pos = 0;
+        for (size_t i = 0; i < n && keepGoing; i++) {
+            size_t end = std::min(m_held[i].end, limit);
+            if (!all || i + 1 < n)
+                end = std::max(pos, utf8CompletePrefix(std::string_view(m_text).substr(0, end)));
+            if (end > pos)
+                keepGoing = m_callback(m_held[i].id, m_text.substr(pos, end - pos));
+            pos = end;
+        }
+
+        m_text.erase(0, pos);
+        m_held.erase(m_held.begin(), m_held.begin() + n);
+        for (auto &held : m_held)
+            held.end -= pos;
+        return keepGoing;
+    }
+
+    struct Held {
+        Token id;
+        size_t end; // end of its text in m_text
+    };
+
+    const LLModel *m_model;
+    StopMatcher m_matcher;
+    std::function<bool(int32_t, const std::string&)> m_callback;
+    std::string m_text;             // text not passed on yet
+    std::vector<Held> m_held;
+    size_t m_dropped = 0;
+};
+
+void LLModel::buildTokenTextTable(int32_t n_vocab)
+{
+    m_tokenText.clear();
+    m_tokenTextEnd.clear();
+    m_tokenTextEnd.reserve(n_vocab);
+    for (Token id = 0; id < n_vocab; id++) {
+        m_tokenText += tokenToString(id);
+        m_tokenTextEnd.push_back(m_tokenText.size());
+    }
+}
+
+void LLModel::appendTokenText(Token id, std::string &text) const
+{
+    if (id < 0 || size_t(id) >= m_tokenTextEnd.size()) {
+        text += tokenToString(id);
+        return;
+    }
+    const uint32_t start = id ? m_tokenTextEnd[id - 1] : 0;
+    text.append(m_tokenText, start, m_tokenTextEnd[id] - start);
+}
+
 void LLModel::generateResponse(std::function<bool(int32_t, const std::string&)> responseCallback,
                                std::function<bool(bool)> recalculateCallback,
                                PromptContext &promptCtx) {
-    std::string cachedResponse;
-    std::vector<Token> cachedTokens;
-    std::unordered_set<std::string> reversePrompts
-        = { "### Instruction", "### Prompt", "### Response", "### Human", "### Assistant", "### Context" };
+    ResponseStream stream(*this, promptCtx.stop, responseCallback);
+
+    // Tokens join the context once decoded, tokens that turn out not to belong to the response are
+    // dropped again and overwritten by the next decode
+    auto pushToken = [&promptCtx](Token id) {
+        if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx) {
+            promptCtx.tokens.erase(promptCtx.tokens.begin());
+            promptCtx.n_draft_past = 0;
+        }
+        promptCtx.tokens.push_back(id);
+        promptCtx.n_past += 1;
+    };
+    auto dropTokens = [&promptCtx](size_t n) {
+        promptCtx.n_past -= n;
+        promptCtx.tokens.resize(promptCtx.tokens.size() - std::min(n, promptCtx.tokens.size()));
+        promptCtx.n_draft_past = std::min(promptCtx.n_draft_past, promptCtx.n_past);
+    };
+
+    // Handles a decoded token, returns false once the response is complete
+    auto handleToken = [&](Token id) -> bool {
+        const auto &endToks = endTokens();
+        if (std::find(endToks.begin(), endToks.end(), id) != endToks.end()) {
+            dropTokens(1);
+            stream.flush();
+            return false;
+        }
+
+        if (!stream.push(id)) {
+            dropTokens(stream.dropped());
+            return false;
+        }
+        return true;
+    };
+
+    const bool speculate = promptCtx.n_draft > 0 && (promptCtx.draft || promptCtx.n_lookup_ngram > 0)
+        && supportsSpeculation();
+    std::vector<Token> batch;
+    std::optional<Token> next;
 
     // predict next tokens
-    for (int i = 0; i < promptCtx.n_predict; i++) {
+    for (int n_predicted = 0; n_predicted < promptCtx.n_predict;) {
 
         // sample next token
-        auto id = sampleToken(promptCtx);
+        const Token id = next ? *next : sampleToken(promptCtx);
+        next.reset();
 
         // Check if the context has run out...
         if (promptCtx.n_past + 1 > promptCtx.n_ctx) {
@@ -220,52 +641,319 @@ void LLModel::generateResponse(std::function<bool(int32_t, const std::string&)>
             assert(promptCtx.n_past + 1 <= promptCtx.n_ctx);
         }
 
-        if (!evalTokens(promptCtx, { id })) {
+        // propose the tokens that may follow it
+        batch.assign(1, id);
+        if (speculate) {
+            const int32_t n_max = std::min({ promptCtx.n_draft, promptCtx.n_predict - n_predicted - 1,
+                                             promptCtx.n_ctx - promptCtx.n_past - 1 });
+            if (promptCtx.draft)
+                draftTokens(promptCtx, id, n_max, batch);
+            else
+                lookupTokens(promptCtx, id, n_max, batch);
+        }
+
+        if (batch.size() == 1) {
+            if (!evalTokens(promptCtx, batch)) {
+                std::cerr << implementation().modelType() << " ERROR: Failed to predict next token\n";
+                return;
+            }
+            pushToken(id);
+            n_predicted++;
+            if (!handleToken(id))
+                return;
+            continue;
+        }
+
+        // decode the proposal in one pass, each proposed token is kept while it is what the model
+        // samples after the tokens before it
+        if (!evalTokensWithLogits(promptCtx, batch)) {
             std::cerr << implementation().modelType() << " ERROR: Failed to predict next token\n";
             return;
         }
+        for (size_t i = 0; i < batch.size(); i++) {
+            pushToken(batch[i]);
+            n_predicted++;
+            if (!handleToken(batch[i]))
+                return;
+            if (n_predicted == promptCtx.n_predict)
+                break;
+            promptCtx.n_last_batch_tokens = i + 1;
+            next = sampleToken(promptCtx);
+            if (i + 1 == batch.size() || *next != batch[i + 1])
+                break;
+            next.reset();
+        }
+    }
+
+    // out of tokens to predict
+    stream.flush();
+}
+
+// Proposes up to n_max tokens to follow id with the context's draft model, which first decodes the
+// part of the context it hasn't seen yet. The proposals are appended to batch.
+void LLModel::draftTokens(PromptContext &promptCtx, Token id, int32_t n_max, std::vector<Token> &batch)
+{
+    LLModel *draft = promptCtx.draft;
+    if (!draft || n_max <= 0 || !draft->isModelLoaded() || !draft->supportsCompletion())
+        return;
+
+    // the draft decodes the same positions, so it needs as large a window
+    PromptContext draftCtx;
+    draftCtx.n_ctx = draft->contextLength();
+    if (promptCtx.n_past + 1 + n_max > draftCtx.n_ctx || int32_t(promptCtx.tokens.size()) != promptCtx.n_past)
+        return;
 
-        // display text
-        for (const auto token : endTokens()) {
-            if (id == token) return;
+    // propose the most likely tokens
+    draftCtx.top_k = 1;
+    draftCtx.temp = 0.0f;
+    draftCtx.repeat_penalty = 1.0f;
+
+    draftCtx.n_past = std::min(promptCtx.n_draft_past, promptCtx.n_past);
+    std::vector<Token> pending(promptCtx.tokens.begin() + draftCtx.n_past, promptCtx.tokens.end());
+    pending.push_back(id);
+    for (size_t i = 0; i < pending.size(); i += LLMODEL_MAX_PROMPT_BATCH) {
+        const size_t end = std::min(i + LLMODEL_MAX_PROMPT_BATCH, pending.size());
+        if (!draft->evalTokens(draftCtx, std::vector<Token>(pending.begin() + i, pending.begin() + end))) {
+            promptCtx.n_draft_past = 0;
+            return;
         }
+        draftCtx.n_past += end - i;
+    }
+    // id is always kept, the proposals are decoded again next time if they are too
+    promptCtx.n_draft_past = draftCtx.n_past;
+
+    const auto &draftEnd = draft->endTokens();
+    for (int32_t i = 0; i < n_max; i++) {
+        const Token t = draft->sampleToken(draftCtx);
+        batch.push_back(t);
+        if (i + 1 == n_max || std::find(draftEnd.begin(), draftEnd.end(), t) != draftEnd.end())
+            break;
+        if (!draft->evalTokens(draftCtx, { t }))
+            break;
+        draftCtx.n_past += 1;
+    }
+}
+
+// Proposes up to n_max tokens to follow id by finding the last earlier occurrence of the context's
+// final n-gram, ending in id, and copying what followed it. Falls back to shorter n-grams down to a
+// single token. Costs nothing but a scan of the context, and pays off where the response quotes it.
+void LLModel::lookupTokens(const PromptContext &promptCtx, Token id, int32_t n_max, std::vector<Token> &batch) const
+{
+    const auto &tokens = promptCtx.tokens;
+    const int32_t n_tokens = tokens.size();
+    if (n_max <= 0 || n_tokens == 0)
+        return;
 
-        const std::string str = tokenToString(id);
+    // the n-gram is the last n - 1 tokens of the context followed by id
+    for (int32_t n = std::min(promptCtx.n_lookup_ngram, n_tokens); n > 0; n--) {
+        const auto ngramBegin = tokens.end() - (n - 1);
+        for (int32_t start = n_tokens - n - 1; start >= 0; start--) {
+            if (tokens[start + n - 1] != id || !std::equal(ngramBegin, tokens.end(), tokens.begin() + start))
+                continue;
 
-        // Check if the provided str is part of our reverse prompts
-        bool foundPartialReversePrompt = false;
-        const std::string completed = cachedResponse + std::string(str);
-        if (reversePrompts.find(completed) != reversePrompts.end())
+            const int32_t end = std::min(n_tokens, start + n + n_max);
+            batch.insert(batch.end(), tokens.begin() + start + n, tokens.begin() + end);
             return;
+        }
+    }
+}
 
-        // Check if it partially matches our reverse prompts and if so, cache
-        for (const auto& s : reversePrompts) {
-            if (s.compare(0, completed.size(), completed) == 0) {
-                foundPartialReversePrompt = true;
-                cachedResponse = completed;
-                break;
+void LLModel::promptParallel(std::vector<ParallelPrompt> &prompts)
+{
+    if (!isModelLoaded()) {
+        std::cerr << implementation().modelType() << " ERROR: prompt won't work with an unloaded model!\n";
+        return;
+    }
+
+    const int32_t n_seqs = std::min(maxSequences(), int32_t(prompts.size()));
+    if (n_seqs < 2 || !supportsCompletion()) {
+        // nothing to batch, decode the prompts one after the other
+        for (auto &p : prompts) {
+            prompt(p.prompt, p.promptTemplate, p.promptCallback, p.responseCallback, [](bool) { return true; },
+                   *p.ctx, p.special);
+        }
+        return;
+    }
+
+    applyThreadAffinity();
+
+    // every sequence gets an equal share of the KV cache
+    const int32_t n_seq_ctx = contextLength() / n_seqs;
+
+    struct Sequence {
+        ParallelPrompt *p = nullptr;
+        PromptContext saved;            // the caller's settings, restored once the sequence is done
+        std::vector<Token> pending;     // tokens waiting to be decoded, front first
+        std::string asstSuffix;
+        std::optional<ResponseStream> stream;
+        int32_t n_predicted = 0;
+        bool generating = false;        // pending holds the last sampled token
+        bool finishing = false;         // pending holds the end of the prompt template
+    };
+    std::vector<Sequence> seqs(n_seqs);
+    size_t next_prompt = 0;
+
+    // the window and batch size only apply while the prompts share the context
+    auto release = [](Sequence &seq) {
+        if (!seq.p)
+            return;
+        auto &promptCtx = *seq.p->ctx;
+        promptCtx.n_ctx = seq.saved.n_ctx;
+        promptCtx.n_predict = seq.saved.n_predict;
+        promptCtx.n_batch = seq.saved.n_batch;
+        seq.p = nullptr;
+    };
+
+    auto admit = [this, &prompts, &next_prompt, n_seq_ctx, &release](Sequence &seq, int32_t seq_id) {
+        // the next prompt overwrites what the previous one left in this sequence of the KV cache
+        PromptContext *previous = seq.p ? seq.p->ctx : nullptr;
+        release(seq);
+        seq = Sequence();
+        while (next_prompt < prompts.size()) {
+            auto &p = prompts[next_prompt++];
+            auto &promptCtx = *p.ctx;
+
+            std::string err;
+            if (!tokenizePrompt(promptCtx, p.prompt, p.promptTemplate, p.special, seq.pending, seq.asstSuffix, err)) {
+                p.responseCallback(-1, err);
+                std::cerr << err << "\n";
+                continue;
+            }
+
+            if (int32_t(seq.pending.size()) > n_seq_ctx - 4) {
+                p.responseCallback(-1, "ERROR: The prompt size exceeds the context window size and cannot be processed.");
+                std::cerr << implementation().modelType() << " ERROR: The prompt is " << seq.pending.size() <<
+                    " tokens and the context window of each sequence is " << n_seq_ctx << "!\n";
+                continue;
+            }
+
+            if (previous && previous != &promptCtx) {
+                previous->n_past = 0;
+                previous->tokens.clear();
+            }
+            seq.saved.n_ctx = promptCtx.n_ctx;
+            seq.saved.n_predict = promptCtx.n_predict;
+            seq.saved.n_batch = promptCtx.n_batch;
+            promptCtx.n_ctx = n_seq_ctx;
+            promptCtx.n_predict = std::min(promptCtx.n_predict, n_seq_ctx - int32_t(seq.pending.size()));
+            if (promptCtx.n_past + int32_t(seq.pending.size()) > n_seq_ctx - 4) {
+                // the earlier conversation doesn't fit in the sequence's share of the context
+                promptCtx.n_past = 0;
+                promptCtx.tokens.clear();
+            }
+            promptCtx.n_batch = std::min(promptCtx.n_batch, LLMODEL_MAX_PROMPT_BATCH);
+            assignSequence(promptCtx, seq_id);
+            seq.p = &p;
+            seq.stream.emplace(*this, promptCtx.stop, p.responseCallback);
+            return;
+        }
+    };
+
+    // queue the end of the template once generation stops, the sequence is done after decoding it
+    auto finishGenerating = [this, &admit](Sequence &seq, int32_t seq_id) {
+        seq.generating = false;
+        seq.finishing = true;
+        seq.pending.clear();
+        if (!seq.asstSuffix.empty())
+            seq.pending = tokenize(*seq.p->ctx, seq.asstSuffix, true);
+        if (seq.pending.empty())
+            admit(seq, seq_id);
+    };
+
+    for (int32_t i = 0; i < n_seqs; i++)
+        admit(seqs[i], i);
+
+    std::vector<SequenceTokens> batch;
+    std::vector<int32_t> batchSeqs;
+    for (;;) {
+        // generating sequences go first so that long prompts can't stall them, the remaining room
+        // is filled with prompt tokens
+        batch.clear();
+        batchSeqs.clear();
+        int32_t n_batch = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int32_t i = 0; i < n_seqs; i++) {
+                auto &seq = seqs[i];
+                if (!seq.p || seq.pending.empty() || seq.generating != (pass == 0))
+                    continue;
+                const int32_t room = LLMODEL_MAX_PROMPT_BATCH - n_batch;
+                const int32_t n = std::min({ int32_t(seq.pending.size()), seq.p->ctx->n_batch, room });
+                if (n <= 0)
+                    continue;
+                // Check if the context of this sequence has run out...
+                if (seq.p->ctx->n_past + n > n_seq_ctx)
+                    recalculateContext(*seq.p->ctx, [](bool) { return true; });
+                batch.push_back({ seq.p->ctx, std::vector<Token>(seq.pending.begin(), seq.pending.begin() + n) });
+                batchSeqs.push_back(i);
+                n_batch += n;
             }
         }
 
-        // Regardless the token gets added to our cache
-        cachedTokens.push_back(id);
+        if (batch.empty())
+            break;
+
+        if (!evalSequences(batch)) {
+            // the prompts still being decoded and the ones waiting for a sequence are all given up
+            const std::string err = "ERROR: Failed to process prompt";
+            std::cerr << "LLModel " << err << "\n";
+            for (auto &seq : seqs) {
+                if (seq.p)
+                    seq.p->responseCallback(-1, err);
+                release(seq);
+            }
+            for (; next_prompt < prompts.size(); next_prompt++)
+                prompts[next_prompt].responseCallback(-1, err);
+            return;
+        }
 
-        // Continue if we have found a partial match
-        if (foundPartialReversePrompt)
-            continue;
+        for (size_t b = 0; b < batch.size(); b++) {
+            auto &seq = seqs[batchSeqs[b]];
+            auto &promptCtx = *seq.p->ctx;
+            const auto &tokens = batch[b].tokens;
+            const bool wasGenerating = seq.generating;
+            seq.pending.erase(seq.pending.begin(), seq.pending.begin() + tokens.size());
+
+            bool stop = false;
+            for (auto t : tokens) {
+                promptCtx.tokens.push_back(t);
+                promptCtx.n_past += 1;
+                if (!wasGenerating && !seq.finishing && !seq.p->promptCallback(t))
+                    stop = true;
+            }
 
-        // Empty the cache
-        for (auto t : cachedTokens) {
-            if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx)
-                promptCtx.tokens.erase(promptCtx.tokens.begin());
-            promptCtx.tokens.push_back(t);
-            promptCtx.n_past += 1;
-            //TODO: Conversion to std::string can be avoided here...
-            if (!responseCallback(t, std::string(tokenToString(t))))
-                return;
+            if (!seq.pending.empty() && !stop)
+                continue;
+
+            if (stop || seq.finishing) {
+                admit(seq, batchSeqs[b]);
+                continue;
+            }
+
+            // the prompt or the last sampled token is decoded, sample the next one
+            if (seq.n_predicted++ >= promptCtx.n_predict) {
+                seq.stream->flush();
+                finishGenerating(seq, batchSeqs[b]);
+                continue;
+            }
+
+            auto id = sampleToken(promptCtx);
+            const auto &endToks = endTokens();
+            if (std::find(endToks.begin(), endToks.end(), id) != endToks.end()) {
+                seq.stream->flush();
+                finishGenerating(seq, batchSeqs[b]);
+                continue;
+            }
+
+            // the token is only decoded if the response goes on
+            seq.generating = true;
+            seq.pending = { id };
+            if (!seq.stream->push(id))
+                finishGenerating(seq, batchSeqs[b]);
         }
-        cachedTokens.clear();
     }
+
+    for (auto &seq : seqs)
+        release(seq);
 }
 
 void LLModel::embed(
@@ -29,6 +29,11 @@ struct llm_kv_cache {
 
     int n; // number of tokens currently in the cache
 
+    // The cache is used as a ring buffer: the entry for context position p lives in slot
+    // (p + shift) % n_ctx and was rotated for position p + shift. Sliding the context window
+    // forward only advances shift, the oldest entries are overwritten by the next tokens.
+    int shift = 0;
+
     ~llm_kv_cache() {
         if (ctx) {
             ggml_free(ctx);
@@ -39,7 +44,9 @@ struct llm_kv_cache {
 inline void ggml_graph_compute_g4a(llm_buffer& buf, ggml_cgraph * graph, int n_threads) {
     struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
     if (plan.work_size > 0) {
-        buf.resize(plan.work_size);
+        // only grows, so that it is reused from one graph to the next
+        if (buf.size < plan.work_size)
+            buf.resize(plan.work_size);
         plan.work_data = buf.addr;
     }
     ggml_graph_compute(graph, &plan);
@@ -0,0 +1,32 @@
+#ifndef LLMODEL_TEST_H
+#define LLMODEL_TEST_H
+
+#include <iostream>
+
+// Minimal checks for the unit tests, a failed check is reported and makes the test exit with 1
+inline int test_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        if (!((a) == (b))) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #a " == " #b "\n"; \
+            test_failures++; \
+        } \
+    } while (0)
+
+inline int test_result()
+{
+    if (test_failures)
+        std::cerr << test_failures << " check(s) failed\n";
+    return test_failures ? 1 : 0;
+}
+
+#endif // LLMODEL_TEST_H
@@ -0,0 +1,102 @@
+#define LLAMAMODEL_H_I_KNOW_WHAT_I_AM_DOING_WHEN_INCLUDING_THIS_FILE
+#include "llamamodel_impl.h"
+#include "test.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <ggml.h>
+
+static constexpr int n_layer = 2;
+static constexpr int n_embd = 64;
+static constexpr int n_head = 4;
+static constexpr int n_head_kv = 2;
+static constexpr int n_ff = 128;
+static constexpr int n_vocab = 100;
+
+// Writes a llama GGUF with the given hyperparameters, a layer of each tensor type and the output
+static void write_model(const std::string &path)
+{
+    gguf_context *gguf = gguf_init_empty();
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_u32(gguf, "llama.context_length", 2048);
+    gguf_set_val_u32(gguf, "llama.block_count", n_layer);
+    gguf_set_val_u32(gguf, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(gguf, "llama.attention.head_count", n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv", n_head_kv);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length", n_ff);
+
+    std::vector<std::string> tokens(n_vocab);
+    std::vector<const char *> token_ptrs;
+    for (int i = 0; i < n_vocab; i++) {
+        tokens[i] = "t" + std::to_string(i);
+        token_ptrs.push_back(tokens[i].c_str());
+    }
+    gguf_set_arr_str(gguf, "tokenizer.ggml.tokens", token_ptrs.data(), n_vocab);
+
+    ggml_init_params params = { 16 * 1024 * 1024, nullptr, false };
+    ggml_context *ctx = ggml_init(params);
+    const auto add = [&](const char *name, ggml_type type, int64_t ne0, int64_t ne1) {
+        ggml_tensor *t = ggml_new_tensor_2d(ctx, type, ne0, ne1);
+        ggml_set_name(t, name);
+        gguf_add_tensor(gguf, t);
+    };
+    add("token_embd.weight", GGML_TYPE_F32, n_embd, n_vocab);
+    add("blk.0.attn_q.weight", GGML_TYPE_F16, n_embd, n_embd);
+    add("blk.1.attn_q.weight", GGML_TYPE_F32, n_embd, n_embd);
+    add("output.weight", GGML_TYPE_F32, n_embd, n_vocab);
+    gguf_write_to_file(gguf, path.c_str(), false);
+
+    ggml_free(ctx);
+    gguf_free(gguf);
+}
+
+int main()
+{
+    const std::string path = (std::filesystem::temp_directory_path() / "test_memory_estimate.gguf").string();
+    write_model(path);
+
+    const size_t embd_bytes = size_t(n_embd) * n_vocab * sizeof(float);
+    const size_t layer0 = size_t(n_embd) * n_embd * 2;
+    const size_t layer1 = size_t(n_embd) * n_embd * sizeof(float);
+    const size_t n_embd_kv = n_embd / n_head * n_head_kv;
+    const int n_ctx = 128;
+
+    LLamaModel model;
+    LLModel::MemoryEstimate estimate;
+    CHECK(model.estimateMemory(path, n_ctx, 0, LLModel::KVCacheType::F16, estimate));
+    CHECK_EQ(estimate.weights, 2 * embd_bytes + layer0 + layer1);
+
+    // K and V of every layer
+    const size_t kv_f16 = n_ctx * (n_embd_kv * 2 + n_embd_kv * 2);
+    CHECK_EQ(estimate.kvCache, n_layer * kv_f16);
+    CHECK_EQ(estimate.layers.size(), size_t(n_layer));
+    CHECK_EQ(estimate.layers[0], layer0 + kv_f16);
+    CHECK_EQ(estimate.layers[1], layer1 + kv_f16);
+    CHECK_EQ(estimate.logits, n_vocab * sizeof(float));
+    CHECK(estimate.compute > 0);
+    CHECK_EQ(estimate.gpu, size_t(0));
+    CHECK_EQ(model.requiredMem(path, n_ctx, 0, LLModel::KVCacheType::F16), estimate.total());
+
+    // only K is quantized: a block of 32 8-bit values shares an fp16 scale
+    CHECK(model.estimateMemory(path, n_ctx, 0, LLModel::KVCacheType::Q8_0, estimate));
+    const size_t kv_q8 = n_ctx * (n_embd_kv / 32 * 34 + n_embd_kv * 2);
+    CHECK_EQ(estimate.kvCache, n_layer * kv_q8);
+
+    // the last layers are offloaded first, and the output once all of them are
+    CHECK(model.estimateMemory(path, n_ctx, 1, LLModel::KVCacheType::F16, estimate));
+    CHECK_EQ(estimate.gpu, estimate.layers[1] + estimate.compute);
+    CHECK(model.estimateMemory(path, n_ctx, n_layer, LLModel::KVCacheType::F16, estimate));
+    CHECK_EQ(estimate.gpu, estimate.layers[0] + estimate.layers[1] + estimate.compute);
+    CHECK(model.estimateMemory(path, n_ctx, 100, LLModel::KVCacheType::F16, estimate));
+    CHECK_EQ(estimate.gpu, estimate.layers[0] + estimate.layers[1] + embd_bytes + estimate.compute);
+
+    // a file that isn't GGUF has no estimate
+    CHECK(!model.estimateMemory(path + ".missing", n_ctx, 0, LLModel::KVCacheType::F16, estimate));
+    CHECK_EQ(model.requiredMem(path + ".missing", n_ctx, 0, LLModel::KVCacheType::F16), size_t(0));
+
+    std::filesystem::remove(path);
+    return test_result();
+}
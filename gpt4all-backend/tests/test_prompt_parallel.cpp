@@ -0,0 +1,153 @@
+#include "llmodel.h"
+#include "test.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// A model of single byte tokens that answers every prompt with the reply scripted for its first
+// character and decodes up to two sequences together
+class MockModel : public LLModel {
+public:
+    std::map<char, std::string> replies;
+    mutable std::vector<std::set<int32_t>> batches; // the sequences in each decoded batch
+    size_t failingBatch = SIZE_MAX; // index of the batch that fails to decode
+
+    MockModel() { buildTokenTextTable(256); }
+
+    bool supportsEmbedding() const override { return false; }
+    bool supportsCompletion() const override { return true; }
+    bool loadModel(const std::string &, int, int, KVCacheType) override { return true; }
+    bool isModelLoaded() const override { return true; }
+    size_t requiredMem(const std::string &, int, int, KVCacheType) override { return 0; }
+    int32_t maxSequences() const override { return 2; }
+
+protected:
+    std::vector<Token> tokenize(PromptContext &, const std::string &str, bool) const override
+    {
+        return std::vector<Token>(str.begin(), str.end());
+    }
+
+    std::string tokenToString(Token id) const override { return id ? std::string(1, char(id)) : std::string(); }
+
+    Token sampleToken(PromptContext &ctx) const override
+    {
+        // the reply is picked by the first token of the prompt and ends with token 0
+        const auto it = m_prompts.find(ctx.seq_id);
+        const std::string &reply = replies.at(char(it->second.first));
+        const size_t n = ctx.tokens.size() - it->second.second;
+        return n < reply.size() ? Token(reply[n]) : 0;
+    }
+
+    bool evalTokens(PromptContext &, const std::vector<int32_t> &) const override { return false; }
+    int32_t contextLength() const override { return 64; }
+    const std::vector<Token> &endTokens() const override { return m_endTokens; }
+    bool shouldAddBOS() const override { return false; }
+
+    bool evalSequences(std::vector<SequenceTokens> &seqs) const override
+    {
+        if (batches.size() == failingBatch)
+            return false;
+        std::set<int32_t> ids;
+        for (auto &seq : seqs) {
+            ids.insert(seq.ctx->seq_id);
+            // the first batch of a sequence holds its whole prompt
+            if (seq.ctx->n_past == 0)
+                m_prompts[seq.ctx->seq_id] = { seq.tokens.front(), seq.tokens.size() };
+            if (seq.ctx->n_past + int32_t(seq.tokens.size()) > contextLength() / 2)
+                return false;
+        }
+        batches.push_back(ids);
+        return true;
+    }
+
+    void assignSequence(PromptContext &ctx, int32_t seq_id) const override
+    {
+        ctx.seq_id = seq_id;
+        m_prompts.erase(seq_id);
+    }
+
+private:
+    const std::vector<Token> m_endTokens = { 0 };
+    mutable std::map<int32_t, std::pair<Token, size_t>> m_prompts; // first token and start by sequence
+};
+
+int main()
+{
+    MockModel model;
+    model.replies = { { 'a', "xy" }, { 'b', "uvwxyz" }, { 'c', "pq" } };
+
+    std::vector<LLModel::PromptContext> contexts(3);
+    std::vector<std::string> responses(3);
+    std::vector<LLModel::ParallelPrompt> prompts(3);
+    const char *texts[] = { "a?", "b?", "c?" };
+    for (int i = 0; i < 3; i++) {
+        auto &ctx = contexts[i];
+        ctx.n_ctx = 1000;
+        ctx.n_batch = 7;
+        ctx.n_predict = 100;
+        prompts[i].prompt = texts[i];
+        // without an assistant suffix the first sequence is done as soon as the reply ends
+        prompts[i].promptTemplate = i == 0 ? "%1%2" : "%1";
+        prompts[i].promptCallback = [](int32_t) { return true; };
+        prompts[i].responseCallback = [&responses, i](int32_t, const std::string &text) {
+            responses[i] += text;
+            return true;
+        };
+        prompts[i].ctx = &ctx;
+    }
+
+    model.promptParallel(prompts);
+
+    // the replies are computed from the prompt in each sequence, so they only come out right if the
+    // sequences are kept apart
+    CHECK_EQ(responses[0], "xy");
+    CHECK_EQ(responses[1], "uvwxyz");
+    CHECK_EQ(responses[2], "pq");
+
+    // both sequences were decoded together
+    bool together = false;
+    for (auto &ids : model.batches)
+        together |= ids.size() == 2;
+    CHECK(together);
+
+    // the caller's settings are restored
+    for (auto &ctx : contexts) {
+        CHECK_EQ(ctx.n_ctx, 1000);
+        CHECK_EQ(ctx.n_batch, 7);
+        CHECK_EQ(ctx.n_predict, 100);
+    }
+
+    // the third prompt took over the sequence of the first one, which finished first
+    CHECK_EQ(contexts[2].seq_id, contexts[0].seq_id);
+    CHECK_EQ(contexts[0].n_past, 0);
+    CHECK(contexts[0].tokens.empty());
+    CHECK_EQ(contexts[1].n_past, int32_t(contexts[1].tokens.size()));
+    CHECK_EQ(contexts[1].n_past, 2 + 6 + 2); // prompt, reply and the default "\n\n" suffix
+
+    // a batch that fails to decode is reported to every prompt that didn't complete, also to the
+    // one still waiting for a sequence
+    MockModel failing;
+    failing.replies = model.replies;
+    failing.failingBatch = 1;
+    std::vector<std::string> errors(3);
+    for (int i = 0; i < 3; i++) {
+        contexts[i] = LLModel::PromptContext();
+        contexts[i].n_ctx = 1000;
+        contexts[i].n_batch = 7;
+        contexts[i].n_predict = 100;
+        prompts[i].responseCallback = [&errors, i](int32_t token, const std::string &text) {
+            if (token == -1)
+                errors[i] += text;
+            return true;
+        };
+    }
+    failing.promptParallel(prompts);
+    for (int i = 0; i < 3; i++)
+        CHECK_EQ(errors[i], "ERROR: Failed to process prompt");
+    for (auto &ctx : contexts)
+        CHECK_EQ(ctx.n_predict, 100);
+
+    return test_result();
+}
@@ -0,0 +1,129 @@
+#include "llmodel.h"
+#include "test.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// A model that replies with a script of tokens from a fixed vocabulary, token 0 ends the reply
+class ScriptedModel : public LLModel {
+public:
+    explicit ScriptedModel(std::vector<std::string> vocab)
+        : m_vocab(std::move(vocab))
+    {
+        buildTokenTextTable(m_vocab.size());
+    }
+
+    std::vector<Token> script;
+
+    bool supportsEmbedding() const override { return false; }
+    bool supportsCompletion() const override { return true; }
+    bool loadModel(const std::string &, int, int, KVCacheType) override { return true; }
+    bool isModelLoaded() const override { return true; }
+    size_t requiredMem(const std::string &, int, int, KVCacheType) override { return 0; }
+
+protected:
+    std::vector<Token> tokenize(PromptContext &, const std::string &str, bool) const override
+    {
+        return std::vector<Token>(str.size(), 1);
+    }
+
+    std::string tokenToString(Token id) const override { return m_vocab.at(id); }
+
+    Token sampleToken(PromptContext &) const override
+    {
+        return m_next < script.size() ? script[m_next++] : 0;
+    }
+
+    bool evalTokens(PromptContext &, const std::vector<int32_t> &) const override { return true; }
+    int32_t contextLength() const override { return 1000; }
+    const std::vector<Token> &endTokens() const override { return m_endTokens; }
+    bool shouldAddBOS() const override { return false; }
+
+private:
+    std::vector<std::string> m_vocab;
+    const std::vector<Token> m_endTokens = { 0 };
+    mutable size_t m_next = 0;
+};
+
+struct Reply {
+    std::vector<std::pair<int32_t, std::string>> calls;
+    std::string text;
+    int32_t n_past = 0;
+};
+
+static Reply generate(const std::vector<std::string> &vocab, std::vector<LLModel::Token> script,
+                      std::vector<std::string> stop = {})
+{
+    ScriptedModel model(vocab);
+    model.script = std::move(script);
+    LLModel::PromptContext ctx;
+    ctx.n_ctx = 1000;
+    ctx.stop = std::move(stop);
+
+    Reply reply;
+    model.prompt("?", "%1%2", [](int32_t) { return true; },
+        [&reply](int32_t id, const std::string &text) {
+            reply.calls.push_back({ id, text });
+            reply.text += text;
+            return true;
+        },
+        [](bool) { return true; }, ctx);
+    reply.n_past = ctx.n_past;
+    return reply;
+}
+
+static bool noEmptyCalls(const Reply &reply)
+{
+    for (const auto &call : reply.calls) {
+        if (call.second.empty())
+            return false;
+    }
+    return true;
+}
+
+int main()
+{
+    const std::vector<std::string> vocab = {
+        "", "?", "Hel", "lo ", "wor", "ld", "\xC3", "\xA9", "\xE2\x82", "\xAC", "o", "### Hu", "man", "ab",
+    };
+
+    // a reply without a stop sequence is passed on token by token
+    Reply reply = generate(vocab, { 2, 3, 4, 5 });
+    CHECK_EQ(reply.text, "Hello world");
+    CHECK_EQ(reply.calls.size(), size_t(4));
+    CHECK_EQ(reply.n_past, 1 + 4);
+
+    // a stop sequence is matched at byte positions across tokens, the token it starts in keeps the
+    // text before it and the tokens after it leave the context
+    reply = generate(vocab, { 2, 3, 4, 5 }, { "o w" });
+    CHECK_EQ(reply.text, "Hell");
+    CHECK(noEmptyCalls(reply));
+    CHECK_EQ(reply.n_past, 1 + 2);
+
+    // the longest stop sequence ending at a byte wins, so the earliest start is cut
+    reply = generate(vocab, { 2, 3, 4, 5 }, { "wor", "lo wor" });
+    CHECK_EQ(reply.text, "Hel");
+
+    // the reverse prompts always stop the reply
+    reply = generate(vocab, { 13, 11, 12, 13 });
+    CHECK_EQ(reply.text, "ab");
+
+    // text held back as the possible start of a stop sequence is passed on when the reply ends
+    reply = generate(vocab, { 13, 10 }, { "o w" });
+    CHECK_EQ(reply.text, "abo");
+    CHECK(noEmptyCalls(reply));
+
+    // characters split across tokens are only passed on once complete, and a token whose text goes
+    // with the next one isn't passed on by itself
+    reply = generate(vocab, { 13, 6, 7, 8, 9 });
+    CHECK_EQ(reply.text, "ab\xC3\xA9\xE2\x82\xAC");
+    CHECK(noEmptyCalls(reply));
+    CHECK(reply.calls.size() == 3 && reply.calls[1].second == "\xC3\xA9" && reply.calls[2].second == "\xE2\x82\xAC");
+
+    // a character cut short by the end of the reply is passed on as it is
+    reply = generate(vocab, { 13, 8 });
+    CHECK_EQ(reply.text, "ab\xE2\x82");
+
+    return test_result();
+}
@@ -0,0 +1,81 @@
+#include "utils.h"
+#include "test.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <set>
+#include <vector>
+
+// the top K tokens after the penalty, by a full sort
+static std::set<gpt_vocab::id> reference_top_k(std::vector<float> logits, const std::vector<int32_t> & last_n,
+                                               int top_k, float repeat_penalty) {
+    std::set<int32_t> window(last_n.begin(), last_n.end());
+    for (const auto id : window) {
+        if (id >= 0 && id < int32_t(logits.size())) {
+            logits[id] = logits[id] < 0.0f ? logits[id]*repeat_penalty : logits[id]/repeat_penalty;
+        }
+    }
+    std::vector<std::pair<float, gpt_vocab::id>> sorted;
+    for (size_t i = 0; i < logits.size(); ++i) {
+        sorted.emplace_back(logits[i], gpt_vocab::id(i));
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto & a, const auto & b) { return a.first > b.first; });
+    std::set<gpt_vocab::id> top;
+    for (int k = 0; k < top_k; ++k) {
+        top.insert(sorted[k].second);
+    }
+    return top;
+}
+
+int main() {
+    std::mt19937 rng(42);
+    gpt_sample_buffers buffers;
+
+    // a vocab that isn't a multiple of the block size, with distinct logits of both signs
+    const size_t n_vocab = 1000 + 7;
+    std::vector<float> logits(n_vocab);
+    std::uniform_real_distribution<float> dist(-10.0f, 10.0f);
+    for (auto & logit : logits) {
+        logit = dist(rng);
+    }
+
+    // the window repeats tokens, holds ids out of range, and holds the best tokens so that the
+    // penalty changes the top K
+    std::vector<int32_t> last_n(64);
+    for (auto & id : last_n) {
+        id = int32_t(rng() % n_vocab);
+    }
+    last_n[0] = last_n[1];
+    last_n[2] = -1;
+    last_n[3] = int32_t(n_vocab);
+    last_n[4] = int32_t(std::max_element(logits.begin(), logits.end()) - logits.begin());
+
+    const std::vector<float> original = logits;
+    for (const int top_k : { 1, 5, 40 }) {
+        const auto expected = reference_top_k(logits, last_n, top_k, 1.3f);
+        std::set<gpt_vocab::id> sampled;
+        for (int n = 0; n < 2000; ++n) {
+            // a high temperature makes every one of the top K likely to come up
+            sampled.insert(gpt_sample_top_k_top_p(n_vocab, last_n.data(), last_n.size(), logits.data(),
+                                                  top_k, 1.0, 100.0, 1.3f, rng, buffers));
+        }
+        CHECK(sampled == expected);
+
+        // the penalized logits are restored
+        CHECK(std::memcmp(logits.data(), original.data(), n_vocab*sizeof(float)) == 0);
+    }
+
+    // a tiny P keeps only the best token after the penalty
+    const auto best = reference_top_k(logits, last_n, 1, 1.3f);
+    CHECK_EQ(gpt_sample_top_k_top_p(n_vocab, last_n.data(), last_n.size(), logits.data(), 40, 1e-6, 0.8, 1.3f, rng, buffers),
+             *best.begin());
+
+    // without temperature the highest logit is taken as is
+    CHECK_EQ(gpt_sample_top_k_top_p(n_vocab, last_n.data(), last_n.size(), logits.data(), 40, 0.9, 0.0, 1.3f, rng, buffers),
+             last_n[4]);
+    CHECK(std::memcmp(logits.data(), original.data(), n_vocab*sizeof(float)) == 0);
+
+    return test_result();
+}
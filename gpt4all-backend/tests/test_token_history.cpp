@@ -0,0 +1,87 @@
+#include "llmodel.h"
+#include "test.h"
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+using TokenHistory = LLModel::TokenHistory;
+using Token = LLModel::Token;
+
+static bool same(const TokenHistory &history, const std::vector<Token> &expected)
+{
+    return std::vector<Token>(history) == expected && history.size() == expected.size()
+        && (expected.empty() || history.data()[0] == expected.front());
+}
+
+int main()
+{
+    // a full window drops its oldest token for every new one
+    {
+        TokenHistory history;
+        std::vector<Token> expected;
+        for (Token t = 0; t < 8; t++) {
+            history.push_back(t);
+            expected.push_back(t);
+        }
+        for (Token t = 8; t < 100; t++) {
+            history.erase(history.begin());
+            expected.erase(expected.begin());
+            history.push_back(t);
+            expected.push_back(t);
+            CHECK(same(history, expected));
+        }
+        CHECK_EQ(history[0], 92);
+        CHECK_EQ(history.back(), 99);
+    }
+
+    // erasing after the first token, as recalculateContext keeps BOS, moves that one token
+    {
+        TokenHistory history(std::vector<Token> { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 });
+        auto it = history.erase(history.begin() + 1, history.begin() + 6);
+        CHECK(same(history, { 1, 7, 8, 9, 10 }));
+        CHECK_EQ(*it, 7);
+        CHECK_EQ(it - history.begin(), 1);
+    }
+
+    // erasing near the end moves the tail instead
+    {
+        TokenHistory history(std::vector<Token> { 1, 2, 3, 4, 5, 6 });
+        auto it = history.erase(history.begin() + 4);
+        CHECK(same(history, { 1, 2, 3, 4, 6 }));
+        CHECK_EQ(*it, 6);
+        history.resize(2);
+        CHECK(same(history, { 1, 2 }));
+        history.clear();
+        CHECK(history.empty());
+    }
+
+    // random edits match a std::vector
+    std::mt19937 rng(42);
+    TokenHistory history;
+    std::vector<Token> expected;
+    for (int i = 0; i < 20000; i++) {
+        const auto op = rng() % 8;
+        if (op < 4 || expected.empty()) {
+            const Token t = Token(rng() % 1000);
+            history.push_back(t);
+            expected.push_back(t);
+        } else if (op < 7) {
+            const size_t first = rng() % expected.size();
+            const size_t last = first + rng() % (expected.size() - first + 1);
+            auto it = history.erase(history.begin() + first, history.begin() + last);
+            auto eit = expected.erase(expected.begin() + first, expected.begin() + last);
+            CHECK_EQ(it - history.begin(), eit - expected.begin());
+        } else {
+            const size_t n = rng() % (expected.size() + 1);
+            history.resize(n);
+            expected.resize(n);
+        }
+        if (!same(history, expected)) {
+            CHECK(same(history, expected));
+            break;
+        }
+    }
+
+    return test_result();
+}
@@ -0,0 +1,144 @@
+// gpt_word_length and the BPE merge loop are internal to utils.cpp
+#include "../utils.cpp"
+#include "test.h"
+
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+static std::string random_text(std::mt19937 & rng, const std::string & alphabet, size_t max_len) {
+    std::string text(rng() % (max_len + 1), ' ');
+    for (auto & c : text) {
+        c = alphabet[rng() % alphabet.size()];
+    }
+    return text;
+}
+
+// BPE as defined: merge the adjacent pair of the lowest rank, the leftmost one on a tie, until none is left
+static std::vector<gpt_vocab::id> naive_bpe(const gpt_vocab & vocab, const std::string & word) {
+    std::vector<gpt_vocab::id> ids;
+    for (const char c : word) {
+        ids.push_back(vocab.byte_to_id[(unsigned char) c]);
+    }
+    for (;;) {
+        size_t best = ids.size();
+        std::pair<int32_t, gpt_vocab::id> best_merge;
+        for (size_t i = 0; i + 1 < ids.size(); ++i) {
+            const auto it = vocab.merges.find(gpt_vocab::merge_key(ids[i], ids[i + 1]));
+            if (it != vocab.merges.end() && (best == ids.size() || it->second.first < best_merge.first)) {
+                best = i;
+                best_merge = it->second;
+            }
+        }
+        if (best == ids.size()) {
+            return ids;
+        }
+        ids[best] = best_merge.second;
+        ids.erase(ids.begin() + best + 1);
+    }
+}
+
+int main() {
+    // the hand-written pre-tokenizer splits like the regex it replaces
+    const std::regex re(R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)");
+    std::mt19937 rng(42);
+    for (int n = 0; n < 5000; ++n) {
+        const std::string text = random_text(rng, "aZst rlevmd'19 .!-\t\n", 24);
+        std::vector<size_t> expected;
+        for (auto it = std::sregex_iterator(text.begin(), text.end(), re); it != std::sregex_iterator(); ++it) {
+            expected.push_back(it->length());
+        }
+        std::vector<size_t> lengths;
+        for (size_t i = 0; i < text.size(); i += lengths.back()) {
+            lengths.push_back(gpt_word_length(text, i));
+        }
+        if (lengths != expected) {
+            std::cerr << "split differs for \"" << text << "\"\n";
+            CHECK(lengths == expected);
+            break;
+        }
+    }
+
+    // a byte-level vocab: every byte, then the merged tokens in the order of the merges
+    gpt_vocab vocab;
+    for (int b = 0; b < 256; ++b) {
+        vocab.token_to_id[gpt_byte_to_unicode(b)] = b;
+    }
+    const std::vector<std::string> merges = {
+        "a b", "b a", "a a", "ab a", "Ġ a", "c c", "ab ab", "Ġa b", "b c", "a bc", "aa a", "Ġab c", "ba ba",
+    };
+    for (const auto & merge : merges) {
+        const size_t space = merge.find(' ');
+        const std::string merged = merge.substr(0, space) + merge.substr(space + 1);
+        vocab.token_to_id.emplace(merged, gpt_vocab::id(vocab.token_to_id.size()));
+    }
+    for (const auto & [token, id] : vocab.token_to_id) {
+        vocab.id_to_token[id] = token;
+    }
+    CHECK(gpt_vocab_init_bpe(vocab, merges));
+    CHECK_EQ(vocab.merges.size(), merges.size());
+
+    // tokens detokenize to the bytes they stand for
+    CHECK_EQ(vocab.id_to_token.at(' '), " ");
+    CHECK_EQ(vocab.id_to_token.at(vocab.token_to_id.at("Ġabc")), " abc");
+
+    for (int n = 0; n < 5000; ++n) {
+        const std::string word = random_text(rng, "abc", 16);
+        std::vector<gpt_vocab::id> tokens;
+        gpt_tokenize_bpe(vocab, word, tokens);
+        if (tokens != naive_bpe(vocab, word)) {
+            std::cerr << "merges differ for \"" << word << "\"\n";
+            CHECK(tokens == naive_bpe(vocab, word));
+            break;
+        }
+    }
+
+    // gpt_tokenize encodes each word on its own
+    const std::string text = "abab cab  aaa";
+    std::vector<gpt_vocab::id> expected;
+    for (const char * word : { "abab", " cab", " ", " aaa" }) {
+        const auto ids = naive_bpe(vocab, word);
+        expected.insert(expected.end(), ids.begin(), ids.end());
+    }
+    CHECK(gpt_tokenize(vocab, text) == expected);
+    std::string decoded;
+    for (const auto id : expected) {
+        decoded += vocab.id_to_token.at(id);
+    }
+    CHECK_EQ(decoded, text);
+
+    // a vocab as convert_gptj_to_gguf.py writes it: the tokens are the raw bytes, the merges stay in
+    // the byte-level alphabet
+    gpt_vocab raw;
+    for (int b = 0; b < 256; ++b) {
+        raw.token_to_id[std::string(1, char(b))] = b;
+    }
+    const std::vector<std::string> raw_merges = { "Ġ a", "a b", "Ã ©", "Ġa b", "Ġ Ã©", "ab c" };
+    for (const char * token : { " a", "ab", "\xc3\xa9", " ab", " \xc3\xa9", "abc" }) {
+        raw.token_to_id.emplace(token, gpt_vocab::id(raw.token_to_id.size()));
+    }
+    for (const auto & [token, id] : raw.token_to_id) {
+        raw.id_to_token[id] = token;
+    }
+    CHECK(gpt_vocab_init_bpe(raw, raw_merges));
+    CHECK_EQ(raw.merges.size(), raw_merges.size());
+    CHECK_EQ(raw.byte_to_id[' '], gpt_vocab::id(' '));
+
+    // the tokens are left as they are, so non-ASCII tokens still detokenize
+    CHECK_EQ(raw.id_to_token.at(raw.token_to_id.at("\xc3\xa9")), "\xc3\xa9");
+
+    const std::string raw_text = "abc ab \xc3\xa9 \xc3\xa9" "a";
+    const std::vector<gpt_vocab::id> raw_expected = {
+        raw.token_to_id.at("abc"), raw.token_to_id.at(" ab"), raw.token_to_id.at(" \xc3\xa9"),
+        raw.token_to_id.at(" \xc3\xa9"), 'a',
+    };
+    CHECK(gpt_tokenize(raw, raw_text) == raw_expected);
+    std::string raw_decoded;
+    for (const auto id : gpt_tokenize(raw, raw_text)) {
+        raw_decoded += raw.id_to_token.at(id);
+    }
+    CHECK_EQ(raw_decoded, raw_text);
+
+    return test_result();
+}
@@ -1,7 +1,10 @@
 #include "utils.h"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
-#include <regex>
+#include <queue>
+#include <string_view>
 
 void replace(std::string & str, const std::string & needle, const std::string & replacement) {
     size_t pos = 0;
@@ -102,101 +105,312 @@ std::map<std::string, int32_t> json_parse(const std::string & fname) {
     return result;
 }
 
-std::vector<gpt_vocab::id> gpt_tokenize_inner(const gpt_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+static bool is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+static bool is_alpha(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
 
-        std::regex re(pat);
-        std::smatch m;
+static bool is_digit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+// length of the word starting at text[i], following the regex in utils.h
+static size_t gpt_word_length(std::string_view text, size_t i) {
+    const size_t n = text.size();
+
+    if (text[i] == '\'' && i + 1 < n) {
+        const char c = text[i + 1];
+        if (c == 's' || c == 't' || c == 'm' || c == 'd') {
+            return 2;
+        }
+        if (i + 2 < n && ((c == 'r' && text[i + 2] == 'e') || (c == 'v' && text[i + 2] == 'e') ||
+                          (c == 'l' && text[i + 2] == 'l'))) {
+            return 3;
         }
     }
 
-    // find the longest tokens that form the words:
-    std::vector<gpt_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.size() == 0) continue;
-
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            while (j > i) {
-                auto it = vocab.token_to_id.find(word.substr(i, j-i));
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    break;
-                }
-                --j;
-            }
-            if (i == n) {
+    // ' ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+'
+    size_t j = i;
+    if (text[j] == ' ' && j + 1 < n && !is_space(text[j + 1])) {
+        ++j;
+    }
+    if (!is_space(text[j])) {
+        const auto same_class = [&](unsigned char c) {
+            if (is_alpha(text[j])) return is_alpha(c);
+            if (is_digit(text[j])) return is_digit(c);
+            return !is_space(c) && !is_alpha(c) && !is_digit(c);
+        };
+        size_t k = j + 1;
+        while (k < n && same_class(text[k])) {
+            ++k;
+        }
+        return k - i;
+    }
+
+    // '\s+(?!\S)|\s+': a run of whitespace leaves its last character to the word that follows
+    size_t k = i + 1;
+    while (k < n && is_space(text[k])) {
+        ++k;
+    }
+    if (k < n && k - i > 1) {
+        --k;
+    }
+    return k - i;
+}
+
+// byte-level BPE: start from one token per byte and apply the merges in order of rank
+static void gpt_tokenize_bpe(const gpt_vocab & vocab, std::string_view word, std::vector<gpt_vocab::id> & tokens) {
+    struct symbol {
+        gpt_vocab::id id;
+        int prev, next;
+    };
+    struct pair {
+        int32_t rank;
+        int left, right;
+        gpt_vocab::id left_id, right_id, merged;
+        bool operator>(const pair & other) const {
+            return rank != other.rank ? rank > other.rank : left > other.left;
+        }
+    };
+
+    if (word.empty()) {
+        return;
+    }
+
+    std::vector<symbol> symbols(word.size());
+    for (size_t i = 0; i < word.size(); ++i) {
+        symbols[i] = { vocab.byte_to_id[(unsigned char) word[i]], int(i) - 1, i + 1 < word.size() ? int(i) + 1 : -1 };
+    }
+
+    std::priority_queue<pair, std::vector<pair>, std::greater<pair>> queue;
+    const auto add_pair = [&](int left, int right) {
+        if (left < 0 || right < 0) {
+            return;
+        }
+        const auto it = vocab.merges.find(gpt_vocab::merge_key(symbols[left].id, symbols[right].id));
+        if (it != vocab.merges.end()) {
+            queue.push({ it->second.first, left, right, symbols[left].id, symbols[right].id, it->second.second });
+        }
+    };
+    for (size_t i = 0; i + 1 < word.size(); ++i) {
+        add_pair(i, i + 1);
+    }
+
+    while (!queue.empty()) {
+        const pair top = queue.top();
+        queue.pop();
+
+        // skip pairs that an earlier merge has changed
+        symbol & left = symbols[top.left];
+        if (left.next != top.right || left.id != top.left_id || symbols[top.right].id != top.right_id) {
+            continue;
+        }
+
+        left.id = top.merged;
+        left.next = symbols[top.right].next;
+        symbols[top.right].id = -1;
+        if (left.next >= 0) {
+            symbols[left.next].prev = top.left;
+        }
+        add_pair(left.prev, top.left);
+        add_pair(top.left, left.next);
+    }
+
+    for (int i = 0; i >= 0; i = symbols[i].next) {
+        tokens.push_back(symbols[i].id);
+    }
+}
+
+// greedy longest match through the token trie, for vocabularies without merges
+static void gpt_tokenize_greedy(const gpt_vocab & vocab, std::string_view word, std::vector<gpt_vocab::id> & tokens) {
+    size_t i = 0;
+    while (i < word.size()) {
+        int32_t node = 0;
+        gpt_vocab::id best = -1;
+        size_t best_len = 0;
+        for (size_t j = i; j < word.size(); ++j) {
+            const auto it = vocab.trie_edges.find(gpt_vocab::trie_key(node, word[j]));
+            if (it == vocab.trie_edges.end()) {
                 break;
             }
-            if (j == i) {
-                auto sub = word.substr(i, 1);
-                if (vocab.token_to_id.find(sub) != vocab.token_to_id.end()) {
-                    tokens.push_back(vocab.token_to_id.at(sub));
-                } else {
-                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, sub.data());
-                }
-                ++i;
+            node = it->second;
+            if (vocab.trie_ids[node] >= 0) {
+                best = vocab.trie_ids[node];
+                best_len = j - i + 1;
             }
         }
-    }
 
-    return tokens;
+        if (best < 0) {
+            fprintf(stderr, "%s: unknown token '%c'\n", __func__, word[i]);
+            ++i;
+            continue;
+        }
+        tokens.push_back(best);
+        i += best_len;
+    }
 }
 
-std::string regex_escape(const std::string &s) {
-  static const std::regex metacharacters(R"([\.\^\$\-\+\(\)\[\]\{\}\|\?\*])");
-  return std::regex_replace(s, metacharacters, "\\$&");
+static void gpt_tokenize_inner(const gpt_vocab & vocab, std::string_view text, std::vector<gpt_vocab::id> & tokens) {
+    for (size_t i = 0; i < text.size();) {
+        const size_t len = gpt_word_length(text, i);
+        if (vocab.byte_level) {
+            gpt_tokenize_bpe(vocab, text.substr(i, len), tokens);
+        } else {
+            gpt_tokenize_greedy(vocab, text.substr(i, len), tokens);
+        }
+        i += len;
+    }
 }
 
 std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text) {
-    // Generate the subpattern from the special_tokens vector if it's not empty
-    if (!vocab.special_tokens.empty()) {
-        std::vector<gpt_vocab::id> out;
-        std::vector<std::string> chunks;
-        std::string str = text;
-        std::string special_tokens_subpattern;
-        for (const auto &token : vocab.special_tokens) {
-            if (!special_tokens_subpattern.empty()) {
-                special_tokens_subpattern += "|";
+    std::vector<gpt_vocab::id> out;
+    if (vocab.special_tokens.empty()) {
+        gpt_tokenize_inner(vocab, text, out);
+        return out;
+    }
+
+    // split off the special tokens in a single pass, preferring the longest one at each position
+    std::string_view str = text;
+    size_t start = 0;
+    for (size_t i = 0; i < str.size();) {
+        const std::string * special = nullptr;
+        for (const auto & token : vocab.special_tokens) {
+            if (!token.empty() && str.compare(i, token.size(), token) == 0 && (!special || token.size() > special->size())) {
+                special = &token;
             }
-            special_tokens_subpattern += regex_escape(token);
         }
-        std::regex re(special_tokens_subpattern);
-        std::smatch m;
-        while (std::regex_search(str, m, re)) {
-            auto tok = vocab.token_to_id.find(m.str());
-            if (tok != vocab.token_to_id.end()) {
-                auto tokid = tok->second;
-                auto pfxtoks = gpt_tokenize_inner(vocab, m.prefix());
-                out.insert(out.end(), pfxtoks.begin(), pfxtoks.end());
-                out.push_back(tokid);
-                str = m.suffix();
-            }
+        const auto tok = special ? vocab.token_to_id.find(*special) : vocab.token_to_id.end();
+        if (tok == vocab.token_to_id.end()) {
+            ++i;
+            continue;
         }
-        if (!str.empty()) {
-            auto tokrest = gpt_tokenize_inner(vocab, str);
-            out.insert(out.end(), tokrest.begin(), tokrest.end());
+        gpt_tokenize_inner(vocab, str.substr(start, i - start), out);
+        out.push_back(tok->second);
+        i += special->size();
+        start = i;
+    }
+    gpt_tokenize_inner(vocab, str.substr(start), out);
+    return out;
+}
+
+// GPT-2 maps every byte to a printable character so that byte-level tokens are valid strings
+static std::string gpt_byte_to_unicode(unsigned char byte) {
+    uint32_t cp = byte;
+    if (!((byte >= '!' && byte <= '~') || (byte >= 0xA1 && byte <= 0xAC) || byte >= 0xAE)) {
+        // the remaining bytes are mapped in order past 255
+        int n = 0;
+        for (int b = 0; b < byte; ++b) {
+            if (!((b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || b >= 0xAE)) {
+                ++n;
+            }
         }
-        return out;
+        cp = 256 + n;
+    }
+
+    std::string out;
+    if (cp < 0x80) {
+        out += char(cp);
     } else {
-        return gpt_tokenize_inner(vocab, text);
+        out += char(0xC0 | (cp >> 6));
+        out += char(0x80 | (cp & 0x3F));
     }
+    return out;
 }
 
+// the bytes a token in the byte-level alphabet stands for, false if it isn't in that alphabet
+static bool gpt_unicode_to_bytes(const std::map<std::string, unsigned char> & unicode_to_byte, const std::string & token, std::string & bytes) {
+    bytes.clear();
+    for (size_t i = 0; i < token.size();) {
+        const size_t len = (unsigned char) token[i] < 0x80 ? 1 : 2;
+        const auto it = unicode_to_byte.find(token.substr(i, len));
+        if (it == unicode_to_byte.end()) {
+            return false;
+        }
+        bytes += char(it->second);
+        i += len;
+    }
+    return true;
+}
+
+bool gpt_vocab_init_bpe(gpt_vocab & vocab, const std::vector<std::string> & merges) {
+    if (merges.empty()) {
+        return false;
+    }
+
+    std::map<std::string, unsigned char> unicode_to_byte;
+    for (int b = 0; b < 256; ++b) {
+        unicode_to_byte[gpt_byte_to_unicode(b)] = b;
+    }
+
+    // the tokens are either stored as the bytes they stand for, as convert_gptj_to_gguf.py writes
+    // them, or in the byte-level alphabet like the merges
+    bool raw = true;
+    for (int b = 0; b < 256 && raw; ++b) {
+        raw = vocab.token_to_id.count(std::string(1, char(b))) != 0;
+    }
+    for (int b = 0; b < 256; ++b) {
+        const auto it = vocab.token_to_id.find(raw ? std::string(1, char(b)) : gpt_byte_to_unicode(b));
+        if (it == vocab.token_to_id.end()) {
+            return false;
+        }
+        vocab.byte_to_id[b] = it->second;
+    }
+
+    vocab.merges.clear();
+    std::string left_token, right_token;
+    for (size_t rank = 0; rank < merges.size(); ++rank) {
+        const std::string & merge = merges[rank];
+        const size_t space = merge.find(' ', 1);
+        if (space == std::string::npos) {
+            continue;
+        }
+        left_token = merge.substr(0, space);
+        right_token = merge.substr(space + 1);
+        if (raw && (!gpt_unicode_to_bytes(unicode_to_byte, merge.substr(0, space), left_token) ||
+                    !gpt_unicode_to_bytes(unicode_to_byte, merge.substr(space + 1), right_token))) {
+            continue;
+        }
+        const auto left = vocab.token_to_id.find(left_token);
+        const auto right = vocab.token_to_id.find(right_token);
+        const auto merged = vocab.token_to_id.find(left_token + right_token);
+        if (left == vocab.token_to_id.end() || right == vocab.token_to_id.end() || merged == vocab.token_to_id.end()) {
+            continue;
+        }
+        vocab.merges.emplace(gpt_vocab::merge_key(left->second, right->second), std::make_pair(int32_t(rank), merged->second));
+    }
+
+    // tokens are looked up by their encoded form, but detokenize to the bytes they stand for
+    if (!raw) {
+        std::string bytes;
+        for (auto & [id, token] : vocab.id_to_token) {
+            if (gpt_unicode_to_bytes(unicode_to_byte, token, bytes)) {
+                token = bytes;
+            }
+        }
+    }
+
+    vocab.byte_level = true;
+    return true;
+}
+
+void gpt_vocab_build_trie(gpt_vocab & vocab) {
+    vocab.trie_edges.clear();
+    vocab.trie_ids.assign(1, -1);
+    for (const auto & [token, id] : vocab.token_to_id) {
+        int32_t node = 0;
+        for (const char c : token) {
+            const auto [it, inserted] = vocab.trie_edges.emplace(gpt_vocab::trie_key(node, c), int32_t(vocab.trie_ids.size()));
+            if (inserted) {
+                vocab.trie_ids.push_back(-1);
+            }
+            node = it->second;
+        }
+        vocab.trie_ids[node] = id;
+    }
+}
 
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
     printf("%s: loading vocab from '%s'\n", __func__, fname.c_str());
@@ -206,6 +420,7 @@ bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
     for (const auto & kv : vocab.token_to_id) {
         vocab.id_to_token[kv.second] = kv.first;
     }
+    gpt_vocab_build_trie(vocab);
 
     printf("%s: vocab size = %d\n", __func__, (int) vocab.token_to_id.size());
 
@@ -221,108 +436,124 @@ gpt_vocab::id gpt_sample_top_k_top_p(
         const size_t actualVocabSize,
         const int32_t * last_n_tokens_data,
         int   last_n_tokens_size,
-        const std::vector<float> logits,
+        float * logits,
         int    top_k,
         double top_p,
         double temp,
         float repeat_penalty,
-        std::mt19937 & rng) {
-    int n_logits = actualVocabSize;
-
-    const auto last_n_tokens = std::vector<int32_t>(last_n_tokens_data, last_n_tokens_data + last_n_tokens_size);
-    const auto * plogits = logits.data();
+        std::mt19937 & rng,
+        gpt_sample_buffers & buffers) {
+    const int n_logits = actualVocabSize;
 
     if (temp <= 0) {
         // select the token with the highest logit directly
-        float max_logit = plogits[0];
-        gpt_vocab::id max_id = 0;
+        return std::max_element(logits, logits + n_logits) - logits;
+    }
 
-        for (int i = 1; i < n_logits; ++i) {
-            if (plogits[i] > max_logit) {
-                max_logit = plogits[i];
-                max_id = i;
-            }
-        }
-        return max_id;
+    if (top_k <= 0 || top_k > n_logits) {
+        top_k = n_logits;
     }
-    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
 
-    {
-        const float scale = 1.0f/temp;
-        for (int i = 0; i < n_logits; ++i) {
-            // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
-            // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
-            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
-                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
-                if (plogits[i] < 0.0f) {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale*repeat_penalty, i));
-                } else {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale/repeat_penalty, i));
-                }
-            } else {
-                logits_id.push_back(std::make_pair(plogits[i]*scale, i));
-            }
+    // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
+    // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
+    //
+    // only the tokens in the window are touched: they are left out of the top K scan below and
+    // considered afterwards with the penalty applied
+    auto & penalized = buffers.penalized;
+    penalized.clear();
+    for (int i = 0; i < last_n_tokens_size; ++i) {
+        const gpt_vocab::id id = last_n_tokens_data[i];
+        if (id < 0 || id >= n_logits || logits[id] == -INFINITY) {
+            continue;
         }
+        penalized.emplace_back(id, logits[id]);
+        logits[id] = -INFINITY;
     }
 
-    // find the top K tokens
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + top_k, logits_id.end(),
-            [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
+    // find the top K tokens with a min-heap, skipping blocks of logits that can't make it
+    auto & logits_id = buffers.candidates;
+    logits_id.clear();
+    logits_id.reserve(top_k);
+    const auto greater = [](const std::pair<float, gpt_vocab::id> & a, const std::pair<float, gpt_vocab::id> & b) {
         return a.first > b.first;
-    });
-
-    logits_id.resize(top_k);
+    };
+    float threshold = -INFINITY;
+    const auto consider = [&](float logit, gpt_vocab::id id) {
+        if ((int) logits_id.size() < top_k) {
+            logits_id.emplace_back(logit, id);
+            std::push_heap(logits_id.begin(), logits_id.end(), greater);
+            if ((int) logits_id.size() == top_k) {
+                threshold = logits_id.front().first;
+            }
+        } else if (logit > threshold) {
+            std::pop_heap(logits_id.begin(), logits_id.end(), greater);
+            logits_id.back() = std::make_pair(logit, id);
+            std::push_heap(logits_id.begin(), logits_id.end(), greater);
+            threshold = logits_id.front().first;
+        }
+    };
+
+    constexpr int block_size = 16;
+    int i = 0;
+    for (; i + block_size <= n_logits; i += block_size) {
+        const float * block = logits + i;
+        bool any = false;
+        for (int j = 0; j < block_size; ++j) {
+            any |= block[j] > threshold;
+        }
+        if (!any && (int) logits_id.size() == top_k) {
+            continue;
+        }
+        for (int j = 0; j < block_size; ++j) {
+            consider(block[j], i + j);
+        }
+    }
+    for (; i < n_logits; ++i) {
+        consider(logits[i], i);
+    }
 
-    double maxl = -INFINITY;
-    for (const auto & kv : logits_id) {
-        maxl = std::max(maxl, kv.first);
+    for (const auto & [id, logit] : penalized) {
+        logits[id] = logit;
+        // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+        consider(logit < 0.0f ? logit*repeat_penalty : logit/repeat_penalty, id);
     }
 
-    // compute probs for the top K tokens
-    std::vector<double> probs;
-    probs.reserve(logits_id.size());
+    std::sort_heap(logits_id.begin(), logits_id.end(), greater);
 
-    double sum = 0.0;
-    for (const auto & kv : logits_id) {
-        double p = exp(kv.first - maxl);
-        probs.push_back(p);
-        sum += p;
-    }
+    // compute probs for the top K tokens, the first one has the highest logit
+    const float scale = 1.0f/temp;
+    const float maxl = logits_id.front().first;
+    auto & probs = buffers.probs;
+    probs.resize(logits_id.size());
 
-    // normalize the probs
-    for (auto & p : probs) {
-        p /= sum;
+    float sum = 0.0f;
+    for (size_t k = 0; k < logits_id.size(); ++k) {
+        probs[k] = expf((logits_id[k].first - maxl)*scale);
+        sum += probs[k];
     }
 
+    // keep the top tokens with cumulative probability >= P, without normalizing first
+    int n_probs = probs.size();
     if (top_p < 1.0f) {
-        double cumsum = 0.0f;
-        for (int i = 0; i < top_k; i++) {
-            cumsum += probs[i];
-            if (cumsum >= top_p) {
-                top_k = i + 1;
-                probs.resize(top_k);
-                logits_id.resize(top_k);
+        const float target = top_p*sum;
+        float cumsum = 0.0f;
+        for (int k = 0; k < n_probs; ++k) {
+            cumsum += probs[k];
+            if (cumsum >= target) {
+                n_probs = k + 1;
                 break;
             }
         }
+        sum = cumsum;
+    }
 
-        cumsum = 1.0/cumsum;
-        for (int i = 0; i < (int) probs.size(); i++) {
-            probs[i] *= cumsum;
+    std::uniform_real_distribution<float> dist(0.0f, sum);
+    float r = dist(rng);
+    for (int k = 0; k < n_probs - 1; ++k) {
+        r -= probs[k];
+        if (r < 0.0f) {
+            return logits_id[k].second;
         }
     }
-
-    //printf("\n");
-    //for (int i = 0; i < (int) probs.size(); i++) {
-    //    printf("%d: '%s' %f\n", i, vocab.id_to_token.at(logits_id[i].second).c_str(), probs[i]);
-    //}
-    //exit(0);
-
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
-
-    return logits_id[idx].second;
-}
\ No newline at end of file
+    return logits_id[n_probs - 1].second;
+}
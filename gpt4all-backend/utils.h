@@ -2,8 +2,11 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <random>
 #include <thread>
@@ -53,6 +56,23 @@ struct gpt_vocab {
     std::map<id, token> id_to_token;
     std::vector<std::string> special_tokens;
 
+    // byte-level BPE, set up by gpt_vocab_init_bpe
+    bool byte_level = false;
+    std::array<id, 256> byte_to_id;
+    std::unordered_map<uint64_t, std::pair<int32_t, id>> merges; // (left, right) -> (rank, merged)
+
+    // trie over token_to_id for greedy longest-match, set up by gpt_vocab_build_trie
+    std::unordered_map<uint64_t, int32_t> trie_edges; // (node, byte) -> node
+    std::vector<id> trie_ids; // the token each node spells, or -1
+
+    static uint64_t merge_key(id left, id right) {
+        return (uint64_t(uint32_t(left)) << 32) | uint32_t(right);
+    }
+
+    static uint64_t trie_key(int32_t node, char c) {
+        return (uint64_t(uint32_t(node)) << 8) | uint8_t(c);
+    }
+
     void add_special_token(const std::string &token) {
         special_tokens.push_back(token);
     }
@@ -65,6 +85,9 @@ std::map<std::string, int32_t> json_parse(const std::string & fname);
 
 // split text into tokens
 //
+// the text is split into words as by the regex below, by hand, and each word is then tokenized with
+// byte-level BPE or, if the vocab has no merges, by greedy longest match
+//
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
 //
 // Regex (Python):
@@ -75,23 +98,39 @@ std::map<std::string, int32_t> json_parse(const std::string & fname);
 //
 std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text);
 
+// set up byte-level BPE from the merges ("left right", in order of rank) of a GPT-2 style vocab,
+// whose tokens are either in the byte-level alphabet or the raw bytes they stand for,
+// returns false if the vocab isn't byte-level
+bool gpt_vocab_init_bpe(gpt_vocab & vocab, const std::vector<std::string> & merges);
+
+// set up greedy longest-match tokenization over token_to_id
+void gpt_vocab_build_trie(gpt_vocab & vocab);
+
 // load the tokens from encoder.json
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab);
 
+// scratch memory reused by gpt_sample_top_k_top_p so that sampling doesn't allocate
+struct gpt_sample_buffers {
+    std::vector<std::pair<float, gpt_vocab::id>> candidates;
+    std::vector<std::pair<gpt_vocab::id, float>> penalized;
+    std::vector<float> probs;
+};
+
 // sample next token given probabilities for each embedding
 //
 //   - consider only the top K tokens
 //   - from them, consider only the top tokens with cumulative probability > P
 //
-// TODO: not sure if this implementation is correct
+// the logits of the last N tokens are penalized in place and restored before returning
 //
 gpt_vocab::id gpt_sample_top_k_top_p(
         const size_t actualVocabSize,
         const int32_t * last_n_tokens_data,
         int   last_n_tokens_size,
-        const std::vector<float> logits,
+        float * logits,
         int    top_k,
         double top_p,
         double temp,
         float repeat_penalty,
-        std::mt19937 & rng);
+        std::mt19937 & rng,
+        gpt_sample_buffers & buffers);
@@ -23,7 +23,7 @@ public interface ILLModel : IDisposable
         Func<ModelRecalculatingEventArgs, bool>? recalculateCallback = null,
         CancellationToken cancellationToken = default);
 
-    unsafe ulong RestoreStateData(byte* destination);
+    unsafe ulong RestoreStateData(byte* destination, ulong size);
 
     unsafe ulong SaveStateData(byte* source);
 }
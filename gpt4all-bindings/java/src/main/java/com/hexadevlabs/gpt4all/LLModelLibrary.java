@@ -66,7 +66,7 @@ public interface LLModelLibrary {
     boolean llmodel_isModelLoaded(Pointer model);
     @u_int64_t long llmodel_get_state_size(Pointer model);
     @u_int64_t long llmodel_save_state_data(Pointer model, Pointer dest);
-    @u_int64_t long llmodel_restore_state_data(Pointer model, Pointer src);
+    @u_int64_t long llmodel_restore_state_data(Pointer model, Pointer src, @u_int64_t long size);
 
     void llmodel_set_implementation_search_path(String path);
 
@@ -21,19 +21,21 @@ ChatAPI::ChatAPI()
 {
 }
 
-size_t ChatAPI::requiredMem(const std::string &modelPath, int n_ctx, int ngl)
+size_t ChatAPI::requiredMem(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType)
 {
     Q_UNUSED(modelPath);
     Q_UNUSED(n_ctx);
     Q_UNUSED(ngl);
+    Q_UNUSED(kvType);
     return 0;
 }
 
-bool ChatAPI::loadModel(const std::string &modelPath, int n_ctx, int ngl)
+bool ChatAPI::loadModel(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType)
 {
     Q_UNUSED(modelPath);
     Q_UNUSED(n_ctx);
     Q_UNUSED(ngl);
+    Q_UNUSED(kvType);
     return true;
 }
 
@@ -69,9 +71,10 @@ size_t ChatAPI::saveState(uint8_t *dest) const
     return 0;
 }
 
-size_t ChatAPI::restoreState(const uint8_t *src)
+size_t ChatAPI::restoreState(const uint8_t *src, size_t size)
 {
     Q_UNUSED(src);
+    Q_UNUSED(size);
     return 0;
 }
 
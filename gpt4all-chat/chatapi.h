@@ -53,12 +53,12 @@ public:
 
     bool supportsEmbedding() const override { return false; }
     bool supportsCompletion() const override { return true; }
-    bool loadModel(const std::string &modelPath, int n_ctx, int ngl) override;
+    bool loadModel(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) override;
     bool isModelLoaded() const override;
-    size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl) override;
+    size_t requiredMem(const std::string &modelPath, int n_ctx, int ngl, KVCacheType kvType) override;
     size_t stateSize() const override;
     size_t saveState(uint8_t *dest) const override;
-    size_t restoreState(const uint8_t *src) override;
+    size_t restoreState(const uint8_t *src, size_t size) override;
     void prompt(const std::string &prompt,
                 const std::string &promptTemplate,
                 std::function<bool(int32_t)> promptCallback,
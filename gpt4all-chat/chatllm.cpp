@@ -5,6 +5,7 @@
 #include "modellist.h"
 #include "network.h"
 #include "mysettings.h"
+#include "llm.h"
 #include "../gpt4all-backend/llmodel.h"
 
 //#define DEBUG
@@ -13,23 +14,44 @@
 #define GPTJ_INTERNAL_STATE_VERSION 0
 #define LLAMA_INTERNAL_STATE_VERSION 0
 
+// Longest run of tokens matched against the context when prompt lookup proposes tokens
+static constexpr int PROMPT_LOOKUP_NGRAM = 3;
+
+// The loaded models. A chat or server worker takes the model it needs out of the store and gives it
+// back when it is done with it, after which it stays loaded, so that switching back to it is fast,
+// until the least recently used idle models have to be evicted to stay within the memory budget.
+// A model that is in use backs a new context for anyone else who needs it, sharing its weights.
 class LLModelStore {
 public:
     static LLModelStore *globalInstance();
 
-    LLModelInfo acquireModel(); // will block until llmodel is ready
+    // returns an empty info if the model isn't loaded with these params
+    LLModelInfo acquireModel(const QFileInfo &fileInfo, const LLModelInfo::LoadParams &params);
+    void reserveMemory(LLModelInfo &info); // must be called before loading a model that wasn't acquired
+    void shareModel(LLModelInfo &info); // call once a model that wasn't acquired has loaded
     void releaseModel(const LLModelInfo &info); // must be called when you are done
+    void unloadModel(const LLModelInfo &info); // instead of releasing the model, deletes it
 
 private:
-    LLModelStore()
-    {
-        // seed with empty model
-        m_availableModels.append(LLModelInfo());
-    }
+    LLModelStore() {}
     ~LLModelStore() {}
-    QVector<LLModelInfo> m_availableModels;
+    void removeActive(LLModel *model);
+    void evict(QList<LLModelInfo> &evicted);
+    void freeMemory(const LLModelInfo &info);
+    void deleteEvicted(const QList<LLModelInfo> &evicted);
+    void setResident(const QList<LLModelInfo> &infos, bool resident);
+
+    QList<LLModelInfo> m_idleModels; // least recently used first
+    QList<LLModelInfo> m_activeModels; // loaded and in use
+    QHash<QString, int> m_residentCount; // by file path, idle or in use
+    struct SharedWeights {
+        size_t memory = 0;
+        int contexts = 0;
+    };
+    QHash<quint64, SharedWeights> m_weights; // counted once, until the last context using them goes away
+    quint64 m_nextWeights = 1;
+    size_t m_memoryUsed = 0;
     QMutex m_mutex;
-    QWaitCondition m_condition;
     friend class MyLLModelStore;
 };
 
@@ -40,20 +62,182 @@ LLModelStore *LLModelStore::globalInstance()
     return storeInstance();
 }
 
-LLModelInfo LLModelStore::acquireModel()
+LLModelInfo LLModelStore::acquireModel(const QFileInfo &fileInfo, const LLModelInfo::LoadParams &params)
 {
+    LLModelInfo info;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (int i = m_idleModels.size() - 1; i >= 0; --i) {
+            if (m_idleModels.at(i).fileInfo == fileInfo && m_idleModels.at(i).params == params) {
+                m_activeModels.append(m_idleModels.takeAt(i));
+                return m_activeModels.last();
+            }
+        }
+
+        // Only the KV cache and compute buffers of the new context take memory. The weights are counted
+        // as in use while the context is created, so that they aren't freed meanwhile.
+        for (const LLModelInfo &active : m_activeModels) {
+            if (active.fileInfo != fileInfo || active.params != params || !active.contextFactory)
+                continue;
+            info.fileInfo = fileInfo;
+            info.params = params;
+            info.memory = active.memory;
+            info.sharedMemory = active.sharedMemory;
+            info.weights = active.weights;
+            info.contextFactory = active.contextFactory;
+            m_weights[info.weights].contexts += 1;
+            m_memoryUsed += info.memory - std::min(info.memory, info.sharedMemory);
+            m_residentCount[fileInfo.filePath()] += 1;
+            break;
+        }
+    }
+    if (!info.contextFactory)
+        return LLModelInfo();
+
+    // creating a context allocates its KV cache, which other chats don't have to wait for
+    info.model = info.contextFactory->createContext();
+    if (!info.model) {
+        {
+            QMutexLocker locker(&m_mutex);
+            freeMemory(info);
+        }
+        setResident({ info }, false);
+        return LLModelInfo();
+    }
+#if defined(DEBUG_MODEL_LOADING)
+    qDebug() << "sharing weights of" << fileInfo.filePath() << "with" << info.model;
+#endif
+
     QMutexLocker locker(&m_mutex);
-    while (m_availableModels.isEmpty())
-        m_condition.wait(locker.mutex());
-    return m_availableModels.takeFirst();
+    m_activeModels.append(info);
+    return info;
 }
 
-void LLModelStore::releaseModel(const LLModelInfo &info)
+void LLModelStore::reserveMemory(LLModelInfo &info)
 {
+    QList<LLModelInfo> evicted;
+    {
+        QMutexLocker locker(&m_mutex);
+        info.weights = m_nextWeights++;
+        m_weights.insert(info.weights, { std::min(info.memory, info.sharedMemory), 1 });
+        m_memoryUsed += info.memory;
+        m_residentCount[info.fileInfo.filePath()] += 1;
+        evict(evicted);
+    }
+    setResident({ info }, true);
+    deleteEvicted(evicted);
+}
+
+void LLModelStore::shareModel(LLModelInfo &info)
+{
+    // taken on the thread that loaded the model, as other chats may use it while the model is in use
+    info.contextFactory = info.model->contextFactory();
     QMutexLocker locker(&m_mutex);
-    m_availableModels.append(info);
-    Q_ASSERT(m_availableModels.count() < 2);
-    m_condition.wakeAll();
+    m_activeModels.append(info);
+}
+
+void LLModelStore::releaseModel(const LLModelInfo &info)
+{
+    if (!info.model)
+        return;
+
+    QList<LLModelInfo> evicted;
+    {
+        QMutexLocker locker(&m_mutex);
+        removeActive(info.model);
+        m_idleModels.append(info);
+        evict(evicted);
+    }
+    deleteEvicted(evicted);
+}
+
+void LLModelStore::unloadModel(const LLModelInfo &info)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        removeActive(info.model);
+        freeMemory(info);
+    }
+    delete info.model;
+    setResident({ info }, false);
+}
+
+// Called with the mutex held
+void LLModelStore::removeActive(LLModel *model)
+{
+    for (int i = 0; i < m_activeModels.size(); ++i) {
+        if (m_activeModels.at(i).model == model) {
+            m_activeModels.removeAt(i);
+            return;
+        }
+    }
+}
+
+// Called with the mutex held, the evicted models are deleted by deleteEvicted once it is unlocked. Keeps
+// the most recently released model like the store always did, even when it alone exceeds the budget.
+void LLModelStore::evict(QList<LLModelInfo> &evicted)
+{
+    qint64 budgetGB = MySettings::globalInstance()->modelMemoryBudget();
+    if (budgetGB <= 0)
+        budgetGB = LLM::globalInstance()->systemTotalRAMInGB() / 2;
+    const size_t budget = size_t(budgetGB) << 30;
+
+    while (m_memoryUsed > budget && m_idleModels.size() > 1) {
+        LLModelInfo info = m_idleModels.takeFirst();
+#if defined(DEBUG_MODEL_LOADING)
+        qDebug() << "evicting model" << info.fileInfo.filePath() << info.model;
+#endif
+        freeMemory(info);
+        evicted.append(info);
+    }
+}
+
+// Called with the mutex held. The shared weights are only freed with the last context using them.
+void LLModelStore::freeMemory(const LLModelInfo &info)
+{
+    size_t memory = info.memory - std::min(info.memory, info.sharedMemory);
+    auto it = m_weights.find(info.weights);
+    if (it != m_weights.end() && --it->contexts <= 0) {
+        memory += it->memory;
+        m_weights.erase(it);
+    }
+    m_memoryUsed -= std::min(m_memoryUsed, memory);
+}
+
+void LLModelStore::deleteEvicted(const QList<LLModelInfo> &evicted)
+{
+    for (const LLModelInfo &info : evicted)
+        delete info.model;
+    setResident(evicted, false);
+}
+
+void LLModelStore::setResident(const QList<LLModelInfo> &infos, bool resident)
+{
+    for (const LLModelInfo &info : infos) {
+        const QString path = info.fileInfo.filePath();
+        {
+            QMutexLocker locker(&m_mutex);
+            if (!resident) {
+                auto it = m_residentCount.find(path);
+                if (it == m_residentCount.end())
+                    continue;
+                if (--*it > 0)
+                    continue;
+                m_residentCount.erase(it);
+            }
+        }
+        // the model list lives on the main thread, where the updates posted by the chat threads may arrive
+        // in any order, so it is told whether the model is resident by the time the update arrives
+        const QString filename = info.fileInfo.fileName();
+        QMetaObject::invokeMethod(ModelList::globalInstance(), [this, path, filename] {
+            bool isResident;
+            {
+                QMutexLocker locker(&m_mutex);
+                isResident = m_residentCount.contains(path);
+            }
+            ModelList::globalInstance()->updateDataByFilename(filename, {{ ModelList::IsResidentRole, isResident }});
+        }, Qt::QueuedConnection);
+    }
 }
 
 ChatLLM::ChatLLM(Chat *parent, bool isServer)
@@ -84,6 +268,7 @@ ChatLLM::ChatLLM(Chat *parent, bool isServer)
     connect(&m_llmThread, &QThread::started, this, &ChatLLM::handleThreadStarted);
     connect(MySettings::globalInstance(), &MySettings::forceMetalChanged, this, &ChatLLM::handleForceMetalChanged);
     connect(MySettings::globalInstance(), &MySettings::deviceChanged, this, &ChatLLM::handleDeviceChanged);
+    connect(MySettings::globalInstance(), &MySettings::draftModelChanged, this, &ChatLLM::handleDraftModelChanged);
 
     // The following are blocking operations and will block the llm thread
     connect(this, &ChatLLM::requestRetrieveFromDB, LocalDocs::globalInstance()->database(), &Database::retrieveFromDB,
@@ -103,12 +288,13 @@ void ChatLLM::destroy() {
     m_llmThread.quit();
     m_llmThread.wait();
 
-    // The only time we should have a model loaded here is on shutdown
+    // The only time we should have a model loaded here is on shutdown or for the server
     // as we explicitly unload the model in all other circumstances
     if (isModelLoaded()) {
-        delete m_llModelInfo.model;
-        m_llModelInfo.model = nullptr;
+        LLModelStore::globalInstance()->unloadModel(m_llModelInfo);
+        m_llModelInfo = LLModelInfo();
     }
+    unloadDraftModel();
 }
 
 void ChatLLM::handleThreadStarted()
@@ -141,6 +327,12 @@ void ChatLLM::handleDeviceChanged()
     }
 }
 
+void ChatLLM::handleDraftModelChanged(const ModelInfo &modelInfo)
+{
+    if (isModelLoaded() && modelInfo.id() == m_modelInfo.id())
+        loadDraftModel();
+}
+
 bool ChatLLM::loadDefaultModel()
 {
     ModelInfo defaultModel = ModelList::globalInstance()->defaultModelInfo();
@@ -168,16 +360,13 @@ bool ChatLLM::trySwitchContextOfLoadedModel(const ModelInfo &modelInfo)
     QString filePath = modelInfo.dirpath + modelInfo.filename();
     QFileInfo fileInfo(filePath);
 
-    m_llModelInfo = LLModelStore::globalInstance()->acquireModel();
+    m_llModelInfo = LLModelStore::globalInstance()->acquireModel(fileInfo, loadParams(modelInfo));
 #if defined(DEBUG_MODEL_LOADING)
         qDebug() << "acquired model from store" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
 
-    // The store gave us no already loaded model, the wrong type of model, then give it back to the
-    // store and fail
-    if (!m_llModelInfo.model || m_llModelInfo.fileInfo != fileInfo) {
-        LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
-        m_llModelInfo = LLModelInfo();
+    // The store doesn't have this model loaded, then fail
+    if (!m_llModelInfo.model) {
         m_shouldTrySwitchContext = false;
         emit trySwitchContextOfLoadedModelCompleted(false);
         return false;
@@ -195,6 +384,7 @@ bool ChatLLM::trySwitchContextOfLoadedModel(const ModelInfo &modelInfo)
     restoreState();
     emit modelLoadingPercentageChanged(1.0f);
     emit trySwitchContextOfLoadedModelCompleted(true);
+    loadDraftModel();
     processSystemPrompt();
     return true;
 }
@@ -203,7 +393,7 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
 {
     // This is a complicated method because N different possible threads are interested in the outcome
     // of this method. Why? Because we have a main/gui thread trying to monitor the state of N different
-    // possible chat threads all vying for a single resource - the currently loaded model - as the user
+    // possible chat threads all vying for a limited resource - the loaded models - as the user
     // switches back and forth between chats. It is important for our main/gui thread to never block
     // but simultaneously always have up2date information with regards to which chat has the model loaded
     // and what the type and name of that model is. I've tried to comment extensively in this method
@@ -215,60 +405,48 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
 
     QString filePath = modelInfo.dirpath + modelInfo.filename();
     QFileInfo fileInfo(filePath);
+    const LLModelInfo::LoadParams params = loadParams(modelInfo);
 
-    // We have a live model, but it isn't the one we want
-    bool alreadyAcquired = isModelLoaded();
-    if (alreadyAcquired) {
+    // We have a live model, but it isn't the one we want. Give it back to the store, which keeps it
+    // loaded for as long as its memory budget allows.
+    if (isModelLoaded()) {
         resetContext();
 #if defined(DEBUG_MODEL_LOADING)
-        qDebug() << "already acquired model deleted" << m_llmThread.objectName() << m_llModelInfo.model;
+        qDebug() << "already acquired model released" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
-        delete m_llModelInfo.model;
-        m_llModelInfo.model = nullptr;
+        LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
+        m_llModelInfo = LLModelInfo();
         emit modelLoadingPercentageChanged(std::numeric_limits<float>::min()); // small non-zero positive value
-    } else if (!m_isServer) {
-        // This is a blocking call that tries to retrieve the model we need from the model store.
-        // If it succeeds, then we just have to restore state. If the store has never had a model
-        // returned to it, then the modelInfo.model pointer should be null which will happen on startup
-        m_llModelInfo = LLModelStore::globalInstance()->acquireModel();
+    }
+
+    // Try to retrieve the model we need from the model store. If it succeeds, then we just have to
+    // restore state.
+    m_llModelInfo = LLModelStore::globalInstance()->acquireModel(fileInfo, params);
 #if defined(DEBUG_MODEL_LOADING)
-        qDebug() << "acquired model from store" << m_llmThread.objectName() << m_llModelInfo.model;
+    qDebug() << "acquired model from store" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
-        // At this point it is possible that while we were blocked waiting to acquire the model from the
-        // store, that our state was changed to not be loaded. If this is the case, release the model
-        // back into the store and quit loading
-        if (!m_shouldBeLoaded) {
+    if (m_llModelInfo.model && !m_reloadingToChangeVariant) {
 #if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "no longer need model" << m_llmThread.objectName() << m_llModelInfo.model;
+        qDebug() << "store had our model" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
-            LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
-            m_llModelInfo = LLModelInfo();
-            emit modelLoadingPercentageChanged(0.0f);
-            return false;
+        restoreState();
+        emit modelLoadingPercentageChanged(1.0f);
+        setModelInfo(modelInfo);
+        Q_ASSERT(!m_modelInfo.filename().isEmpty());
+        if (m_modelInfo.filename().isEmpty())
+            emit modelLoadingError(QString("Modelinfo is left null for %1").arg(modelInfo.filename()));
+        else {
+            loadDraftModel();
+            processSystemPrompt();
         }
-
-        // Check if the store just gave us exactly the model we were looking for
-        if (m_llModelInfo.model && m_llModelInfo.fileInfo == fileInfo && !m_reloadingToChangeVariant) {
-#if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "store had our model" << m_llmThread.objectName() << m_llModelInfo.model;
-#endif
-            restoreState();
-            emit modelLoadingPercentageChanged(1.0f);
-            setModelInfo(modelInfo);
-            Q_ASSERT(!m_modelInfo.filename().isEmpty());
-            if (m_modelInfo.filename().isEmpty())
-                emit modelLoadingError(QString("Modelinfo is left null for %1").arg(modelInfo.filename()));
-            else
-                processSystemPrompt();
-            return true;
-        } else {
-            // Release the memory since we have to switch to a different model.
+        return true;
+    } else if (m_llModelInfo.model) {
+        // It was loaded for the previous variant/device
 #if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "deleting model" << m_llmThread.objectName() << m_llModelInfo.model;
+        qDebug() << "deleting model" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
-            delete m_llModelInfo.model;
-            m_llModelInfo.model = nullptr;
-        }
+        LLModelStore::globalInstance()->unloadModel(m_llModelInfo);
+        m_llModelInfo = LLModelInfo();
     }
 
     // Guarantee we've released the previous models memory
@@ -276,6 +454,7 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
 
     // Store the file info in the modelInfo in case we have an error loading
     m_llModelInfo.fileInfo = fileInfo;
+    m_llModelInfo.params = params;
 
     if (fileInfo.exists()) {
         if (modelInfo.isOnline) {
@@ -297,19 +476,30 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
             model->setRequestURL(modelInfo.url());
             model->setAPIKey(apiKey);
             m_llModelInfo.model = model;
+            LLModelStore::globalInstance()->reserveMemory(m_llModelInfo);
         } else {
-            auto n_ctx = MySettings::globalInstance()->modelContextLength(modelInfo);
+            auto n_ctx = params.n_ctx;
             m_ctx.n_ctx = n_ctx;
-            auto ngl = MySettings::globalInstance()->modelGpuLayers(modelInfo);
+            auto ngl = params.ngl;
+            auto kvType = params.kvType;
 
             std::string buildVariant = "auto";
 #if defined(Q_OS_MAC) && defined(__arm__)
-            if (m_forceMetal)
+            if (params.forceMetal)
                 buildVariant = "metal";
 #endif
             m_llModelInfo.model = LLModel::Implementation::construct(filePath.toStdString(), buildVariant, n_ctx);
 
             if (m_llModelInfo.model) {
+                // Make room for the model among the ones the store keeps loaded
+                LLModel::MemoryEstimate estimate;
+                const bool haveEstimate
+                    = m_llModelInfo.model->estimateMemory(filePath.toStdString(), n_ctx, ngl, kvType, estimate);
+                m_llModelInfo.memory = haveEstimate
+                    ? estimate.total() : m_llModelInfo.model->requiredMem(filePath.toStdString(), n_ctx, ngl, kvType);
+                m_llModelInfo.sharedMemory = haveEstimate ? estimate.weights : 0;
+                LLModelStore::globalInstance()->reserveMemory(m_llModelInfo);
+
                 if (m_llModelInfo.model->isModelBlacklisted(filePath.toStdString())) {
                     static QSet<QString> warned;
                     auto fname = modelInfo.filename();
@@ -328,11 +518,12 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
 
                 // Pick the best match for the device
                 QString actualDevice = m_llModelInfo.model->implementation().buildVariant() == "metal" ? "Metal" : "CPU";
-                const QString requestedDevice = MySettings::globalInstance()->device();
+                const QString requestedDevice = params.device;
                 if (requestedDevice == "CPU") {
                     emit reportFallbackReason(""); // fallback not applicable
                 } else {
-                    const size_t requiredMemory = m_llModelInfo.model->requiredMem(filePath.toStdString(), n_ctx, ngl);
+                    // only the offloaded part has to fit on the device
+                    const size_t requiredMemory = haveEstimate ? estimate.gpu : m_llModelInfo.memory;
                     std::vector<LLModel::GPUDevice> availableDevices = m_llModelInfo.model->availableGPUDevices(requiredMemory);
                     LLModel::GPUDevice *device = nullptr;
 
@@ -361,14 +552,14 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
                 // Report which device we're actually using
                 emit reportDevice(actualDevice);
 
-                bool success = m_llModelInfo.model->loadModel(filePath.toStdString(), n_ctx, ngl);
+                bool success = m_llModelInfo.model->loadModel(filePath.toStdString(), n_ctx, ngl, kvType);
                 if (actualDevice == "CPU") {
                     // we asked llama.cpp to use the CPU
                 } else if (!success) {
                     // llama_init_from_file returned nullptr
                     emit reportDevice("CPU");
                     emit reportFallbackReason("<br>GPU loading failed (out of VRAM?)");
-                    success = m_llModelInfo.model->loadModel(filePath.toStdString(), n_ctx, 0);
+                    success = m_llModelInfo.model->loadModel(filePath.toStdString(), n_ctx, 0, kvType);
                 } else if (!m_llModelInfo.model->usingGPUDevice()) {
                     // ggml_vk_init was not called in llama.cpp
                     // We might have had to fallback to CPU after load if the model is not possible to accelerate
@@ -378,10 +569,7 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
                 }
 
                 if (!success) {
-                    delete m_llModelInfo.model;
-                    m_llModelInfo.model = nullptr;
-                    if (!m_isServer)
-                        LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
+                    LLModelStore::globalInstance()->unloadModel(m_llModelInfo);
                     m_llModelInfo = LLModelInfo();
                     emit modelLoadingError(QString("Could not load model due to invalid model file for %1").arg(modelInfo.filename()));
                 } else {
@@ -390,18 +578,15 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
                     case 'G': m_llModelType = LLModelType::GPTJ_; break;
                     default:
                         {
-                            delete m_llModelInfo.model;
-                            m_llModelInfo.model = nullptr;
-                            if (!m_isServer)
-                                LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
+                            LLModelStore::globalInstance()->unloadModel(m_llModelInfo);
                             m_llModelInfo = LLModelInfo();
                             emit modelLoadingError(QString("Could not determine model type for %1").arg(modelInfo.filename()));
                         }
                     }
+                    if (m_llModelInfo.model)
+                        LLModelStore::globalInstance()->shareModel(m_llModelInfo);
                 }
             } else {
-                if (!m_isServer)
-                    LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
                 m_llModelInfo = LLModelInfo();
                 emit modelLoadingError(QString("Could not load model due to invalid format for %1").arg(modelInfo.filename()));
             }
@@ -423,14 +608,13 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
         } else
             emit sendModelLoaded();
     } else {
-        if (!m_isServer)
-            LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
         m_llModelInfo = LLModelInfo();
         emit modelLoadingError(QString("Could not find file for model %1").arg(modelInfo.filename()));
     }
 
     if (m_llModelInfo.model) {
         setModelInfo(modelInfo);
+        loadDraftModel();
         processSystemPrompt();
     }
     return m_llModelInfo.model;
@@ -522,13 +706,10 @@ void ChatLLM::modelChangeRequested(const ModelInfo &modelInfo)
 
 bool ChatLLM::handlePrompt(int32_t token)
 {
-    // m_promptResponseTokens is related to last prompt/response not
-    // the entire context window which we can reset on regenerate prompt
 #if defined(DEBUG)
     qDebug() << "prompt process" << m_llmThread.objectName() << token;
 #endif
     ++m_promptTokens;
-    ++m_promptResponseTokens;
     m_timer->start();
     return !m_stopGenerating;
 }
@@ -547,11 +728,7 @@ bool ChatLLM::handleResponse(int32_t token, const std::string &response)
         return false;
     }
 
-    // m_promptResponseTokens is related to last prompt/response not
-    // the entire context window which we can reset on regenerate prompt
-    ++m_promptResponseTokens;
     m_timer->inc();
-    Q_ASSERT(!response.empty());
     m_response.append(response);
     emit responseChanged(QString::fromStdString(remove_leading_whitespace(m_response)));
     return !m_stopGenerating;
@@ -611,8 +788,6 @@ bool ChatLLM::promptInternal(const QList<QString> &collectionList, const QString
     for (const ResultInfo &info : databaseResults)
         docsContext.append(info.text);
 
-    int n_threads = MySettings::globalInstance()->threadCount();
-
     m_stopGenerating = false;
     auto promptFunc = std::bind(&ChatLLM::handlePrompt, this, std::placeholders::_1);
     auto responseFunc = std::bind(&ChatLLM::handleResponse, this, std::placeholders::_1,
@@ -627,18 +802,24 @@ bool ChatLLM::promptInternal(const QList<QString> &collectionList, const QString
     m_ctx.n_batch = n_batch;
     m_ctx.repeat_penalty = repeat_penalty;
     m_ctx.repeat_last_n = repeat_penalty_tokens;
-    m_llModelInfo.model->setThreadCount(n_threads);
+    applyThreadSettings();
+    applyDraftSettings();
 #if defined(DEBUG)
     printf("%s", qPrintable(prompt));
     fflush(stdout);
 #endif
     m_timer->start();
+    const int32_t n_past = m_ctx.n_past;
     if (!docsContext.isEmpty()) {
         auto old_n_predict = std::exchange(m_ctx.n_predict, 0); // decode localdocs context without a response
         m_llModelInfo.model->prompt(docsContext.join("\n").toStdString(), "%1", promptFunc, responseFunc, recalcFunc, m_ctx);
         m_ctx.n_predict = old_n_predict; // now we are ready for a response
     }
     m_llModelInfo.model->prompt(prompt.toStdString(), promptTemplate.toStdString(), promptFunc, responseFunc, recalcFunc, m_ctx);
+    // m_promptResponseTokens is related to last prompt/response not the entire context window which we
+    // can reset on regenerate prompt. It is counted from the context as not every response token is
+    // passed to handleResponse.
+    m_promptResponseTokens += std::max(0, m_ctx.n_past - n_past);
 #if defined(DEBUG)
     printf("\n");
     fflush(stdout);
@@ -700,13 +881,13 @@ void ChatLLM::unloadModel()
 #endif
 
     if (m_forceUnloadModel) {
-        delete m_llModelInfo.model;
-        m_llModelInfo.model = nullptr;
+        LLModelStore::globalInstance()->unloadModel(m_llModelInfo);
         m_forceUnloadModel = false;
+    } else {
+        LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
     }
-
-    LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
     m_llModelInfo = LLModelInfo();
+    unloadDraftModel();
 }
 
 void ChatLLM::reloadModel()
@@ -970,12 +1151,172 @@ void ChatLLM::saveState()
         return;
     }
 
-    const size_t stateSize = m_llModelInfo.model->stateSize();
-    m_state.resize(stateSize);
+    m_state.resize(m_llModelInfo.model->stateSize());
+    m_state.resize(m_llModelInfo.model->saveState(static_cast<uint8_t*>(reinterpret_cast<void*>(m_state.data()))));
 #if defined(DEBUG)
     qDebug() << "saveState" << m_llmThread.objectName() << "size:" << m_state.size();
 #endif
-    m_llModelInfo.model->saveState(static_cast<uint8_t*>(reinterpret_cast<void*>(m_state.data())));
+}
+
+void ChatLLM::restorePromptPrefix(PrefixCache &cache, const QString &prompt, const QString &promptTemplate)
+{
+    if (!isModelLoaded() || m_llModelType == LLModelType::API_)
+        return;
+
+    cache.setModel(m_modelInfo.filename());
+    const std::vector<int32_t> tokens = m_llModelInfo.model->promptTokens(prompt.toStdString(),
+        promptTemplate.toStdString());
+    const PrefixCache::Entry *entry = cache.longestPrefix(tokens);
+    if (!entry)
+        return;
+
+#if defined(DEBUG)
+    qDebug() << "restorePromptPrefix" << m_llmThread.objectName() << "cached tokens:" << entry->tokens.size();
+#endif
+    if (!m_llModelInfo.model->restoreState(reinterpret_cast<const uint8_t*>(entry->state.constData()),
+                                           entry->state.size()))
+        return;
+
+    // the model only decodes the part of the prompt that doesn't match these
+    m_ctx.tokens = entry->tokens;
+    m_ctx.n_past = 0;
+    m_ctx.n_cached = int32_t(entry->tokens.size());
+}
+
+void ChatLLM::savePromptPrefix(PrefixCache &cache)
+{
+    if (!isModelLoaded() || m_llModelType == LLModelType::API_ || m_ctx.n_past != int32_t(m_ctx.tokens.size()))
+        return;
+
+    QByteArray state(m_llModelInfo.model->stateSize(), Qt::Uninitialized);
+    state.resize(m_llModelInfo.model->saveState(reinterpret_cast<uint8_t*>(state.data())));
+    cache.insert(m_ctx.tokens, state);
+}
+
+// Parses a list of CPUs like "0-7,16" as taskset takes it
+static std::vector<int> parseCoreList(const QString &list)
+{
+    std::vector<int> cores;
+    for (const QString &part : list.split(',', Qt::SkipEmptyParts)) {
+        const QStringList range = part.trimmed().split('-');
+        bool firstOk, lastOk;
+        const int first = range.first().toInt(&firstOk);
+        const int last = range.last().toInt(&lastOk);
+        if (range.size() > 2 || !firstOk || !lastOk || first < 0 || last < first) {
+            qWarning() << "ERROR: invalid CPU list" << list;
+            return {};
+        }
+        for (int core = first; core <= last; ++core)
+            cores.push_back(core);
+    }
+    return cores;
+}
+
+void ChatLLM::applyThreadSettings()
+{
+    const MySettings *settings = MySettings::globalInstance();
+    m_llModelInfo.model->setThreadCount(settings->threadCount());
+    if (const int n_threads_batch = settings->batchThreadCount())
+        m_llModelInfo.model->setBatchThreadCount(n_threads_batch);
+
+    const QString affinity = settings->threadAffinity();
+    if (affinity == "Physical cores")
+        m_llModelInfo.model->setThreadAffinity(LLModel::AffinityPolicy::PhysicalCores);
+    else if (affinity == "Core set")
+        m_llModelInfo.model->setThreadAffinity(LLModel::AffinityPolicy::CoreSet,
+            parseCoreList(settings->threadAffinityCores()));
+    else
+        m_llModelInfo.model->setThreadAffinity(LLModel::AffinityPolicy::None);
+}
+
+// Loads the draft model chosen for speculative decoding with the current model, or drops the one
+// loaded if that changed. Called when the model loads or the setting changes, never mid-prompt.
+void ChatLLM::loadDraftModel()
+{
+    const QString filename = isModelLoaded() && m_llModelType != LLModelType::API_
+        ? MySettings::globalInstance()->modelDraftModel(m_modelInfo) : QString();
+    ModelInfo draftInfo;
+    LLModelInfo::LoadParams params;
+    if (!filename.isEmpty()) {
+        draftInfo = ModelList::globalInstance()->modelInfoByFilename(filename);
+        params = loadParams(draftInfo);
+        params.n_ctx = m_llModelInfo.params.n_ctx; // the draft has to hold everything the model does
+    }
+    if (filename == m_draftModelFile && params == m_draftModelInfo.params)
+        return;
+
+    unloadDraftModel();
+    m_draftModelFile = filename;
+    if (filename.isEmpty())
+        return;
+
+    const QString filePath = draftInfo.dirpath + draftInfo.filename();
+    const std::string path = filePath.toStdString();
+    m_draftModelInfo.fileInfo = QFileInfo(filePath);
+    m_draftModelInfo.params = params;
+    if (draftInfo.filename().isEmpty() || !m_draftModelInfo.fileInfo.exists()) {
+        emit modelLoadingError(QString("Could not find file for draft model %1").arg(filename));
+        return;
+    }
+
+    std::string buildVariant = "auto";
+#if defined(Q_OS_MAC) && defined(__arm__)
+    if (params.forceMetal)
+        buildVariant = "metal";
+#endif
+    m_draftModelInfo.model = LLModel::Implementation::construct(path, buildVariant, params.n_ctx);
+    if (!m_draftModelInfo.model) {
+        m_draftModelInfo = LLModelInfo();
+        m_draftModelInfo.params = params;
+        emit modelLoadingError(QString("Could not load draft model due to invalid format for %1").arg(filename));
+        return;
+    }
+
+    // the draft model counts against the memory budget like any other loaded model
+    LLModel::MemoryEstimate estimate;
+    m_draftModelInfo.memory = m_draftModelInfo.model->estimateMemory(path, params.n_ctx, params.ngl, params.kvType, estimate)
+        ? estimate.total() : m_draftModelInfo.model->requiredMem(path, params.n_ctx, params.ngl, params.kvType);
+    LLModelStore::globalInstance()->reserveMemory(m_draftModelInfo);
+    if (!m_draftModelInfo.model->loadModel(path, params.n_ctx, params.ngl, params.kvType)) {
+        LLModelStore::globalInstance()->unloadModel(m_draftModelInfo);
+        m_draftModelInfo = LLModelInfo();
+        m_draftModelInfo.params = params;
+        emit modelLoadingError(QString("Could not load draft model due to invalid model file for %1").arg(filename));
+    }
+}
+
+// Without a draft model, tokens may still be proposed by prompt lookup.
+void ChatLLM::applyDraftSettings()
+{
+    const MySettings *settings = MySettings::globalInstance();
+    m_ctx.draft = m_draftModelInfo.model;
+    const bool promptLookup = m_llModelType != LLModelType::API_ && settings->modelPromptLookup(m_modelInfo);
+    m_ctx.n_lookup_ngram = promptLookup ? PROMPT_LOOKUP_NGRAM : 0;
+    m_ctx.n_draft = m_draftModelInfo.model || promptLookup ? settings->modelDraftTokens(m_modelInfo) : 0;
+}
+
+void ChatLLM::unloadDraftModel()
+{
+    m_ctx.draft = nullptr;
+    m_ctx.n_draft = 0;
+    m_ctx.n_draft_past = 0;
+    m_ctx.n_lookup_ngram = 0;
+    if (m_draftModelInfo.model)
+        LLModelStore::globalInstance()->unloadModel(m_draftModelInfo);
+    m_draftModelInfo = LLModelInfo();
+    m_draftModelFile.clear();
+}
+
+LLModelInfo::LoadParams ChatLLM::loadParams(const ModelInfo &modelInfo) const
+{
+    const MySettings *settings = MySettings::globalInstance();
+    LLModelInfo::LoadParams params;
+    params.n_ctx = settings->modelContextLength(modelInfo);
+    params.ngl = settings->modelGpuLayers(modelInfo);
+    params.kvType = LLModel::KVCacheType(settings->modelKVCacheType(modelInfo));
+    params.device = settings->device();
+    params.forceMetal = m_forceMetal;
+    return params;
 }
 
 void ChatLLM::restoreState()
@@ -1002,11 +1343,12 @@ void ChatLLM::restoreState()
     if (m_state.isEmpty())
         return;
 
-    if (m_llModelInfo.model->stateSize() == m_state.size()) {
-        m_llModelInfo.model->restoreState(static_cast<const uint8_t*>(reinterpret_cast<void*>(m_state.data())));
+    // the backend refuses a state of another size, version, model or context
+    if (m_llModelInfo.model->restoreState(static_cast<const uint8_t*>(reinterpret_cast<void*>(m_state.data())),
+                                          m_state.size())) {
         m_processedSystemPrompt = true;
     } else {
-        qWarning() << "restoring state from text because" << m_llModelInfo.model->stateSize() << "!=" << m_state.size();
+        qWarning() << "restoring state from text because the saved state does not match the model";
         m_restoreStateFromText = true;
     }
 
@@ -1041,7 +1383,6 @@ void ChatLLM::processSystemPrompt()
     const int32_t n_batch = MySettings::globalInstance()->modelPromptBatchSize(m_modelInfo);
     const float repeat_penalty = MySettings::globalInstance()->modelRepeatPenalty(m_modelInfo);
     const int32_t repeat_penalty_tokens = MySettings::globalInstance()->modelRepeatPenaltyTokens(m_modelInfo);
-    int n_threads = MySettings::globalInstance()->threadCount();
     m_ctx.n_predict = n_predict;
     m_ctx.top_k = top_k;
     m_ctx.top_p = top_p;
@@ -1050,7 +1391,7 @@ void ChatLLM::processSystemPrompt()
     m_ctx.n_batch = n_batch;
     m_ctx.repeat_penalty = repeat_penalty;
     m_ctx.repeat_last_n = repeat_penalty_tokens;
-    m_llModelInfo.model->setThreadCount(n_threads);
+    applyThreadSettings();
 #if defined(DEBUG)
     printf("%s", qPrintable(QString::fromStdString(systemPrompt)));
     fflush(stdout);
@@ -1090,7 +1431,6 @@ void ChatLLM::processRestoreStateFromText()
     const int32_t n_batch = MySettings::globalInstance()->modelPromptBatchSize(m_modelInfo);
     const float repeat_penalty = MySettings::globalInstance()->modelRepeatPenalty(m_modelInfo);
     const int32_t repeat_penalty_tokens = MySettings::globalInstance()->modelRepeatPenaltyTokens(m_modelInfo);
-    int n_threads = MySettings::globalInstance()->threadCount();
     m_ctx.n_predict = n_predict;
     m_ctx.top_k = top_k;
     m_ctx.top_p = top_p;
@@ -1099,7 +1439,7 @@ void ChatLLM::processRestoreStateFromText()
     m_ctx.n_batch = n_batch;
     m_ctx.repeat_penalty = repeat_penalty;
     m_ctx.repeat_last_n = repeat_penalty_tokens;
-    m_llModelInfo.model->setThreadCount(n_threads);
+    applyThreadSettings();
 
     auto it = m_stateFromText.begin();
     while (it < m_stateFromText.end()) {
@@ -5,8 +5,11 @@
 #include <QThread>
 #include <QFileInfo>
 
+#include <memory>
+
 #include "database.h"
 #include "modellist.h"
+#include "prefixcache.h"
 #include "../gpt4all-backend/llmodel.h"
 
 enum LLModelType {
@@ -16,8 +19,23 @@ enum LLModelType {
 };
 
 struct LLModelInfo {
+    // What a model was loaded with, the store only hands a loaded model out for the same settings
+    struct LoadParams {
+        int n_ctx = 0;
+        int ngl = 0;
+        LLModel::KVCacheType kvType = LLModel::KVCacheType::F16;
+        QString device;
+        bool forceMetal = false;
+        bool operator==(const LoadParams &other) const = default;
+    };
+
     LLModel *model = nullptr;
     QFileInfo fileInfo;
+    LoadParams params;
+    size_t memory = 0; // estimated, counted against the memory budget of the model store
+    size_t sharedMemory = 0; // part of memory that contexts created from the model share
+    quint64 weights = 0; // identifies the weights of the contexts sharing them, set by the model store
+    std::shared_ptr<const LLModel::ContextFactory> contextFactory; // taken by the model store once loaded
     // NOTE: This does not store the model type or name on purpose as this is left for ChatLLM which
     // must be able to serialize the information even if it is in the unloaded state
 };
@@ -113,6 +131,7 @@ public Q_SLOTS:
     void handleThreadStarted();
     void handleForceMetalChanged(bool forceMetal);
     void handleDeviceChanged();
+    void handleDraftModelChanged(const ModelInfo &modelInfo);
     void processSystemPrompt();
     void processRestoreStateFromText();
 
@@ -143,8 +162,8 @@ protected:
     bool promptInternal(const QList<QString> &collectionList, const QString &prompt, const QString &promptTemplate,
         int32_t n_predict, int32_t top_k, float top_p, float min_p, float temp, int32_t n_batch, float repeat_penalty,
         int32_t repeat_penalty_tokens);
-    bool handlePrompt(int32_t token);
-    bool handleResponse(int32_t token, const std::string &response);
+    virtual bool handlePrompt(int32_t token);
+    virtual bool handleResponse(int32_t token, const std::string &response);
     bool handleRecalculate(bool isRecalc);
     bool handleNamePrompt(int32_t token);
     bool handleNameResponse(int32_t token, const std::string &response);
@@ -157,6 +176,13 @@ protected:
     bool handleRestoreStateFromTextRecalculate(bool isRecalc);
     void saveState();
     void restoreState();
+    void restorePromptPrefix(PrefixCache &cache, const QString &prompt, const QString &promptTemplate);
+    void savePromptPrefix(PrefixCache &cache);
+    void applyThreadSettings();
+    void loadDraftModel();
+    void applyDraftSettings();
+    void unloadDraftModel();
+    LLModelInfo::LoadParams loadParams(const ModelInfo &modelInfo) const;
 
 protected:
     LLModel::PromptContext m_ctx;
@@ -184,6 +210,8 @@ private:
     bool m_processedSystemPrompt;
     bool m_restoreStateFromText;
     QVector<QPair<QString, QString>> m_stateFromText;
+    LLModelInfo m_draftModelInfo;
+    QString m_draftModelFile;
 };
 
 #endif // CHATLLM_H
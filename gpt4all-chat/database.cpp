@@ -6,6 +6,9 @@
 #include <QTimer>
 #include <QPdfDocument>
 
+#include <algorithm>
+#include <cctype>
+
 //#define DEBUG
 //#define DEBUG_EXAMPLE
 
@@ -14,7 +17,8 @@
 const auto INSERT_CHUNK_SQL = QLatin1String(R"(
     insert into chunks(document_id, chunk_text,
         file, title, author, subject, keywords, page, line_from, line_to)
-        values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?);
+        values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
+        returning chunk_id;
     )");
 
 const auto INSERT_CHUNK_FTS_SQL = QLatin1String(R"(
@@ -70,6 +74,71 @@ const auto SELECT_NGRAM_SQL = QLatin1String(R"(
     limit %2;
     )");
 
+// Pragmas for the indexing phase. The journal is in WAL mode, where synchronous=normal can lose the
+// last transactions on power loss but never corrupts the db, and they are simply indexed again.
+const auto INDEXING_PRAGMAS_SQL = {
+    QLatin1String("pragma synchronous = normal;"),
+    QLatin1String("pragma cache_size = -65536;"), // KiB
+};
+
+const auto IDLE_PRAGMAS_SQL = {
+    QLatin1String("pragma synchronous = full;"),
+    QLatin1String("pragma cache_size = -2000;"),
+    QLatin1String("pragma wal_checkpoint(passive);"),
+};
+
+// Inserts the chunks of an indexing session with statements that are only prepared once
+class ChunkWriter
+{
+public:
+    bool prepare()
+    {
+        if (!m_chunkQuery.prepare(INSERT_CHUNK_SQL)) {
+            m_lastError = m_chunkQuery.lastError();
+            return false;
+        }
+        if (!m_ftsQuery.prepare(INSERT_CHUNK_FTS_SQL)) {
+            m_lastError = m_ftsQuery.lastError();
+            return false;
+        }
+        return true;
+    }
+
+    bool insert(int document_id, const QString &chunk_text, const QString &file, const QString &title,
+        const QString &author, const QString &subject, const QString &keywords, int page, int from, int to,
+        int *chunk_id)
+    {
+        const QVariant values[] = { chunk_text, file, title, author, subject, keywords, page, from, to };
+
+        m_chunkQuery.bindValue(0, document_id);
+        for (int i = 0; i < int(std::size(values)); ++i)
+            m_chunkQuery.bindValue(i + 1, values[i]);
+        if (!m_chunkQuery.exec() || !m_chunkQuery.next()) {
+            m_lastError = m_chunkQuery.lastError();
+            return false;
+        }
+        *chunk_id = m_chunkQuery.value(0).toInt();
+        m_chunkQuery.finish();
+
+        m_ftsQuery.bindValue(0, document_id);
+        m_ftsQuery.bindValue(1, *chunk_id);
+        for (int i = 0; i < int(std::size(values)); ++i)
+            m_ftsQuery.bindValue(i + 2, values[i]);
+        if (!m_ftsQuery.exec()) {
+            m_lastError = m_ftsQuery.lastError();
+            return false;
+        }
+        return true;
+    }
+
+    QSqlError lastError() const { return m_lastError; }
+
+private:
+    QSqlQuery m_chunkQuery;
+    QSqlQuery m_ftsQuery;
+    QSqlError m_lastError;
+};
+
 bool addChunk(QSqlQuery &q, int document_id, const QString &chunk_text,
     const QString &file, const QString &title, const QString &author, const QString &subject, const QString &keywords,
     int page, int from, int to, int *chunk_id)
@@ -87,13 +156,9 @@ bool addChunk(QSqlQuery &q, int document_id, const QString &chunk_text,
         q.addBindValue(page);
         q.addBindValue(from);
         q.addBindValue(to);
-        if (!q.exec())
+        if (!q.exec() || !q.next())
             return false;
     }
-    if (!q.exec("select last_insert_rowid();"))
-        return false;
-    if (!q.next())
-        return false;
     *chunk_id = q.value(0).toInt();
     {
         if (!q.prepare(INSERT_CHUNK_FTS_SQL))
@@ -450,6 +515,11 @@ QSqlError initDb()
     if (!db.open())
         return db.lastError();
 
+    // lets chunks be written without rewriting pages in place, see INDEXING_PRAGMAS_SQL
+    QSqlQuery pragma;
+    if (!pragma.exec("pragma journal_mode = wal;"))
+        qWarning() << "WARNING: Could not switch the db to WAL mode" << pragma.lastError();
+
     QStringList tables = db.tables();
     if (tables.contains("chunks", Qt::CaseInsensitive))
         return QSqlError();
@@ -533,13 +603,113 @@ QSqlError initDb()
     return QSqlError();
 }
 
+// Limits of the indexing pipeline
+static constexpr int READER_THREADS = 4;                   // reading is mostly io, and pdfium is serialized
+static constexpr int MAX_DOCS_IN_FLIGHT = 32;              // read or chunked but not yet inserted
+static constexpr qint64 MAX_READ_BYTES = 4 * 1024 * 1024;  // text files are read in slices of this size
+static constexpr int CHUNK_INSERT_BATCH = 500;             // chunks inserted per transaction
+static constexpr int EMBEDDING_BATCH = 100;                // chunks per embedding request
+static constexpr int MAX_EMBEDDING_BATCHES_IN_FLIGHT = 8;
+
+// Runs on a reader thread
+static void readDocumentText(ScannedDocument &doc)
+{
+    const QString document_path = doc.info.doc.canonicalFilePath();
+    if (doc.info.isPdf()) {
+        QPdfDocument pdf;
+        if (QPdfDocument::Error::None != pdf.load(document_path)) {
+            doc.error = "ERROR: Could not load pdf";
+            return;
+        }
+        doc.title = pdf.metaData(QPdfDocument::MetaDataField::Title).toString();
+        doc.author = pdf.metaData(QPdfDocument::MetaDataField::Author).toString();
+        doc.subject = pdf.metaData(QPdfDocument::MetaDataField::Subject).toString();
+        doc.keywords = pdf.metaData(QPdfDocument::MetaDataField::Keywords).toString();
+        for (int i = 0; i < pdf.pageCount(); ++i)
+            doc.pages.append(qMakePair(i + 1, pdf.getAllText(i).text()));
+        doc.bytes = doc.info.doc.size();
+        return;
+    }
+
+    QFile file(document_path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        doc.error = "ERROR: Cannot open file for scanning";
+        return;
+    }
+    if (!file.seek(doc.info.currentPosition)) {
+        doc.error = "ERROR: Cannot seek to pos for scanning";
+        return;
+    }
+
+    QByteArray data = file.read(MAX_READ_BYTES);
+    if (!file.atEnd()) {
+        // end the slice on whitespace so that no word is split between two of them
+        qsizetype cut = data.size() - 1;
+        while (cut > 0 && !std::isspace(static_cast<unsigned char>(data.at(cut))))
+            --cut;
+        if (cut > 0)
+            data.truncate(cut + 1);
+    }
+    const bool atStart = doc.info.currentPosition == 0;
+    doc.info.currentPosition += data.size();
+    doc.bytes = data.size();
+    doc.hasMore = qint64(doc.info.currentPosition) < file.size();
+    if (atStart && data.startsWith("\xEF\xBB\xBF"))
+        data.remove(0, 3);
+    doc.pages.append(qMakePair(-1, QString::fromUtf8(data)));
+}
+
+// Runs on a chunker thread. Chunks are whitespace separated words joined by single spaces.
+static void chunkDocument(ScannedDocument &doc, int chunkSize)
+{
+    for (const auto &page : doc.pages) {
+        const QString &text = page.second;
+        const qsizetype size = text.size();
+        QString chunk;
+        int charCount = 0;
+        int words = 0;
+
+        qsizetype i = 0;
+        while (i < size && text.at(i).isSpace())
+            ++i;
+        while (i < size) {
+            const qsizetype start = i;
+            while (i < size && !text.at(i).isSpace())
+                ++i;
+            const QStringView word = QStringView(text).mid(start, i - start);
+            while (i < size && text.at(i).isSpace())
+                ++i;
+
+            if (words++)
+                chunk += u' ';
+            chunk += word;
+            charCount += word.size();
+            if (charCount + words - 1 >= chunkSize || i == size) {
+                doc.chunks.append({ chunk, page.first });
+                chunk.clear();
+                charCount = 0;
+                words = 0;
+            }
+        }
+    }
+    doc.pages.clear();
+}
+
 Database::Database(int chunkSize)
     : QObject(nullptr)
     , m_watcher(new QFileSystemWatcher(this))
     , m_chunkSize(chunkSize)
     , m_embLLM(new EmbeddingLLM)
-    , m_embeddings(new Embeddings(this))
+    , m_embeddings(new Embeddings(MySettings::globalInstance()->modelPath(), this))
+    , m_docsInFlight(0)
+    , m_chunkedOffset(0)
+    , m_embeddingBatchesInFlight(0)
+    , m_generation(0)
+    , m_stopping(false)
 {
+    m_readerPool.setMaxThreadCount(READER_THREADS);
+    m_chunkerPool.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+
     moveToThread(&m_dbThread);
     connect(&m_dbThread, &QThread::started, this, &Database::start);
     m_dbThread.setObjectName("database");
@@ -548,19 +718,26 @@ Database::Database(int chunkSize)
 
 Database::~Database()
 {
+    // scans still in the pools post their results to our thread, so they finish before it stops
+    m_stopping = true;
+    m_readerPool.clear();
+    m_readerPool.waitForDone();
+    m_chunkerPool.clear();
+    m_chunkerPool.waitForDone();
+
     m_dbThread.quit();
     m_dbThread.wait();
+    m_chunkWriter.reset();
 }
 
-void Database::scheduleNext(int folder_id, size_t countForFolder)
+void Database::updateFolderProgress(int folder_id)
 {
-    emit updateCurrentDocsToIndex(folder_id, countForFolder);
-    if (!countForFolder) {
+    const size_t count = countOfDocuments(folder_id) + m_folderDocsInFlight.value(folder_id);
+    emit updateCurrentDocsToIndex(folder_id, count);
+    if (!count) {
         emit updateIndexing(folder_id, false);
         emit updateInstalled(folder_id, true);
     }
-    if (!m_docsToScan.isEmpty())
-        QTimer::singleShot(0, this, &Database::scanQueue);
 }
 
 void Database::handleDocumentError(const QString &errorMessage,
@@ -569,83 +746,165 @@ void Database::handleDocumentError(const QString &errorMessage,
     qWarning() << errorMessage << document_id << document_path << error.text();
 }
 
-size_t Database::chunkStream(QTextStream &stream, int folder_id, int document_id, const QString &file,
-    const QString &title, const QString &author, const QString &subject, const QString &keywords, int page,
-    int maxChunks)
+void Database::readDocument(const DocumentInfo &info, int document_id)
+{
+    // no more scans once we are being destroyed
+    if (m_stopping)
+        return;
+
+    ScannedDocument doc;
+    doc.info = info;
+    doc.document_id = document_id;
+    doc.generation = m_generation;
+    doc.folderGeneration = m_folderGenerations.value(info.folder);
+
+    ++m_docsInFlight;
+    ++m_folderDocsInFlight[info.folder];
+    const int chunkSize = m_chunkSize;
+    m_readerPool.start([this, doc, chunkSize]() mutable {
+        readDocumentText(doc);
+        m_chunkerPool.start([this, doc = std::move(doc), chunkSize]() mutable {
+            if (doc.error.isEmpty())
+                chunkDocument(doc, chunkSize);
+            QMetaObject::invokeMethod(this, [this, doc = std::move(doc)] { handleDocumentChunked(doc); },
+                Qt::QueuedConnection);
+        });
+    });
+}
+
+void Database::handleDocumentChunked(const ScannedDocument &doc)
+{
+    --m_docsInFlight;
+
+    // drop documents whose folder was removed, or that were chunked with an old chunk size, meanwhile
+    if (doc.generation != m_generation || doc.folderGeneration != m_folderGenerations.value(doc.info.folder))
+        return scanQueue();
+
+    if (!doc.error.isEmpty()) {
+        handleDocumentError(doc.error, doc.document_id, doc.info.doc.canonicalFilePath(), QSqlError());
+        finishDocument(doc);
+        return scanQueue();
+    }
+
+    m_chunkedDocs.enqueue(doc);
+    insertChunks();
+}
+
+void Database::insertChunks()
 {
-    int charCount = 0;
-    int line_from = -1;
-    int line_to = -1;
-    QList<QString> words;
-    int chunks = 0;
-
-    QVector<EmbeddingChunk> chunkList;
-
-    while (!stream.atEnd()) {
-        QString word;
-        stream >> word;
-        charCount += word.length();
-        words.append(word);
-        if (charCount + words.size() - 1 >= m_chunkSize || stream.atEnd()) {
-            const QString chunk = words.join(" ");
-            QSqlQuery q;
+    // a batch at a time so that retrieval isn't held up for long, and only as fast as embedding keeps up
+    if (m_chunkedDocs.isEmpty() || m_embeddingBatchesInFlight >= MAX_EMBEDDING_BATCHES_IN_FLIGHT)
+        return scanQueue();
+
+    if (!m_chunkWriter)
+        beginIndexingSession();
+
+    QSqlDatabase::database().transaction();
+    int inserted = 0;
+    while (!m_chunkedDocs.isEmpty() && inserted < CHUNK_INSERT_BATCH) {
+        const ScannedDocument &doc = m_chunkedDocs.head();
+        for (; m_chunkedOffset < doc.chunks.size() && inserted < CHUNK_INSERT_BATCH; ++m_chunkedOffset, ++inserted) {
+            const ScannedDocument::Chunk &chunk = doc.chunks.at(m_chunkedOffset);
             int chunk_id = 0;
-            if (!addChunk(q,
-                document_id,
-                chunk,
-                file,
-                title,
-                author,
-                subject,
-                keywords,
-                page,
-                line_from,
-                line_to,
+            if (!m_chunkWriter->insert(
+                doc.document_id,
+                chunk.text,
+                doc.info.doc.fileName(),
+                doc.title,
+                doc.author,
+                doc.subject,
+                doc.keywords,
+                chunk.page,
+                -1 /*from*/,
+                -1 /*to*/,
                 &chunk_id
             )) {
-                qWarning() << "ERROR: Could not insert chunk into db" << q.lastError();
+                qWarning() << "ERROR: Could not insert chunk into db" << m_chunkWriter->lastError();
+                continue;
             }
 
-#if 1
+            // progress is counted per folder, so a batch holds the chunks of one
+            if (!m_chunksToEmbed.isEmpty() && m_chunksToEmbed.first().folder_id != doc.info.folder)
+                flushChunksToEmbed();
             EmbeddingChunk toEmbed;
-            toEmbed.folder_id = folder_id;
+            toEmbed.folder_id = doc.info.folder;
             toEmbed.chunk_id = chunk_id;
-            toEmbed.chunk = chunk;
-            chunkList << toEmbed;
-            if (chunkList.count() == 100) {
-                m_embLLM->generateAsyncEmbeddings(chunkList);
-                emit updateTotalEmbeddingsToIndex(folder_id, 100);
-                chunkList.clear();
-            }
-#else
-            const std::vector<float> result = m_embLLM->generateEmbeddings(chunk);
-            if (!m_embeddings->add(result, chunk_id))
-                qWarning() << "ERROR: Cannot add point to embeddings index";
-#endif
+            toEmbed.chunk = chunk.text;
+            m_chunksToEmbed << toEmbed;
+            if (m_chunksToEmbed.count() == EMBEDDING_BATCH)
+                flushChunksToEmbed();
+        }
 
-            ++chunks;
+        if (m_chunkedOffset < doc.chunks.size())
+            break;
+        m_chunkedOffset = 0;
+        finishDocument(m_chunkedDocs.dequeue());
+    }
+    QSqlDatabase::database().commit();
+    flushChunksToEmbed();
 
-            words.clear();
-            charCount = 0;
+    if (!m_chunkedDocs.isEmpty())
+        QTimer::singleShot(0, this, &Database::insertChunks);
+    scanQueue();
+}
 
-            if (maxChunks > 0 && chunks == maxChunks)
-                break;
-        }
+void Database::beginIndexingSession()
+{
+    QSqlQuery q;
+    for (const auto &sql : INDEXING_PRAGMAS_SQL) {
+        if (!q.exec(sql))
+            qWarning() << "WARNING: Could not set indexing pragma" << sql << q.lastError();
     }
 
-    if (!chunkList.isEmpty()) {
-        m_embLLM->generateAsyncEmbeddings(chunkList);
-        emit updateTotalEmbeddingsToIndex(folder_id, chunkList.count());
-        chunkList.clear();
+    m_chunkWriter = std::make_unique<ChunkWriter>();
+    if (!m_chunkWriter->prepare())
+        qWarning() << "ERROR: Could not prepare chunk inserts" << m_chunkWriter->lastError();
+}
+
+void Database::endIndexingSession()
+{
+    m_chunkWriter.reset();
+
+    QSqlQuery q;
+    for (const auto &sql : IDLE_PRAGMAS_SQL) {
+        if (!q.exec(sql))
+            qWarning() << "WARNING: Could not set idle pragma" << sql << q.lastError();
+    }
+}
+
+void Database::finishDocument(const ScannedDocument &doc)
+{
+    const int folder_id = doc.info.folder;
+    emit subtractCurrentBytesToIndex(folder_id, doc.bytes);
+
+    auto it = m_folderDocsInFlight.find(folder_id);
+    if (it != m_folderDocsInFlight.end() && --it.value() == 0)
+        m_folderDocsInFlight.erase(it);
+
+    if (doc.hasMore) {
+        // go on with the next slice of a large text file
+        DocumentInfo info = doc.info;
+        info.currentlyProcessing = true;
+        enqueueDocumentInternal(info, true /*prepend*/);
     }
+    updateFolderProgress(folder_id);
+}
 
-    return stream.pos();
+void Database::flushChunksToEmbed()
+{
+    if (m_chunksToEmbed.isEmpty())
+        return;
+    m_embLLM->generateAsyncEmbeddings(m_chunksToEmbed);
+    emit updateTotalEmbeddingsToIndex(m_chunksToEmbed.first().folder_id, m_chunksToEmbed.count());
+    ++m_embeddingBatchesInFlight;
+    m_chunksToEmbed.clear();
 }
 
 void Database::handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddings)
 {
+    --m_embeddingBatchesInFlight;
     if (embeddings.isEmpty())
-        return;
+        return insertChunks();
 
     int folder_id = 0;
     for (auto e : embeddings) {
@@ -655,11 +914,14 @@ void Database::handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddi
     }
     emit updateCurrentEmbeddingsToIndex(folder_id, embeddings.count());
     m_embeddings->save();
+    insertChunks();
 }
 
 void Database::handleErrorGenerated(int folder_id, const QString &error)
 {
+    --m_embeddingBatchesInFlight;
     emit updateError(folder_id, error);
+    insertChunks();
 }
 
 void Database::removeEmbeddingsByDocumentId(int document_id)
@@ -717,6 +979,18 @@ DocumentInfo Database::dequeueDocument()
 
 void Database::removeFolderFromDocumentQueue(int folder_id)
 {
+    // documents of the folder that are still being read or chunked are dropped once they come back
+    m_folderDocsInFlight.remove(folder_id);
+    ++m_folderGenerations[folder_id];
+    for (qsizetype i = m_chunkedDocs.size() - 1; i >= 0; --i) {
+        if (m_chunkedDocs.at(i).info.folder != folder_id)
+            continue;
+        if (i == 0)
+            m_chunkedOffset = 0;
+        m_chunkedDocs.removeAt(i);
+    }
+    m_chunksToEmbed.removeIf([folder_id](const EmbeddingChunk &c) { return c.folder_id == folder_id; });
+
     if (!m_docsToScan.contains(folder_id))
         return;
     m_docsToScan.remove(folder_id);
@@ -750,140 +1024,87 @@ void Database::enqueueDocuments(int folder_id, const QVector<DocumentInfo> &info
 
 void Database::scanQueue()
 {
-    if (m_docsToScan.isEmpty())
-        return;
-
-    DocumentInfo info = dequeueDocument();
-    const size_t countForFolder = countOfDocuments(info.folder);
-    const int folder_id = info.folder;
-
-    // Update info
-    info.doc.stat();
-
-    // If the doc has since been deleted or no longer readable, then we schedule more work and return
-    // leaving the cleanup for the cleanup handler
-    if (!info.doc.exists() || !info.doc.isReadable()) {
-        return scheduleNext(folder_id, countForFolder);
-    }
-
-    const qint64 document_time = info.doc.fileTime(QFile::FileModificationTime).toMSecsSinceEpoch();
-    const QString document_path = info.doc.canonicalFilePath();
-    const bool currentlyProcessing = info.currentlyProcessing;
-
-    // Check and see if we already have this document
-    QSqlQuery q;
-    int existing_id = -1;
-    qint64 existing_time = -1;
-    if (!selectDocument(q, document_path, &existing_id, &existing_time)) {
-        handleDocumentError("ERROR: Cannot select document",
-            existing_id, document_path, q.lastError());
-        return scheduleNext(folder_id, countForFolder);
-    }
+    // hand documents to the pipeline for as long as it has room for them
+    while (!m_docsToScan.isEmpty() && m_docsInFlight + m_chunkedDocs.size() < MAX_DOCS_IN_FLIGHT) {
+        DocumentInfo info = dequeueDocument();
+        const int folder_id = info.folder;
+
+        // Update info
+        info.doc.stat();
+
+        // If the doc has since been deleted or no longer readable, then we move on to the next one
+        // leaving the cleanup for the cleanup handler
+        if (!info.doc.exists() || !info.doc.isReadable()) {
+            updateFolderProgress(folder_id);
+            continue;
+        }
 
-    // If we have the document, we need to compare the last modification time and if it is newer
-    // we must rescan the document, otherwise return
-    if (existing_id != -1 && !currentlyProcessing) {
-        Q_ASSERT(existing_time != -1);
-        if (document_time == existing_time) {
-            // No need to rescan, but we do have to schedule next
-            return scheduleNext(folder_id, countForFolder);
-        } else {
-            removeEmbeddingsByDocumentId(existing_id);
-            if (!removeChunksByDocumentId(q, existing_id)) {
-                handleDocumentError("ERROR: Cannot remove chunks of document",
-                    existing_id, document_path, q.lastError());
-                return scheduleNext(folder_id, countForFolder);
-            }
+        const qint64 document_time = info.doc.fileTime(QFile::FileModificationTime).toMSecsSinceEpoch();
+        const QString document_path = info.doc.canonicalFilePath();
+        const bool currentlyProcessing = info.currentlyProcessing;
+
+        // Check and see if we already have this document
+        QSqlQuery q;
+        int existing_id = -1;
+        qint64 existing_time = -1;
+        if (!selectDocument(q, document_path, &existing_id, &existing_time)) {
+            handleDocumentError("ERROR: Cannot select document",
+                existing_id, document_path, q.lastError());
+            updateFolderProgress(folder_id);
+            continue;
         }
-    }
 
-    // Update the document_time for an existing document, or add it for the first time now
-    int document_id = existing_id;
-    if (!currentlyProcessing) {
-        if (document_id != -1) {
-            if (!updateDocument(q, document_id, document_time)) {
-                handleDocumentError("ERROR: Could not update document_time",
-                    document_id, document_path, q.lastError());
-                return scheduleNext(folder_id, countForFolder);
-            }
-        } else {
-            if (!addDocument(q, folder_id, document_time, document_path, &document_id)) {
-                handleDocumentError("ERROR: Could not add document",
-                    document_id, document_path, q.lastError());
-                return scheduleNext(folder_id, countForFolder);
+        // If we have the document, we need to compare the last modification time and if it is newer
+        // we must rescan the document, otherwise move on
+        if (existing_id != -1 && !currentlyProcessing) {
+            Q_ASSERT(existing_time != -1);
+            if (document_time == existing_time) {
+                // No need to rescan
+                updateFolderProgress(folder_id);
+                continue;
+            } else {
+                removeEmbeddingsByDocumentId(existing_id);
+                if (!removeChunksByDocumentId(q, existing_id)) {
+                    handleDocumentError("ERROR: Cannot remove chunks of document",
+                        existing_id, document_path, q.lastError());
+                    updateFolderProgress(folder_id);
+                    continue;
+                }
             }
         }
-    }
 
-    QSqlDatabase::database().transaction();
-    Q_ASSERT(document_id != -1);
-    if (info.isPdf()) {
-        QPdfDocument doc;
-        if (QPdfDocument::Error::None != doc.load(info.doc.canonicalFilePath())) {
-            handleDocumentError("ERROR: Could not load pdf",
-                document_id, document_path, q.lastError());
-            return scheduleNext(folder_id, countForFolder);
-        }
-        const size_t bytes = info.doc.size();
-        const size_t bytesPerPage = std::floor(bytes / doc.pageCount());
-        const int pageIndex = info.currentPage;
-#if defined(DEBUG)
-        qDebug() << "scanning page" << pageIndex << "of" << doc.pageCount() << document_path;
-#endif
-        const QPdfSelection selection = doc.getAllText(pageIndex);
-        QString text = selection.text();
-        QTextStream stream(&text);
-        chunkStream(stream, info.folder, document_id, info.doc.fileName(),
-            doc.metaData(QPdfDocument::MetaDataField::Title).toString(),
-            doc.metaData(QPdfDocument::MetaDataField::Author).toString(),
-            doc.metaData(QPdfDocument::MetaDataField::Subject).toString(),
-            doc.metaData(QPdfDocument::MetaDataField::Keywords).toString(),
-            pageIndex + 1
-        );
-        emit subtractCurrentBytesToIndex(info.folder, bytesPerPage);
-        if (info.currentPage < doc.pageCount()) {
-            info.currentPage += 1;
-            info.currentlyProcessing = true;
-            enqueueDocumentInternal(info, true /*prepend*/);
-            return scheduleNext(folder_id, countForFolder + 1);
-        } else {
-            emit subtractCurrentBytesToIndex(info.folder, bytes - (bytesPerPage * doc.pageCount()));
-        }
-    } else {
-        QFile file(document_path);
-        if (!file.open(QIODevice::ReadOnly)) {
-            handleDocumentError("ERROR: Cannot open file for scanning",
-                                existing_id, document_path, q.lastError());
-            return scheduleNext(folder_id, countForFolder);
+        // Update the document_time for an existing document, or add it for the first time now
+        int document_id = existing_id;
+        if (!currentlyProcessing) {
+            if (document_id != -1) {
+                if (!updateDocument(q, document_id, document_time)) {
+                    handleDocumentError("ERROR: Could not update document_time",
+                        document_id, document_path, q.lastError());
+                    updateFolderProgress(folder_id);
+                    continue;
+                }
+            } else {
+                if (!addDocument(q, folder_id, document_time, document_path, &document_id)) {
+                    handleDocumentError("ERROR: Could not add document",
+                        document_id, document_path, q.lastError());
+                    updateFolderProgress(folder_id);
+                    continue;
+                }
+            }
         }
 
-        const size_t bytes = info.doc.size();
-        QTextStream stream(&file);
-        const size_t byteIndex = info.currentPosition;
-        if (!stream.seek(byteIndex)) {
-            handleDocumentError("ERROR: Cannot seek to pos for scanning",
-                                existing_id, document_path, q.lastError());
-            return scheduleNext(folder_id, countForFolder);
-        }
+        Q_ASSERT(document_id != -1);
 #if defined(DEBUG)
-        qDebug() << "scanning byteIndex" << byteIndex << "of" << bytes << document_path;
+        qDebug() << "scanning" << document_path << "from" << info.currentPosition;
 #endif
-        int pos = chunkStream(stream, info.folder, document_id, info.doc.fileName(), QString() /*title*/, QString() /*author*/,
-            QString() /*subject*/, QString() /*keywords*/, -1 /*page*/, 100 /*maxChunks*/);
-        file.close();
-        const size_t bytesChunked = pos - byteIndex;
-        emit subtractCurrentBytesToIndex(info.folder, bytesChunked);
-        if (info.currentPosition < bytes) {
-            info.currentPosition = pos;
-            info.currentlyProcessing = true;
-            enqueueDocumentInternal(info, true /*prepend*/);
-            return scheduleNext(folder_id, countForFolder + 1);
-        }
+        readDocument(info, document_id);
     }
-    QSqlDatabase::database().commit();
-    return scheduleNext(folder_id, countForFolder);
+
+    if (m_chunkWriter && m_docsToScan.isEmpty() && !m_docsInFlight && m_chunkedDocs.isEmpty())
+        endIndexingSession();
 }
 
+
 void Database::scanDocuments(int folder_id, const QString &folder_path)
 {
 #if defined(DEBUG)
@@ -1230,6 +1451,14 @@ void Database::changeChunkSize(int chunkSize)
 
     m_chunkSize = chunkSize;
 
+    // everything is scanned again, so drop what is in the pipeline
+    ++m_generation;
+    m_docsToScan.clear();
+    m_folderDocsInFlight.clear();
+    m_chunkedDocs.clear();
+    m_chunkedOffset = 0;
+    m_chunksToEmbed.clear();
+
     QSqlQuery q;
     // Scan all documents in db to make sure they still exist
     if (!q.prepare(SELECT_ALL_DOCUMENTS_SQL)) {
@@ -6,16 +6,20 @@
 #include <QQueue>
 #include <QFileInfo>
 #include <QThread>
+#include <QThreadPool>
 #include <QFileSystemWatcher>
 
 #include "embllm.h"
 
+#include <atomic>
+#include <memory>
+
+class ChunkWriter;
 class Embeddings;
 struct DocumentInfo
 {
     int folder;
     QFileInfo doc;
-    int currentPage = 0;
     size_t currentPosition = 0;
     bool currentlyProcessing = false;
     bool isPdf() const {
@@ -23,6 +27,29 @@ struct DocumentInfo
     }
 };
 
+// A document, or a slice of a large text file, on its way through the indexing pipeline: read and
+// chunked on the pool threads, then inserted into the db on the database thread
+struct ScannedDocument {
+    struct Chunk {
+        QString text;
+        int page = -1;
+    };
+
+    DocumentInfo info;
+    int document_id = -1;
+    int generation = 0;
+    int folderGeneration = 0;
+    QString title;
+    QString author;
+    QString subject;
+    QString keywords;
+    QList<QPair<int, QString>> pages; // page number and text, dropped once chunked
+    QVector<Chunk> chunks;
+    size_t bytes = 0;                 // bytes of the file this covers
+    bool hasMore = false;             // the text file continues past this slice
+    QString error;
+};
+
 struct ResultInfo {
     QString file;   // [Required] The name of the file, but not the full path
     QString title;  // [Optional] The title of the document
@@ -91,14 +118,18 @@ private Q_SLOTS:
     void addCurrentFolders();
     void handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddings);
     void handleErrorGenerated(int folder_id, const QString &error);
+    void insertChunks();
 
 private:
     void removeFolderInternal(const QString &collection, int folder_id, const QString &path);
-    size_t chunkStream(QTextStream &stream, int folder_id, int document_id, const QString &file,
-        const QString &title, const QString &author, const QString &subject, const QString &keywords, int page,
-        int maxChunks = -1);
+    void readDocument(const DocumentInfo &info, int document_id);
+    void handleDocumentChunked(const ScannedDocument &doc);
+    void finishDocument(const ScannedDocument &doc);
+    void beginIndexingSession();
+    void endIndexingSession();
+    void flushChunksToEmbed();
     void removeEmbeddingsByDocumentId(int document_id);
-    void scheduleNext(int folder_id, size_t countForFolder);
+    void updateFolderProgress(int folder_id);
     void handleDocumentError(const QString &errorMessage,
         int document_id, const QString &document_path, const QSqlError &error);
     size_t countOfDocuments(int folder_id) const;
@@ -116,6 +147,20 @@ private:
     QFileSystemWatcher *m_watcher;
     EmbeddingLLM *m_embLLM;
     Embeddings *m_embeddings;
+
+    // indexing pipeline
+    QThreadPool m_readerPool;
+    QThreadPool m_chunkerPool;
+    int m_docsInFlight;                   // being read or chunked
+    QHash<int, int> m_folderDocsInFlight; // dequeued but not yet inserted, by folder
+    QQueue<ScannedDocument> m_chunkedDocs;
+    qsizetype m_chunkedOffset;            // next chunk to insert of the head of m_chunkedDocs
+    QVector<EmbeddingChunk> m_chunksToEmbed;
+    int m_embeddingBatchesInFlight;
+    int m_generation;                     // bumped to drop documents scanned with an old chunk size
+    QHash<int, int> m_folderGenerations;  // bumped to drop documents of a folder removed meanwhile
+    std::atomic<bool> m_stopping;         // set by the destructor, which runs on another thread
+    std::unique_ptr<ChunkWriter> m_chunkWriter; // while chunks are being inserted
 };
 
 #endif // DATABASE_H
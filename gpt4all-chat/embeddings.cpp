@@ -4,7 +4,15 @@
 #include <QFileInfo>
 #include <QDebug>
 
-#include "mysettings.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 #include "hnswlib/hnswlib.h"
 
 #define EMBEDDINGS_VERSION 0
@@ -13,26 +21,69 @@ const int s_dim = 384;              // Dimension of the elements
 const int s_ef_construction = 200;  // Controls index search speed/build speed tradeoff
 const int s_M = 16;                 // Tightly connected with internal dimensionality of the data
                                     // strongly affects the memory consumption
+const int s_minCheckpointRecords = 10000; // Default log records written before the index is checkpointed
+
+// Log records: an op byte and the label, followed by s_dim floats for an add
+const char s_logAdd = 'a';
+const char s_logRemove = 'r';
+const qint64 s_logHeaderSize = sizeof(char) + sizeof(qint64);
+const qint64 s_logEmbeddingSize = s_dim * sizeof(float);
 
-Embeddings::Embeddings(QObject *parent)
+Embeddings::Embeddings(const QString &dirPath, QObject *parent)
     : QObject(parent)
     , m_space(nullptr)
     , m_hnsw(nullptr)
+    , m_map(nullptr)
+    , m_logRecords(0)
+    , m_minCheckpointRecords(s_minCheckpointRecords)
 {
-    m_filePath = MySettings::globalInstance()->modelPath()
-        + QString("embeddings_v%1.dat").arg(EMBEDDINGS_VERSION);
+    m_filePath = dirPath + QString("embeddings_v%1.dat").arg(EMBEDDINGS_VERSION);
+    m_logFilePath = dirPath + QString("embeddings_v%1.log").arg(EMBEDDINGS_VERSION);
 }
 
 Embeddings::~Embeddings()
 {
-    delete m_hnsw;
-    m_hnsw = nullptr;
-    delete m_space;
-    m_space = nullptr;
+    clear();
+}
+
+// Flushes the file all the way to the disk, so that it survives a crash of the system too
+static bool syncFile(QFile &file)
+{
+    if (!file.flush())
+        return false;
+#if defined(Q_OS_WIN)
+    return _commit(file.handle()) == 0;
+#else
+    return fsync(file.handle()) == 0;
+#endif
+}
+
+static bool indexLoads(const QString &filePath)
+{
+    try {
+        hnswlib::InnerProductSpace space(s_dim);
+        hnswlib::HierarchicalNSW<float> hnsw(&space, filePath.toStdString(), s_M, s_ef_construction);
+    } catch (const std::exception &e) {
+        qWarning() << "WARNING: discarding embeddings checkpoint" << filePath << e.what();
+        return false;
+    }
+    return true;
 }
 
 bool Embeddings::load()
 {
+    // the log is only removed once a checkpoint has replaced the index, so a leftover checkpoint
+    // can be dropped unless it was about to replace the index and got written in full
+    const QString checkpointPath = m_filePath + ".tmp";
+    if (QFileInfo::exists(checkpointPath)) {
+        if (QFileInfo::exists(m_filePath) || !indexLoads(checkpointPath) || !QFile::rename(checkpointPath, m_filePath))
+            QFile::remove(checkpointPath);
+    }
+
+    // the first checkpoint may not have been written yet
+    if (!QFileInfo::exists(m_filePath))
+        return load(500) && replayLog();
+
     QFileInfo info(m_filePath);
     if (!info.exists()) {
         qWarning() << "ERROR: loading embeddings file does not exist" << m_filePath;
@@ -49,14 +100,30 @@ bool Embeddings::load()
         return false;
     }
 
+    // map the index rather than reading it so that the base layer, which holds the vectors, is only
+    // paged in as searches touch it and is shared with anyone else who has the file open
+    m_mappedFile.setFileName(m_filePath);
+    if (m_mappedFile.open(QIODevice::ReadOnly))
+        m_map = m_mappedFile.map(0, m_mappedFile.size(), QFileDevice::MapPrivateOption);
+    if (!m_map) {
+        qWarning() << "WARNING: could not map embeddings file, reading it instead" << m_mappedFile.errorString();
+        m_mappedFile.close();
+    }
+
     try {
         m_space = new hnswlib::InnerProductSpace(s_dim);
-        m_hnsw = new hnswlib::HierarchicalNSW<float>(m_space, m_filePath.toStdString(), s_M, s_ef_construction);
+        if (m_map) {
+            m_hnsw = new hnswlib::HierarchicalNSW<float>(m_space, reinterpret_cast<const char *>(m_map),
+                m_mappedFile.size());
+        } else {
+            m_hnsw = new hnswlib::HierarchicalNSW<float>(m_space, m_filePath.toStdString(), s_M, s_ef_construction);
+        }
     } catch (const std::exception &e) {
         qWarning() << "ERROR: could not load hnswlib index:" << e.what();
+        clear();
         return false;
     }
-    return isLoaded();
+    return replayLog();
 }
 
 bool Embeddings::load(qint64 maxElements)
@@ -75,15 +142,112 @@ bool Embeddings::save()
 {
     if (!isLoaded())
         return false;
+
+    // checkpointing doubles the log allowance each time, so the index is rewritten O(log n) times
+    if (m_logRecords >= std::max<qint64>(m_minCheckpointRecords, m_hnsw->cur_element_count))
+        return checkpoint();
+
+    if (m_pendingLog.isEmpty())
+        return true;
+
+    QFile file(m_logFilePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "ERROR: could not open embeddings log" << m_logFilePath << file.errorString();
+        return false;
+    }
+    if (file.write(m_pendingLog) != m_pendingLog.size() || !syncFile(file)) {
+        qWarning() << "ERROR: could not write embeddings log" << m_logFilePath << file.errorString();
+        return false;
+    }
+    m_pendingLog.clear();
+    return true;
+}
+
+bool Embeddings::checkpoint()
+{
+    // write next to the index and swap it in so that a crash never leaves a partial index behind
+    const QString checkpointPath = m_filePath + ".tmp";
     try {
-        m_hnsw->saveIndex(m_filePath.toStdString());
+        m_hnsw->saveIndex(checkpointPath.toStdString());
     } catch (const std::exception &e) {
         qWarning() << "ERROR: could not save hnswlib index:" << e.what();
+        QFile::remove(checkpointPath);
         return false;
     }
+    QFile checkpointFile(checkpointPath);
+    if (!checkpointFile.open(QIODevice::ReadWrite) || !syncFile(checkpointFile)) {
+        qWarning() << "ERROR: could not sync hnswlib index" << checkpointPath << checkpointFile.errorString();
+        QFile::remove(checkpointPath);
+        return false;
+    }
+    checkpointFile.close();
+
+    // the mapped file is about to be replaced, so the index needs its own copy of the base layer
+    if (m_map) {
+        try {
+            m_hnsw->resizeIndex(m_hnsw->max_elements_);
+        } catch (const std::exception &e) {
+            qWarning() << "ERROR: could not copy hnswlib index:" << e.what();
+            return false;
+        }
+        unmap();
+    }
+
+    QFile::remove(m_filePath);
+    if (!QFile::rename(checkpointPath, m_filePath)) {
+        qWarning() << "ERROR: could not replace hnswlib index" << m_filePath;
+        return false;
+    }
+
+    // everything in the log is now part of the index
+    m_pendingLog.clear();
+    m_logRecords = 0;
+    QFile::remove(m_logFilePath);
     return true;
 }
 
+bool Embeddings::replayLog()
+{
+    QFile file(m_logFilePath);
+    if (!file.exists())
+        return isLoaded();
+
+    if (!file.open(QIODevice::ReadWrite)) {
+        qWarning() << "ERROR: could not open embeddings log" << m_logFilePath << file.errorString();
+        return false;
+    }
+
+    const QByteArray log = file.readAll();
+    qint64 pos = 0;
+    m_logRecords = 0;
+    std::vector<float> embedding(s_dim);
+    while (pos + s_logHeaderSize <= log.size()) {
+        const char op = log.at(pos);
+        qint64 label;
+        std::memcpy(&label, log.constData() + pos + sizeof(char), sizeof(qint64));
+        if (op == s_logAdd) {
+            if (pos + s_logHeaderSize + s_logEmbeddingSize > log.size())
+                break;
+            std::memcpy(embedding.data(), log.constData() + pos + s_logHeaderSize, s_logEmbeddingSize);
+            addInternal(embedding, label);
+            pos += s_logHeaderSize + s_logEmbeddingSize;
+        } else if (op == s_logRemove) {
+            removeInternal(label);
+            pos += s_logHeaderSize;
+        } else {
+            break;
+        }
+        ++m_logRecords;
+    }
+
+    // drop a record that was cut short by a crash
+    if (pos < log.size()) {
+        qWarning() << "WARNING: truncating embeddings log at" << pos << "of" << log.size() << "bytes";
+        file.resize(pos);
+    }
+    return isLoaded();
+}
+
 bool Embeddings::isLoaded() const
 {
     return m_hnsw != nullptr;
@@ -91,8 +255,8 @@ bool Embeddings::isLoaded() const
 
 bool Embeddings::fileExists() const
 {
-    QFileInfo info(m_filePath);
-    return info.exists();
+    return QFileInfo::exists(m_filePath) || QFileInfo::exists(m_filePath + ".tmp")
+        || QFileInfo::exists(m_logFilePath);
 }
 
 bool Embeddings::resize(qint64 size)
@@ -109,10 +273,30 @@ bool Embeddings::resize(qint64 size)
         qWarning() << "ERROR: could not resize hnswlib index:" << e.what();
         return false;
     }
+
+    // the base layer has been copied out of the mapping
+    unmap();
     return true;
 }
 
 bool Embeddings::add(const std::vector<float> &embedding, qint64 label)
+{
+    if (embedding.size() != size_t(s_dim)) {
+        qWarning() << "ERROR: attempting to add an embedding of dimension" << embedding.size();
+        return false;
+    }
+
+    if (!addInternal(embedding, label))
+        return false;
+
+    m_pendingLog.append(s_logAdd);
+    m_pendingLog.append(reinterpret_cast<const char *>(&label), sizeof(qint64));
+    m_pendingLog.append(reinterpret_cast<const char *>(embedding.data()), s_logEmbeddingSize);
+    ++m_logRecords;
+    return true;
+}
+
+bool Embeddings::addInternal(const std::vector<float> &embedding, qint64 label)
 {
     if (!isLoaded()) {
         bool success = load(500);
@@ -124,7 +308,8 @@ bool Embeddings::add(const std::vector<float> &embedding, qint64 label)
 
     Q_ASSERT(m_hnsw);
     if (m_hnsw->cur_element_count + 1 > m_hnsw->max_elements_) {
-        if (!resize(m_hnsw->max_elements_ + 500)) {
+        // grow geometrically, as each resize copies the whole index
+        if (!resize(m_hnsw->max_elements_ + std::max<size_t>(500, m_hnsw->max_elements_ / 2))) {
             return false;
         }
     }
@@ -142,10 +327,20 @@ bool Embeddings::add(const std::vector<float> &embedding, qint64 label)
 }
 
 void Embeddings::remove(qint64 label)
+{
+    if (!removeInternal(label))
+        return;
+
+    m_pendingLog.append(s_logRemove);
+    m_pendingLog.append(reinterpret_cast<const char *>(&label), sizeof(qint64));
+    ++m_logRecords;
+}
+
+bool Embeddings::removeInternal(qint64 label)
 {
     if (!isLoaded()) {
         qWarning() << "ERROR: attempting to remove an embedding when the embeddings are not open!";
-        return;
+        return false;
     }
 
     Q_ASSERT(m_hnsw);
@@ -153,15 +348,28 @@ void Embeddings::remove(qint64 label)
         m_hnsw->markDelete(label);
     } catch (const std::exception &e) {
         qWarning() << "ERROR: could not add remove embedding from hnswlib index:" << e.what();
+        return false;
+    }
+    return true;
+}
+
+void Embeddings::unmap()
+{
+    if (m_map) {
+        m_mappedFile.unmap(m_map);
+        m_map = nullptr;
     }
+    m_mappedFile.close();
 }
 
 void Embeddings::clear()
 {
+    m_pendingLog.clear();
     delete m_hnsw;
     m_hnsw = nullptr;
     delete m_space;
     m_space = nullptr;
+    unmap();
 }
 
 std::vector<qint64> Embeddings::search(const std::vector<float> &embedding, int K)
@@ -1,7 +1,10 @@
 #ifndef EMBEDDINGS_H
 #define EMBEDDINGS_H
 
+#include <QByteArray>
+#include <QFile>
 #include <QObject>
+#include <QString>
 
 namespace hnswlib {
     template <typename T>
@@ -13,12 +16,18 @@ class Embeddings : public QObject
 {
     Q_OBJECT
 public:
-    Embeddings(QObject *parent);
+    // The index and its log are kept in dirPath
+    Embeddings(const QString &dirPath, QObject *parent);
     virtual ~Embeddings();
 
     bool load();
     bool load(qint64 maxElements);
+
+    // Appends the changes since the last save to the log, and checkpoints the whole index once the
+    // log has grown as large as the index itself
     bool save();
+    // The log records that are written at least before the index is checkpointed
+    void setMinCheckpointRecords(qint64 records) { m_minCheckpointRecords = records; }
     bool isLoaded() const;
     bool fileExists() const;
     bool resize(qint64 size);
@@ -37,9 +46,21 @@ public:
     std::vector<qint64> search(const std::vector<float> &embedding, int K);
 
 private:
+    bool addInternal(const std::vector<float> &embedding, qint64 label);
+    bool removeInternal(qint64 label);
+    bool replayLog();
+    bool checkpoint();
+    void unmap();
+
     QString m_filePath;
+    QString m_logFilePath;
+    QByteArray m_pendingLog;    // records not yet appended to the log
+    qint64 m_logRecords;
+    qint64 m_minCheckpointRecords;
     hnswlib::InnerProductSpace *m_space;
     hnswlib::HierarchicalNSW<float> *m_hnsw;
+    QFile m_mappedFile;
+    uchar *m_map;               // backs the base layer of m_hnsw until it is resized
 };
 
 #endif // EMBEDDINGS_H
@@ -145,26 +145,39 @@ void EmbeddingLLMWorker::requestSyncEmbedding(const QString &text)
 // this function is always called for storage into the database
 void EmbeddingLLMWorker::requestAsyncEmbedding(const QVector<EmbeddingChunk> &chunks)
 {
+    // every request is answered with either embeddingsGenerated or errorGenerated, the database
+    // counts on it to pace indexing
     if (!hasModel() && !loadModel()) {
         qWarning() << "WARNING: Could not load model for embeddings";
+        emit errorGenerated(chunks.first().folder_id, "ERROR: Could not load model for embeddings");
         return;
     }
 
     if (m_nomicAPIKey.isEmpty()) {
+        // embed the whole list in one call so the model can pack the chunks into full batches
+        std::vector<std::string> texts;
+        texts.reserve(chunks.size());
+        for (const auto &c : chunks)
+            texts.push_back(c.chunk.toStdString());
+
+        const size_t embeddingSize = m_model->embeddingSize();
+        std::vector<float> embeddings(texts.size() * embeddingSize);
+        try {
+            m_model->embed(texts, embeddings.data(), false);
+        } catch (const std::exception &e) {
+            qWarning() << "WARNING: LLModel::embed failed:" << e.what();
+            emit errorGenerated(chunks.first().folder_id, QString("ERROR: LLModel::embed failed: %1").arg(e.what()));
+            return;
+        }
+
         QVector<EmbeddingResult> results;
         results.reserve(chunks.size());
-        for (auto c : chunks) {
+        for (int i = 0; i < chunks.size(); ++i) {
             EmbeddingResult result;
-            result.folder_id = c.folder_id;
-            result.chunk_id = c.chunk_id;
-            // TODO(cebtenzzre): take advantage of batched embeddings
-            result.embedding.resize(m_model->embeddingSize());
-            try {
-                m_model->embed({c.chunk.toStdString()}, result.embedding.data(), false);
-            } catch (const std::exception &e) {
-                qWarning() << "WARNING: LLModel::embed failed:" << e.what();
-                return;
-            }
+            result.folder_id = chunks.at(i).folder_id;
+            result.chunk_id = chunks.at(i).chunk_id;
+            auto begin = embeddings.begin() + i * embeddingSize;
+            result.embedding.assign(begin, begin + embeddingSize);
             results << result;
         }
         emit embeddingsGenerated(results);
@@ -258,6 +271,8 @@ void EmbeddingLLMWorker::handleFinished()
     QJsonDocument document = QJsonDocument::fromJson(jsonData, &err);
     if (err.error != QJsonParseError::NoError) {
         qWarning() << "ERROR: Couldn't parse Nomic Atlas response: " << jsonData << err.errorString();
+        if (!chunks.isEmpty())
+            emit errorGenerated(folder_id, "ERROR: Couldn't parse Nomic Atlas response");
         return;
     }
 
@@ -265,7 +280,11 @@ void EmbeddingLLMWorker::handleFinished()
     const QJsonArray embeddings = root.value("embeddings").toArray();
 
     if (!chunks.isEmpty()) {
-        emit embeddingsGenerated(jsonArrayToEmbeddingResults(chunks, embeddings));
+        const QVector<EmbeddingResult> results = jsonArrayToEmbeddingResults(chunks, embeddings);
+        if (results.isEmpty())
+            emit errorGenerated(folder_id, "ERROR: Nomic Atlas response does not match the request");
+        else
+            emit embeddingsGenerated(results);
     } else {
         m_lastResponse = jsonArrayToVector(embeddings);
         emit finished();
@@ -47,6 +47,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     size_t offsetData_{0}, offsetLevel0_{0}, label_offset_{ 0 };
 
     char *data_level0_memory_{nullptr};
+    bool data_level0_borrowed_{false};  // data_level0_memory_ points into a buffer owned by the caller
     char **linkLists_{nullptr};
     std::vector<int> element_levels_;  // keeps level of each element
 
@@ -85,6 +86,18 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    // Loads an index saved by saveIndex without copying the base layer, which stays in the buffer
+    // (usually a private file mapping) until the index is resized. The buffer must outlive the index.
+    HierarchicalNSW(
+        SpaceInterface<dist_t> *s,
+        const char *buffer,
+        size_t size,
+        bool allow_replace_deleted = false)
+        : allow_replace_deleted_(allow_replace_deleted) {
+        loadIndex(buffer, size, s);
+    }
+
+
     HierarchicalNSW(
         SpaceInterface<dist_t> *s,
         size_t max_elements,
@@ -138,7 +151,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     ~HierarchicalNSW() {
-        free(data_level0_memory_);
+        if (!data_level0_borrowed_)
+            free(data_level0_memory_);
         for (tableint i = 0; i < cur_element_count; i++) {
             if (element_levels_[i] > 0)
                 free(linkLists_[i]);
@@ -581,10 +595,18 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::vector<std::mutex>(new_max_elements).swap(link_list_locks_);
 
         // Reallocate base layer
-        char * data_level0_memory_new = (char *) realloc(data_level0_memory_, new_max_elements * size_data_per_element_);
+        char * data_level0_memory_new;
+        if (data_level0_borrowed_) {
+            data_level0_memory_new = (char *) malloc(new_max_elements * size_data_per_element_);
+            if (data_level0_memory_new != nullptr)
+                memcpy(data_level0_memory_new, data_level0_memory_, cur_element_count * size_data_per_element_);
+        } else {
+            data_level0_memory_new = (char *) realloc(data_level0_memory_, new_max_elements * size_data_per_element_);
+        }
         if (data_level0_memory_new == nullptr)
             throw std::runtime_error("Not enough memory: resizeIndex failed to allocate base layer");
         data_level0_memory_ = data_level0_memory_new;
+        data_level0_borrowed_ = false;
 
         // Reallocate all other layers
         char ** linkLists_new = (char **) realloc(linkLists_, sizeof(void *) * new_max_elements);
@@ -624,6 +646,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 output.write(linkLists_[i], linkListSize);
         }
         output.close();
+        if (output.fail())
+            throw std::runtime_error("Cannot write file");
     }
 
 
@@ -735,6 +759,85 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    void loadIndex(const char *buffer, size_t size, SpaceInterface<dist_t> *s) {
+        const char *input = buffer;
+        const char *end = buffer + size;
+
+        readBinaryPOD(input, end, offsetLevel0_);
+        readBinaryPOD(input, end, max_elements_);
+        readBinaryPOD(input, end, cur_element_count);
+        readBinaryPOD(input, end, size_data_per_element_);
+        readBinaryPOD(input, end, label_offset_);
+        readBinaryPOD(input, end, offsetData_);
+        readBinaryPOD(input, end, maxlevel_);
+        readBinaryPOD(input, end, enterpoint_node_);
+
+        readBinaryPOD(input, end, maxM_);
+        readBinaryPOD(input, end, maxM0_);
+        readBinaryPOD(input, end, M_);
+        readBinaryPOD(input, end, mult_);
+        readBinaryPOD(input, end, ef_construction_);
+
+        data_size_ = s->get_data_size();
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+
+        // the base layer can't grow in place, so the first insertion resizes the index
+        const size_t max_elements = cur_element_count;
+        max_elements_ = max_elements;
+
+        if ((size_t) (end - input) < cur_element_count * size_data_per_element_)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        data_level0_memory_ = (char *) input;
+        data_level0_borrowed_ = true;
+        input += cur_element_count * size_data_per_element_;
+
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
+
+        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+        std::vector<std::mutex>(max_elements).swap(link_list_locks_);
+        std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
+
+        visited_list_pool_ = new VisitedListPool(1, max_elements);
+
+        linkLists_ = (char **) malloc(sizeof(void *) * std::max<size_t>(max_elements, 1));
+        if (linkLists_ == nullptr)
+            throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
+        element_levels_ = std::vector<int>(max_elements);
+        revSize_ = 1.0 / mult_;
+        ef_ = 10;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            label_lookup_[getExternalLabel(i)] = i;
+            unsigned int linkListSize;
+            readBinaryPOD(input, end, linkListSize);
+            if (linkListSize == 0) {
+                element_levels_[i] = 0;
+                linkLists_[i] = nullptr;
+            } else {
+                if ((size_t) (end - input) < linkListSize)
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                element_levels_[i] = linkListSize / size_links_per_element_;
+                linkLists_[i] = (char *) malloc(linkListSize);
+                if (linkLists_[i] == nullptr)
+                    throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
+                memcpy(linkLists_[i], input, linkListSize);
+                input += linkListSize;
+            }
+        }
+
+        // throw exception if it either corrupted or old index
+        if (input != end)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if (isMarkedDeleted(i)) {
+                num_deleted_ += 1;
+                if (allow_replace_deleted_) deleted_elements.insert(i);
+            }
+        }
+    }
+
+
     template<typename data_t>
     std::vector<data_t> getDataByLabel(labeltype label) const {
         // lock all operations with element by label
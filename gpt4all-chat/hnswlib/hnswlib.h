@@ -139,6 +139,14 @@ static void readBinaryPOD(std::istream &in, T &podRef) {
     in.read((char *) &podRef, sizeof(T));
 }
 
+template<typename T>
+static void readBinaryPOD(const char *&in, const char *end, T &podRef) {
+    if (end - in < (std::ptrdiff_t) sizeof(T))
+        throw std::runtime_error("Index seems to be corrupted or unsupported");
+    memcpy(&podRef, in, sizeof(T));
+    in += sizeof(T);
+}
+
 template<typename MTYPE>
 using DISTFUNC = MTYPE(*)(const void *, const void *, const void *);
 
@@ -0,0 +1,216 @@
+#include "httplistener.h"
+
+#include <QList>
+#include <QMetaObject>
+
+#include <algorithm>
+
+// Requests larger than this are refused rather than buffered
+static constexpr qsizetype MAX_REQUEST_SIZE = 64 * 1024 * 1024;
+
+// Time a client has to send the whole request, so that slow ones can't hold connections open
+static constexpr int REQUEST_TIMEOUT_MS = 30 * 1000;
+
+static QByteArray reasonPhrase(int status)
+{
+    switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    case 408: return "Request Timeout";
+    case 413: return "Payload Too Large";
+    case 429: return "Too Many Requests";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    default:  return status < 500 ? "Bad Request" : "Internal Server Error";
+    }
+}
+
+HttpListener::HttpListener(QObject *parent)
+    : QTcpServer(parent)
+{
+}
+
+void HttpListener::incomingConnection(qintptr socketDescriptor)
+{
+    QTcpSocket *socket = new QTcpSocket(this);
+    if (!socket->setSocketDescriptor(socketDescriptor)) {
+        delete socket;
+        return;
+    }
+
+    Request request;
+    request.timeout = new QTimer(socket);
+    request.timeout->setSingleShot(true);
+    connect(request.timeout, &QTimer::timeout, this, [this, socket] { reject(socket, 408); });
+    request.timeout->start(REQUEST_TIMEOUT_MS);
+    m_requests.insert(socket, request);
+
+    connect(socket, &QTcpSocket::readyRead, this, [this, socket] { handleReadyRead(socket); });
+    connect(socket, &QTcpSocket::disconnected, this, [this, socket] {
+        m_requests.remove(socket);
+        socket->deleteLater();
+    });
+}
+
+void HttpListener::release(QTcpSocket *socket)
+{
+    auto it = m_requests.find(socket);
+    if (it == m_requests.end())
+        return;
+    // may be called from the timer's own timeout
+    it->timeout->stop();
+    it->timeout->deleteLater();
+    m_requests.erase(it);
+    disconnect(socket, nullptr, this, nullptr);
+}
+
+void HttpListener::reject(QTcpSocket *socket, int status)
+{
+    if (!m_requests.contains(socket))
+        return;
+    release(socket);
+    HttpResponder(socket).write(status);
+}
+
+void HttpListener::handleReadyRead(QTcpSocket *socket)
+{
+    auto it = m_requests.find(socket);
+    if (it == m_requests.end())
+        return;
+
+    Request &request = *it;
+    request.data.append(socket->readAll());
+    if (request.data.size() > MAX_REQUEST_SIZE) {
+        reject(socket, 413);
+        return;
+    }
+
+    const qsizetype headerEnd = request.data.indexOf("\r\n\r\n");
+    if (headerEnd < 0)
+        return;
+
+    const QList<QByteArray> lines = request.data.left(headerEnd).split('\n');
+    const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+    if (requestLine.size() != 3 || !requestLine.at(2).startsWith("HTTP/1.")) {
+        reject(socket, 400);
+        return;
+    }
+
+    qsizetype contentLength = -1;
+    bool expectContinue = false;
+    for (qsizetype i = 1; i < lines.size(); ++i) {
+        const qsizetype colon = lines.at(i).indexOf(':');
+        if (colon < 0)
+            continue;
+        const QByteArray name = lines.at(i).left(colon).trimmed().toLower();
+        const QByteArray value = lines.at(i).mid(colon + 1).trimmed();
+        if (name == "content-length") {
+            // digits only, and repeated only with the same value
+            bool ok = !value.isEmpty() && value.at(0) != '+' && value.at(0) != '-';
+            const qlonglong length = ok ? value.toLongLong(&ok) : -1;
+            if (!ok || (contentLength >= 0 && length != contentLength)) {
+                reject(socket, 400);
+                return;
+            }
+            if (length > MAX_REQUEST_SIZE) {
+                reject(socket, 413);
+                return;
+            }
+            contentLength = length;
+        } else if (name == "transfer-encoding") {
+            // no transfer coding is implemented, a chunked body can't be delimited
+            reject(socket, 501);
+            return;
+        } else if (name == "expect") {
+            expectContinue = value.toLower() == "100-continue";
+        }
+    }
+    contentLength = std::max(contentLength, qsizetype(0));
+
+    const qsizetype bodyStart = headerEnd + 4;
+    if (bodyStart + contentLength > MAX_REQUEST_SIZE) {
+        reject(socket, 413);
+        return;
+    }
+    if (request.data.size() < bodyStart + contentLength) {
+        if (expectContinue && !request.continueSent) {
+            socket->write("HTTP/1.1 100 Continue\r\n\r\n");
+            request.continueSent = true;
+        }
+        return;
+    }
+
+    QByteArray path = requestLine.at(1);
+    const qsizetype query = path.indexOf('?');
+    if (query >= 0)
+        path.truncate(query);
+    const QByteArray body = request.data.mid(bodyStart, contentLength);
+    release(socket);
+    emit requestReceived(socket, requestLine.at(0), path, body);
+}
+
+HttpResponder::HttpResponder(QTcpSocket *socket)
+    : m_socket(socket)
+    , m_connected(std::make_shared<std::atomic<bool>>(socket->state() == QAbstractSocket::ConnectedState))
+{
+    QObject::connect(socket, &QTcpSocket::disconnected, socket, [connected = m_connected] { *connected = false; });
+}
+
+HttpResponder::~HttpResponder()
+{
+    if (!m_written)
+        write(500);
+    QMetaObject::invokeMethod(m_socket, [socket = m_socket] {
+        socket->disconnectFromHost();
+        if (socket->state() == QAbstractSocket::UnconnectedState)
+            socket->deleteLater();
+        else
+            QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+    }, Qt::QueuedConnection);
+}
+
+void HttpResponder::send(const QByteArray &data)
+{
+    // the socket lives on the listener's thread and isn't deleted before we are
+    QMetaObject::invokeMethod(m_socket, [socket = m_socket, data] { socket->write(data); }, Qt::QueuedConnection);
+}
+
+void HttpResponder::writeHead(int status, const QByteArray &headers)
+{
+    Q_ASSERT(!m_written);
+    m_written = true;
+    QByteArray head = "HTTP/1.1 " + QByteArray::number(status) + ' ' + reasonPhrase(status) + "\r\n";
+    head += "Access-Control-Allow-Origin: *\r\n";
+    head += "Connection: close\r\n";
+    head += headers;
+    head += "\r\n";
+    send(head);
+}
+
+void HttpResponder::write(int status, const QByteArray &mimeType, const QByteArray &body)
+{
+    QByteArray headers = "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    if (!mimeType.isEmpty())
+        headers += "Content-Type: " + mimeType + "\r\n";
+    writeHead(status, headers);
+    send(body);
+}
+
+void HttpResponder::beginEventStream()
+{
+    writeHead(200, "Content-Type: text/event-stream\r\nCache-Control: no-cache\r\n");
+    m_streaming = true;
+}
+
+bool HttpResponder::writeEvent(const QByteArray &data)
+{
+    Q_ASSERT(m_streaming);
+    if (!isConnected())
+        return false;
+    send("data: " + data + "\n\n");
+    return true;
+}
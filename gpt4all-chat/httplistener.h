@@ -0,0 +1,77 @@
+#ifndef HTTPLISTENER_H
+#define HTTPLISTENER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include <atomic>
+#include <memory>
+
+// A minimal HTTP/1.1 server: reads one request per connection and hands the socket over to whoever
+// answers it through an HttpResponder. Owning the socket lets the completion handlers stream their
+// response as it is generated and notice when the client goes away.
+class HttpListener : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    explicit HttpListener(QObject *parent = nullptr);
+
+Q_SIGNALS:
+    // Emitted once the request line, headers and body have been read. The socket is closed and
+    // deleted once the HttpResponder created for it is destroyed.
+    void requestReceived(QTcpSocket *socket, const QByteArray &method, const QByteArray &path,
+        const QByteArray &body);
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private:
+    void handleReadyRead(QTcpSocket *socket);
+    // Answers with an error status instead of reading the rest of the request
+    void reject(QTcpSocket *socket, int status);
+    // Stops reading the request, the socket now belongs to whoever answers it
+    void release(QTcpSocket *socket);
+
+    struct Request {
+        QByteArray data;
+        bool continueSent = false;
+        QTimer *timeout = nullptr;
+    };
+    QHash<QTcpSocket*, Request> m_requests;
+};
+
+// The response to a request read by HttpListener, written either in one go or as a stream of
+// server-sent events. It must be created on the socket's thread but may then be written from any
+// thread; the body is delimited by closing the connection.
+class HttpResponder
+{
+public:
+    explicit HttpResponder(QTcpSocket *socket);
+    ~HttpResponder();
+
+    bool isConnected() const { return *m_connected; }
+    bool isStreaming() const { return m_streaming; }
+
+    void write(int status, const QByteArray &mimeType = QByteArray(), const QByteArray &body = QByteArray());
+
+    // Sends the headers of a text/event-stream response, after which only events can be written
+    void beginEventStream();
+
+    // Returns false if the client has gone away
+    bool writeEvent(const QByteArray &data);
+
+private:
+    void writeHead(int status, const QByteArray &headers);
+    void send(const QByteArray &data);
+
+    QTcpSocket *m_socket;
+    std::shared_ptr<std::atomic<bool>> m_connected;
+    bool m_written = false;
+    bool m_streaming = false;
+};
+
+#endif // HTTPLISTENER_H
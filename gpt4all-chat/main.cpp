@@ -39,6 +39,8 @@ int main(int argc, char *argv[])
         llmodelSearchPaths += ";" + frameworksDir;
 #endif
     LLModel::Implementation::setImplementationsSearchPath(llmodelSearchPaths.toStdString());
+    LLModel::Implementation::setMetadataCachePath((MySettings::globalInstance()->modelPath()
+                                                   + "gguf_metadata_v1.cache").toStdString());
 
     qmlRegisterSingletonInstance("mysettings", 1, 0, "MySettings", MySettings::globalInstance());
     qmlRegisterSingletonInstance("modellist", 1, 0, "ModelList", ModelList::globalInstance());
@@ -260,6 +260,50 @@ int ModelInfo::maxGpuLayers() const
     return m_maxGpuLayers;
 }
 
+int ModelInfo::kvCacheType() const
+{
+    return MySettings::globalInstance()->modelKVCacheType(*this);
+}
+
+void ModelInfo::setKVCacheType(int t)
+{
+    if (shouldSaveMetadata()) MySettings::globalInstance()->setModelKVCacheType(*this, t, true /*force*/);
+    m_kvCacheType = t;
+}
+
+QString ModelInfo::draftModel() const
+{
+    return MySettings::globalInstance()->modelDraftModel(*this);
+}
+
+void ModelInfo::setDraftModel(const QString &f)
+{
+    if (shouldSaveMetadata()) MySettings::globalInstance()->setModelDraftModel(*this, f, true /*force*/);
+    m_draftModel = f;
+}
+
+int ModelInfo::draftTokens() const
+{
+    return MySettings::globalInstance()->modelDraftTokens(*this);
+}
+
+void ModelInfo::setDraftTokens(int n)
+{
+    if (shouldSaveMetadata()) MySettings::globalInstance()->setModelDraftTokens(*this, n, true /*force*/);
+    m_draftTokens = n;
+}
+
+bool ModelInfo::promptLookup() const
+{
+    return MySettings::globalInstance()->modelPromptLookup(*this);
+}
+
+void ModelInfo::setPromptLookup(bool b)
+{
+    if (shouldSaveMetadata()) MySettings::globalInstance()->setModelPromptLookup(*this, b, true /*force*/);
+    m_promptLookup = b;
+}
+
 double ModelInfo::repeatPenalty() const
 {
     return MySettings::globalInstance()->modelRepeatPenalty(*this);
@@ -467,6 +511,10 @@ ModelList::ModelList()
     connect(MySettings::globalInstance(), &MySettings::promptBatchSizeChanged, this, &ModelList::updateDataForSettings);
     connect(MySettings::globalInstance(), &MySettings::contextLengthChanged, this, &ModelList::updateDataForSettings);
     connect(MySettings::globalInstance(), &MySettings::gpuLayersChanged, this, &ModelList::updateDataForSettings);
+    connect(MySettings::globalInstance(), &MySettings::kvCacheTypeChanged, this, &ModelList::updateDataForSettings);
+    connect(MySettings::globalInstance(), &MySettings::draftModelChanged, this, &ModelList::updateDataForSettings);
+    connect(MySettings::globalInstance(), &MySettings::draftTokensChanged, this, &ModelList::updateDataForSettings);
+    connect(MySettings::globalInstance(), &MySettings::promptLookupChanged, this, &ModelList::updateDataForSettings);
     connect(MySettings::globalInstance(), &MySettings::repeatPenaltyChanged, this, &ModelList::updateDataForSettings);
     connect(MySettings::globalInstance(), &MySettings::repeatPenaltyTokensChanged, this, &ModelList::updateDataForSettings);;
     connect(MySettings::globalInstance(), &MySettings::promptTemplateChanged, this, &ModelList::updateDataForSettings);
@@ -732,6 +780,8 @@ QVariant ModelList::dataInternal(const ModelInfo *info, int role) const
             return info->isDiscovered();
         case IsEmbeddingModelRole:
             return info->isEmbeddingModel;
+        case IsResidentRole:
+            return info->isResident;
         case TemperatureRole:
             return info->temperature();
         case TopPRole:
@@ -748,6 +798,14 @@ QVariant ModelList::dataInternal(const ModelInfo *info, int role) const
             return info->contextLength();
         case GpuLayersRole:
             return info->gpuLayers();
+        case KVCacheTypeRole:
+            return info->kvCacheType();
+        case DraftModelRole:
+            return info->draftModel();
+        case DraftTokensRole:
+            return info->draftTokens();
+        case PromptLookupRole:
+            return info->promptLookup();
         case RepeatPenaltyRole:
             return info->repeatPenalty();
         case RepeatPenaltyTokensRole:
@@ -902,6 +960,8 @@ void ModelList::updateData(const QString &id, const QVector<QPair<int, QVariant>
                 }
             case IsEmbeddingModelRole:
                 info->isEmbeddingModel = value.toBool(); break;
+            case IsResidentRole:
+                info->isResident = value.toBool(); break;
             case TemperatureRole:
                 info->setTemperature(value.toDouble()); break;
             case TopPRole:
@@ -918,6 +978,14 @@ void ModelList::updateData(const QString &id, const QVector<QPair<int, QVariant>
                 info->setContextLength(value.toInt()); break;
             case GpuLayersRole:
                 info->setGpuLayers(value.toInt()); break;
+            case KVCacheTypeRole:
+                info->setKVCacheType(value.toInt()); break;
+            case DraftModelRole:
+                info->setDraftModel(value.toString()); break;
+            case DraftTokensRole:
+                info->setDraftTokens(value.toInt()); break;
+            case PromptLookupRole:
+                info->setPromptLookup(value.toBool()); break;
             case RepeatPenaltyRole:
                 info->setRepeatPenalty(value.toDouble()); break;
             case RepeatPenaltyTokensRole:
@@ -1065,6 +1133,10 @@ QString ModelList::clone(const ModelInfo &model)
         { ModelList::PromptBatchSizeRole, model.promptBatchSize() },
         { ModelList::ContextLengthRole, model.contextLength() },
         { ModelList::GpuLayersRole, model.gpuLayers() },
+        { ModelList::KVCacheTypeRole, model.kvCacheType() },
+        { ModelList::DraftModelRole, model.draftModel() },
+        { ModelList::DraftTokensRole, model.draftTokens() },
+        { ModelList::PromptLookupRole, model.promptLookup() },
         { ModelList::RepeatPenaltyRole, model.repeatPenalty() },
         { ModelList::RepeatPenaltyTokensRole, model.repeatPenaltyTokens() },
         { ModelList::PromptTemplateRole, model.promptTemplate() },
@@ -1262,6 +1334,9 @@ void ModelList::updateModelsFromDirectory()
         updateOldRemoteModels(localPath);
         processDirectory(localPath);
     }
+
+    // keep what was read from the headers of new models for the next start
+    LLModel::Implementation::flushMetadataCache();
 }
 
 #define MODELS_VERSION 3
@@ -1487,6 +1562,14 @@ void ModelList::parseModelsJsonFile(const QByteArray &jsonData, bool save)
             data.append({ ModelList::ContextLengthRole, obj["contextLength"].toInt() });
         if (obj.contains("gpuLayers"))
             data.append({ ModelList::GpuLayersRole, obj["gpuLayers"].toInt() });
+        if (obj.contains("kvCacheType"))
+            data.append({ ModelList::KVCacheTypeRole, obj["kvCacheType"].toInt() });
+        if (obj.contains("draftModel"))
+            data.append({ ModelList::DraftModelRole, obj["draftModel"].toString() });
+        if (obj.contains("draftTokens"))
+            data.append({ ModelList::DraftTokensRole, obj["draftTokens"].toInt() });
+        if (obj.contains("promptLookup"))
+            data.append({ ModelList::PromptLookupRole, obj["promptLookup"].toBool() });
         if (obj.contains("repeatPenalty"))
             data.append({ ModelList::RepeatPenaltyRole, obj["repeatPenalty"].toDouble() });
         if (obj.contains("repeatPenaltyTokens"))
@@ -1787,6 +1870,22 @@ void ModelList::updateModelsFromSettings()
             const int gpuLayers = settings.value(g + "/gpuLayers").toInt();
             data.append({ ModelList::GpuLayersRole, gpuLayers });
         }
+        if (settings.contains(g + "/kvCacheType")) {
+            const int kvCacheType = settings.value(g + "/kvCacheType").toInt();
+            data.append({ ModelList::KVCacheTypeRole, kvCacheType });
+        }
+        if (settings.contains(g + "/draftModel")) {
+            const QString draftModel = settings.value(g + "/draftModel").toString();
+            data.append({ ModelList::DraftModelRole, draftModel });
+        }
+        if (settings.contains(g + "/draftTokens")) {
+            const int draftTokens = settings.value(g + "/draftTokens").toInt();
+            data.append({ ModelList::DraftTokensRole, draftTokens });
+        }
+        if (settings.contains(g + "/promptLookup")) {
+            const bool promptLookup = settings.value(g + "/promptLookup").toBool();
+            data.append({ ModelList::PromptLookupRole, promptLookup });
+        }
         if (settings.contains(g + "/repeatPenalty")) {
             const double repeatPenalty = settings.value(g + "/repeatPenalty").toDouble();
             data.append({ ModelList::RepeatPenaltyRole, repeatPenalty });
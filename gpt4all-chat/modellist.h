@@ -36,6 +36,7 @@ struct ModelInfo {
     Q_PROPERTY(bool isClone READ isClone WRITE setIsClone)
     Q_PROPERTY(bool isDiscovered READ isDiscovered WRITE setIsDiscovered)
     Q_PROPERTY(bool isEmbeddingModel MEMBER isEmbeddingModel)
+    Q_PROPERTY(bool isResident MEMBER isResident)
     Q_PROPERTY(double temperature READ temperature WRITE setTemperature)
     Q_PROPERTY(double topP READ topP WRITE setTopP)
     Q_PROPERTY(double minP READ minP WRITE setMinP)
@@ -46,6 +47,10 @@ struct ModelInfo {
     Q_PROPERTY(int maxContextLength READ maxContextLength)
     Q_PROPERTY(int gpuLayers READ gpuLayers WRITE setGpuLayers)
     Q_PROPERTY(int maxGpuLayers READ maxGpuLayers)
+    Q_PROPERTY(int kvCacheType READ kvCacheType WRITE setKVCacheType)
+    Q_PROPERTY(QString draftModel READ draftModel WRITE setDraftModel)
+    Q_PROPERTY(int draftTokens READ draftTokens WRITE setDraftTokens)
+    Q_PROPERTY(bool promptLookup READ promptLookup WRITE setPromptLookup)
     Q_PROPERTY(double repeatPenalty READ repeatPenalty WRITE setRepeatPenalty)
     Q_PROPERTY(int repeatPenaltyTokens READ repeatPenaltyTokens WRITE setRepeatPenaltyTokens)
     Q_PROPERTY(QString promptTemplate READ promptTemplate WRITE setPromptTemplate)
@@ -118,6 +123,7 @@ public:
     QString parameters;
     bool isEmbeddingModel = false;
     bool checkedEmbeddingModel = false;
+    bool isResident = false; // loaded by a chat or kept loaded by the model store
 
     bool operator==(const ModelInfo &other) const {
         return  m_id == other.m_id;
@@ -141,6 +147,14 @@ public:
     int gpuLayers() const;
     void setGpuLayers(int l);
     int maxGpuLayers() const;
+    int kvCacheType() const;
+    void setKVCacheType(int t);
+    QString draftModel() const;
+    void setDraftModel(const QString &f);
+    int draftTokens() const;
+    void setDraftTokens(int n);
+    bool promptLookup() const;
+    void setPromptLookup(bool b);
     double repeatPenalty() const;
     void setRepeatPenalty(double p);
     int repeatPenaltyTokens() const;
@@ -175,6 +189,10 @@ private:
     mutable int m_maxContextLength = -1;
     int     m_gpuLayers            = 100;
     mutable int m_maxGpuLayers     = -1;
+    int     m_kvCacheType          = 0; // LLModel::KVCacheType
+    QString m_draftModel;                 // filename of the model used for speculative decoding
+    int     m_draftTokens          = 5;
+    bool    m_promptLookup         = false; // speculate with tokens copied from the context without a draft
     double  m_repeatPenalty        = 1.18;
     int     m_repeatPenaltyTokens  = 64;
     QString m_promptTemplate       = "### Human:\n%1\n\n### Assistant:\n";
@@ -306,6 +324,7 @@ public:
         IsCloneRole,
         IsDiscoveredRole,
         IsEmbeddingModelRole,
+        IsResidentRole,
         TemperatureRole,
         TopPRole,
         TopKRole,
@@ -313,6 +332,10 @@ public:
         PromptBatchSizeRole,
         ContextLengthRole,
         GpuLayersRole,
+        KVCacheTypeRole,
+        DraftModelRole,
+        DraftTokensRole,
+        PromptLookupRole,
         RepeatPenaltyRole,
         RepeatPenaltyTokensRole,
         PromptTemplateRole,
@@ -356,6 +379,7 @@ public:
         roles[IsCloneRole] = "isClone";
         roles[IsDiscoveredRole] = "isDiscovered";
         roles[IsEmbeddingModelRole] = "isEmbeddingModel";
+        roles[IsResidentRole] = "isResident";
         roles[TemperatureRole] = "temperature";
         roles[TopPRole] = "topP";
         roles[MinPRole] = "minP";
@@ -364,6 +388,10 @@ public:
         roles[PromptBatchSizeRole] = "promptBatchSize";
         roles[ContextLengthRole] = "contextLength";
         roles[GpuLayersRole] = "gpuLayers";
+        roles[KVCacheTypeRole] = "kvCacheType";
+        roles[DraftModelRole] = "draftModel";
+        roles[DraftTokensRole] = "draftTokens";
+        roles[PromptLookupRole] = "promptLookup";
         roles[RepeatPenaltyRole] = "repeatPenalty";
         roles[RepeatPenaltyTokensRole] = "repeatPenaltyTokens";
         roles[PromptTemplateRole] = "promptTemplate";
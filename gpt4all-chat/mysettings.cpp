@@ -10,6 +10,9 @@
 #include <QUrl>
 
 static int      default_threadCount         = std::min(4, (int32_t) std::thread::hardware_concurrency());
+static int      default_batchThreadCount    = 0;
+static QString  default_threadAffinity      = "None";
+static QString  default_threadAffinityCores = "";
 static bool     default_saveChatsContext    = false;
 static bool     default_serverChat          = false;
 static QString  default_userDefaultModel    = "Application default";
@@ -23,6 +26,8 @@ static bool     default_localDocsShowReferences = true;
 static QString  default_networkAttribution      = "";
 static bool     default_networkIsActive         = false;
 static int      default_networkPort         = 4891;
+static int      default_serverWorkers       = 1;
+static int      default_modelMemoryBudget   = 0; // half of the system RAM
 static bool     default_networkUsageStatsActive = false;
 static QString  default_device              = "Auto";
 
@@ -94,6 +99,10 @@ void MySettings::restoreModelDefaults(const ModelInfo &model)
     setModelPromptBatchSize(model, model.m_promptBatchSize);
     setModelContextLength(model, model.m_contextLength);
     setModelGpuLayers(model, model.m_gpuLayers);
+    setModelKVCacheType(model, model.m_kvCacheType);
+    setModelDraftModel(model, model.m_draftModel);
+    setModelDraftTokens(model, model.m_draftTokens);
+    setModelPromptLookup(model, model.m_promptLookup);
     setModelRepeatPenalty(model, model.m_repeatPenalty);
     setModelRepeatPenaltyTokens(model, model.m_repeatPenaltyTokens);
     setModelPromptTemplate(model, model.m_promptTemplate);
@@ -106,9 +115,14 @@ void MySettings::restoreApplicationDefaults()
     setFontSize(default_fontSize);
     setDevice(default_device);
     setThreadCount(default_threadCount);
+    setBatchThreadCount(default_batchThreadCount);
+    setThreadAffinity(default_threadAffinity);
+    setThreadAffinityCores(default_threadAffinityCores);
     setSaveChatsContext(default_saveChatsContext);
     setServerChat(default_serverChat);
     setNetworkPort(default_networkPort);
+    setServerWorkers(default_serverWorkers);
+    setModelMemoryBudget(default_modelMemoryBudget);
     setModelPath(defaultLocalModelsPath());
     setUserDefaultModel(default_userDefaultModel);
     setForceMetal(default_forceMetal);
@@ -529,6 +543,94 @@ void MySettings::setModelGpuLayers(const ModelInfo &m, int l, bool force)
         emit gpuLayersChanged(m);
 }
 
+int MySettings::modelKVCacheType(const ModelInfo &m) const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value(QString("model-%1").arg(m.id()) + "/kvCacheType", m.m_kvCacheType).toInt();
+}
+
+void MySettings::setModelKVCacheType(const ModelInfo &m, int t, bool force)
+{
+    if (modelKVCacheType(m) == t && !force)
+        return;
+
+    QSettings setting;
+    if (m.m_kvCacheType == t && !m.shouldSaveMetadata())
+        setting.remove(QString("model-%1").arg(m.id()) + "/kvCacheType");
+    else
+        setting.setValue(QString("model-%1").arg(m.id()) + "/kvCacheType", t);
+    setting.sync();
+    if (!force)
+        emit kvCacheTypeChanged(m);
+}
+
+QString MySettings::modelDraftModel(const ModelInfo &m) const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value(QString("model-%1").arg(m.id()) + "/draftModel", m.m_draftModel).toString();
+}
+
+void MySettings::setModelDraftModel(const ModelInfo &m, const QString &f, bool force)
+{
+    if (modelDraftModel(m) == f && !force)
+        return;
+
+    QSettings setting;
+    if (m.m_draftModel == f && !m.shouldSaveMetadata())
+        setting.remove(QString("model-%1").arg(m.id()) + "/draftModel");
+    else
+        setting.setValue(QString("model-%1").arg(m.id()) + "/draftModel", f);
+    setting.sync();
+    if (!force)
+        emit draftModelChanged(m);
+}
+
+int MySettings::modelDraftTokens(const ModelInfo &m) const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value(QString("model-%1").arg(m.id()) + "/draftTokens", m.m_draftTokens).toInt();
+}
+
+void MySettings::setModelDraftTokens(const ModelInfo &m, int n, bool force)
+{
+    if (modelDraftTokens(m) == n && !force)
+        return;
+
+    QSettings setting;
+    if (m.m_draftTokens == n && !m.shouldSaveMetadata())
+        setting.remove(QString("model-%1").arg(m.id()) + "/draftTokens");
+    else
+        setting.setValue(QString("model-%1").arg(m.id()) + "/draftTokens", n);
+    setting.sync();
+    if (!force)
+        emit draftTokensChanged(m);
+}
+
+bool MySettings::modelPromptLookup(const ModelInfo &m) const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value(QString("model-%1").arg(m.id()) + "/promptLookup", m.m_promptLookup).toBool();
+}
+
+void MySettings::setModelPromptLookup(const ModelInfo &m, bool b, bool force)
+{
+    if (modelPromptLookup(m) == b && !force)
+        return;
+
+    QSettings setting;
+    if (m.m_promptLookup == b && !m.shouldSaveMetadata())
+        setting.remove(QString("model-%1").arg(m.id()) + "/promptLookup");
+    else
+        setting.setValue(QString("model-%1").arg(m.id()) + "/promptLookup", b);
+    setting.sync();
+    if (!force)
+        emit promptLookupChanged(m);
+}
+
 double MySettings::modelRepeatPenalty(const ModelInfo &m) const
 {
     QSettings setting;
@@ -644,6 +746,62 @@ void MySettings::setThreadCount(int c)
     emit threadCountChanged();
 }
 
+int MySettings::batchThreadCount() const
+{
+    QSettings setting;
+    setting.sync();
+    int c = setting.value("batchThreadCount", default_batchThreadCount).toInt();
+    return std::clamp(c, 0, QThread::idealThreadCount());
+}
+
+void MySettings::setBatchThreadCount(int c)
+{
+    c = std::clamp(c, 0, QThread::idealThreadCount());
+    if (batchThreadCount() == c)
+        return;
+
+    QSettings setting;
+    setting.setValue("batchThreadCount", c);
+    setting.sync();
+    emit batchThreadCountChanged();
+}
+
+QString MySettings::threadAffinity() const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value("threadAffinity", default_threadAffinity).toString();
+}
+
+void MySettings::setThreadAffinity(const QString &a)
+{
+    if (threadAffinity() == a)
+        return;
+
+    QSettings setting;
+    setting.setValue("threadAffinity", a);
+    setting.sync();
+    emit threadAffinityChanged();
+}
+
+QString MySettings::threadAffinityCores() const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value("threadAffinityCores", default_threadAffinityCores).toString();
+}
+
+void MySettings::setThreadAffinityCores(const QString &c)
+{
+    if (threadAffinityCores() == c)
+        return;
+
+    QSettings setting;
+    setting.setValue("threadAffinityCores", c);
+    setting.sync();
+    emit threadAffinityCoresChanged();
+}
+
 bool MySettings::saveChatsContext() const
 {
     QSettings setting;
@@ -698,6 +856,42 @@ void MySettings::setNetworkPort(int c)
     emit networkPortChanged();
 }
 
+int MySettings::serverWorkers() const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value("serverWorkers", default_serverWorkers).toInt();
+}
+
+void MySettings::setServerWorkers(int c)
+{
+    if (serverWorkers() == c)
+        return;
+
+    QSettings setting;
+    setting.setValue("serverWorkers", c);
+    setting.sync();
+    emit serverWorkersChanged();
+}
+
+int MySettings::modelMemoryBudget() const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value("modelMemoryBudget", default_modelMemoryBudget).toInt();
+}
+
+void MySettings::setModelMemoryBudget(int gb)
+{
+    if (modelMemoryBudget() == gb)
+        return;
+
+    QSettings setting;
+    setting.setValue("modelMemoryBudget", gb);
+    setting.sync();
+    emit modelMemoryBudgetChanged();
+}
+
 QString MySettings::modelPath() const
 {
     QSettings setting;
@@ -12,6 +12,9 @@ class MySettings : public QObject
 {
     Q_OBJECT
     Q_PROPERTY(int threadCount READ threadCount WRITE setThreadCount NOTIFY threadCountChanged)
+    Q_PROPERTY(int batchThreadCount READ batchThreadCount WRITE setBatchThreadCount NOTIFY batchThreadCountChanged)
+    Q_PROPERTY(QString threadAffinity READ threadAffinity WRITE setThreadAffinity NOTIFY threadAffinityChanged)
+    Q_PROPERTY(QString threadAffinityCores READ threadAffinityCores WRITE setThreadAffinityCores NOTIFY threadAffinityCoresChanged)
     Q_PROPERTY(bool saveChatsContext READ saveChatsContext WRITE setSaveChatsContext NOTIFY saveChatsContextChanged)
     Q_PROPERTY(bool serverChat READ serverChat WRITE setServerChat NOTIFY serverChatChanged)
     Q_PROPERTY(QString modelPath READ modelPath WRITE setModelPath NOTIFY modelPathChanged)
@@ -29,6 +32,8 @@ class MySettings : public QObject
     Q_PROPERTY(QString device READ device WRITE setDevice NOTIFY deviceChanged)
     Q_PROPERTY(QVector<QString> deviceList READ deviceList NOTIFY deviceListChanged)
     Q_PROPERTY(int networkPort READ networkPort WRITE setNetworkPort NOTIFY networkPortChanged)
+    Q_PROPERTY(int serverWorkers READ serverWorkers WRITE setServerWorkers NOTIFY serverWorkersChanged)
+    Q_PROPERTY(int modelMemoryBudget READ modelMemoryBudget WRITE setModelMemoryBudget NOTIFY modelMemoryBudgetChanged)
 
 public:
     static MySettings *globalInstance();
@@ -88,10 +93,24 @@ public:
     Q_INVOKABLE void setModelContextLength(const ModelInfo &m, int s, bool force = false);
     int modelGpuLayers(const ModelInfo &m) const;
     Q_INVOKABLE void setModelGpuLayers(const ModelInfo &m, int s, bool force = false);
+    int modelKVCacheType(const ModelInfo &m) const;
+    Q_INVOKABLE void setModelKVCacheType(const ModelInfo &m, int t, bool force = false);
+    QString modelDraftModel(const ModelInfo &m) const;
+    Q_INVOKABLE void setModelDraftModel(const ModelInfo &m, const QString &f, bool force = false);
+    int modelDraftTokens(const ModelInfo &m) const;
+    Q_INVOKABLE void setModelDraftTokens(const ModelInfo &m, int n, bool force = false);
+    bool modelPromptLookup(const ModelInfo &m) const;
+    Q_INVOKABLE void setModelPromptLookup(const ModelInfo &m, bool b, bool force = false);
 
     // Application settings
     int threadCount() const;
     void setThreadCount(int c);
+    int batchThreadCount() const; // 0 means the same as threadCount
+    void setBatchThreadCount(int c);
+    QString threadAffinity() const;
+    void setThreadAffinity(const QString &a);
+    QString threadAffinityCores() const;
+    void setThreadAffinityCores(const QString &c);
     bool saveChatsContext() const;
     void setSaveChatsContext(bool b);
     bool serverChat() const;
@@ -134,6 +153,10 @@ public:
     void setNetworkUsageStatsActive(bool b);
     int networkPort() const;
     void setNetworkPort(int c);
+    int serverWorkers() const;
+    void setServerWorkers(int c);
+    int modelMemoryBudget() const;
+    void setModelMemoryBudget(int gb);
 
     QVector<QString> deviceList() const;
     void setDeviceList(const QVector<QString> &deviceList);
@@ -149,11 +172,18 @@ Q_SIGNALS:
     void promptBatchSizeChanged(const ModelInfo &model);
     void contextLengthChanged(const ModelInfo &model);
     void gpuLayersChanged(const ModelInfo &model);
+    void kvCacheTypeChanged(const ModelInfo &model);
+    void draftModelChanged(const ModelInfo &model);
+    void draftTokensChanged(const ModelInfo &model);
+    void promptLookupChanged(const ModelInfo &model);
     void repeatPenaltyChanged(const ModelInfo &model);
     void repeatPenaltyTokensChanged(const ModelInfo &model);
     void promptTemplateChanged(const ModelInfo &model);
     void systemPromptChanged(const ModelInfo &model);
     void threadCountChanged();
+    void batchThreadCountChanged();
+    void threadAffinityChanged();
+    void threadAffinityCoresChanged();
     void saveChatsContextChanged();
     void serverChatChanged();
     void modelPathChanged();
@@ -168,6 +198,8 @@ Q_SIGNALS:
     void networkAttributionChanged();
     void networkIsActiveChanged();
     void networkPortChanged();
+    void serverWorkersChanged();
+    void modelMemoryBudgetChanged();
     void networkUsageStatsActiveChanged();
     void attemptModelLoadChanged();
     void deviceChanged();
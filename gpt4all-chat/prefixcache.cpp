@@ -0,0 +1,95 @@
+#include "prefixcache.h"
+
+#include <algorithm>
+
+// Prefixes are hashed at multiples of this many tokens
+static constexpr size_t PREFIX_BLOCK_SIZE = 32;
+
+PrefixCache::PrefixCache(qsizetype maxBytes)
+    : m_maxBytes(maxBytes)
+{
+}
+
+void PrefixCache::setModel(const QString &model)
+{
+    if (model == m_model)
+        return;
+    clear();
+    m_model = model;
+}
+
+std::vector<quint64> PrefixCache::blockHashes(const std::vector<int32_t> &tokens)
+{
+    // FNV-1a over the tokens, the hash of each block covers every token before it
+    std::vector<quint64> hashes;
+    hashes.reserve(tokens.size() / PREFIX_BLOCK_SIZE);
+    quint64 hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        hash ^= quint32(tokens[i]);
+        hash *= 0x100000001b3ULL;
+        if ((i + 1) % PREFIX_BLOCK_SIZE == 0)
+            hashes.push_back(hash);
+    }
+    return hashes;
+}
+
+const PrefixCache::Entry *PrefixCache::longestPrefix(const std::vector<int32_t> &tokens)
+{
+    const std::vector<quint64> hashes = blockHashes(tokens);
+    for (auto h = hashes.rbegin(); h != hashes.rend(); ++h) {
+        const size_t n_block = (hashes.rend() - h) * PREFIX_BLOCK_SIZE;
+        auto [begin, end] = m_index.equal_range(*h);
+        for (auto found = begin; found != end; ++found) {
+            // guard against hash collisions, the entry must really share this block
+            auto it = found->second;
+            if (it->tokens.size() < n_block || !std::equal(tokens.begin(), tokens.begin() + n_block, it->tokens.begin()))
+                continue;
+
+            m_entries.splice(m_entries.begin(), m_entries, it);
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+void PrefixCache::insert(const std::vector<int32_t> &tokens, const QByteArray &state)
+{
+    if (state.size() > m_maxBytes || tokens.size() < PREFIX_BLOCK_SIZE)
+        return;
+
+    // an entry holding a prefix of these tokens is of no more use
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        auto next = std::next(it);
+        if (it->tokens.size() <= tokens.size() && std::equal(it->tokens.begin(), it->tokens.end(), tokens.begin()))
+            evict(it);
+        it = next;
+    }
+
+    while (!m_entries.empty() && m_bytes + state.size() > m_maxBytes)
+        evict(std::prev(m_entries.end()));
+
+    m_entries.push_front({ tokens, state });
+    m_bytes += state.size();
+    for (quint64 hash : blockHashes(tokens))
+        m_index.emplace(hash, m_entries.begin());
+}
+
+void PrefixCache::clear()
+{
+    m_entries.clear();
+    m_index.clear();
+    m_bytes = 0;
+}
+
+void PrefixCache::evict(EntryList::iterator it)
+{
+    // only this entry's mappings, others sharing its first blocks stay reachable
+    for (quint64 hash : blockHashes(it->tokens)) {
+        auto [begin, end] = m_index.equal_range(hash);
+        auto found = std::find_if(begin, end, [it](const auto &mapping) { return mapping.second == it; });
+        if (found != end)
+            m_index.erase(found);
+    }
+    m_bytes -= it->state.size();
+    m_entries.erase(it);
+}
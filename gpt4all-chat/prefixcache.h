@@ -0,0 +1,48 @@
+#ifndef PREFIXCACHE_H
+#define PREFIXCACHE_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// Model states saved after a prompt, keyed by the tokens they hold. A request that starts with the
+// same tokens, e.g. the same system prompt and chat history, restores the state instead of decoding
+// them again.
+class PrefixCache
+{
+public:
+    struct Entry {
+        std::vector<int32_t> tokens;
+        QByteArray state;
+    };
+
+    explicit PrefixCache(qsizetype maxBytes = 1024 * 1024 * 1024);
+
+    // States are only valid for the model that produced them
+    QString model() const { return m_model; }
+    void setModel(const QString &model);
+
+    // Returns the entry sharing the longest prefix with tokens, or nullptr if none shares at least
+    // one block of tokens
+    const Entry *longestPrefix(const std::vector<int32_t> &tokens);
+    void insert(const std::vector<int32_t> &tokens, const QByteArray &state);
+    void clear();
+
+private:
+    using EntryList = std::list<Entry>;
+
+    static std::vector<quint64> blockHashes(const std::vector<int32_t> &tokens);
+    void evict(EntryList::iterator it);
+
+    QString m_model;
+    qsizetype m_maxBytes;
+    qsizetype m_bytes = 0;
+    EntryList m_entries; // most recently used first
+    // hash of a token prefix -> each entry starting with it, entries may share their first blocks
+    std::unordered_multimap<quint64, EntryList::iterator> m_index;
+};
+
+#endif // PREFIXCACHE_H
@@ -286,9 +286,40 @@ MySettingsTab {
             Accessible.name: serverPortField.text
             Accessible.description: ToolTip.text
         }
-        Rectangle {
+        MySettingsLabel {
+            id: serverWorkersLabel
+            text: qsTr("API Server Workers (Requires restart):")
             Layout.row: 10
             Layout.column: 0
+        }
+        MyTextField {
+            id: serverWorkersField
+            text: MySettings.serverWorkers
+            color: theme.textColor
+            font.pixelSize: theme.fontSizeLarge
+            ToolTip.text: qsTr("Number of api requests answered at once. Workers share the weights of a model, but each needs memory for its own context")
+            ToolTip.visible: hovered
+            Layout.row: 10
+            Layout.column: 1
+            validator: IntValidator {
+                bottom: 1
+            }
+            onEditingFinished: {
+                var val = parseInt(text)
+                if (!isNaN(val)) {
+                    MySettings.serverWorkers = val
+                    focus = false
+                } else {
+                    text = MySettings.serverWorkers
+                }
+            }
+            Accessible.role: Accessible.EditableText
+            Accessible.name: serverWorkersField.text
+            Accessible.description: ToolTip.text
+        }
+        Rectangle {
+            Layout.row: 11
+            Layout.column: 0
             Layout.columnSpan: 3
             Layout.fillWidth: true
             height: 3
@@ -300,7 +331,7 @@ MySettingsTab {
         rowSpacing: 10
         columnSpacing: 10
         Rectangle {
-            Layout.row: 2
+            Layout.row: 6
             Layout.column: 0
             Layout.fillWidth: true
             Layout.columnSpan: 3
@@ -338,6 +369,124 @@ MySettingsTab {
                 }
             }
         }
+        MySettingsLabel {
+            id: nBatchThreadsLabel
+            text: qsTr("Prompt Processing Threads")
+            Layout.row: 2
+            Layout.column: 0
+        }
+        MyTextField {
+            text: MySettings.batchThreadCount
+            color: theme.textColor
+            font.pixelSize: theme.fontSizeLarge
+            ToolTip.text: qsTr("Threads used to process prompts, 0 to use the CPU Threads setting. Prompt processing scales with cores while generating text is limited by memory bandwidth")
+            ToolTip.visible: hovered
+            Layout.row: 2
+            Layout.column: 1
+            validator: IntValidator {
+                bottom: 0
+            }
+            onEditingFinished: {
+                var val = parseInt(text)
+                if (!isNaN(val)) {
+                    MySettings.batchThreadCount = val
+                    focus = false
+                } else {
+                    text = MySettings.batchThreadCount
+                }
+            }
+            Accessible.role: Accessible.EditableText
+            Accessible.name: nBatchThreadsLabel.text
+            Accessible.description: ToolTip.text
+        }
+        MySettingsLabel {
+            id: threadAffinityLabel
+            text: qsTr("Thread Affinity")
+            Layout.row: 3
+            Layout.column: 0
+        }
+        MyComboBox {
+            id: threadAffinityBox
+            Layout.row: 3
+            Layout.column: 1
+            Layout.minimumWidth: 200
+            Layout.fillWidth: false
+            model: ["None", "Physical cores", "Core set"]
+            Accessible.role: Accessible.ComboBox
+            Accessible.name: threadAffinityLabel.text
+            Accessible.description: qsTr("Which CPUs inference runs on, one per physical core or the cores listed below. Not supported on macOS")
+            function updateModel() {
+                threadAffinityBox.currentIndex = threadAffinityBox.indexOfValue(MySettings.threadAffinity);
+            }
+            Component.onCompleted: {
+                threadAffinityBox.updateModel()
+            }
+            Connections {
+                target: MySettings
+                function onThreadAffinityChanged() {
+                    threadAffinityBox.updateModel()
+                }
+            }
+            onActivated: {
+                MySettings.threadAffinity = threadAffinityBox.currentText
+            }
+        }
+        MySettingsLabel {
+            id: threadAffinityCoresLabel
+            text: qsTr("Affinity Cores")
+            Layout.row: 4
+            Layout.column: 0
+        }
+        MyTextField {
+            id: threadAffinityCoresField
+            text: MySettings.threadAffinityCores
+            enabled: MySettings.threadAffinity === "Core set"
+            color: theme.textColor
+            font.pixelSize: theme.fontSizeLarge
+            placeholderText: "0-7,16"
+            ToolTip.text: qsTr("CPUs to run inference on when the thread affinity is a core set, as a list like 0-7,16")
+            ToolTip.visible: hovered
+            Layout.row: 4
+            Layout.column: 1
+            onEditingFinished: {
+                MySettings.threadAffinityCores = text
+                focus = false
+            }
+            Accessible.role: Accessible.EditableText
+            Accessible.name: threadAffinityCoresLabel.text
+            Accessible.description: ToolTip.text
+        }
+        MySettingsLabel {
+            id: modelMemoryBudgetLabel
+            text: qsTr("Model Memory Budget (GB)")
+            Layout.row: 5
+            Layout.column: 0
+        }
+        MyTextField {
+            id: modelMemoryBudgetField
+            text: MySettings.modelMemoryBudget
+            color: theme.textColor
+            font.pixelSize: theme.fontSizeLarge
+            ToolTip.text: qsTr("Memory the models kept loaded for switching between them may use, 0 for half of the system RAM. The least recently used models are unloaded first")
+            ToolTip.visible: hovered
+            Layout.row: 5
+            Layout.column: 1
+            validator: IntValidator {
+                bottom: 0
+            }
+            onEditingFinished: {
+                var val = parseInt(text)
+                if (!isNaN(val)) {
+                    MySettings.modelMemoryBudget = val
+                    focus = false
+                } else {
+                    text = MySettings.modelMemoryBudget
+                }
+            }
+            Accessible.role: Accessible.EditableText
+            Accessible.name: modelMemoryBudgetLabel.text
+            Accessible.description: ToolTip.text
+        }
     }
 }
 
@@ -412,7 +412,7 @@ Rectangle {
                         id: comboItemDelegate
                         width: comboBox.width
                         contentItem: Text {
-                            text: name
+                            text: isResident ? name + qsTr(" \u00B7 loaded") : name
                             color: theme.textColor
                             font: comboBox.font
                             elide: Text.ElideRight
@@ -782,6 +782,165 @@ MySettingsTab {
                 Accessible.name: gpuLayersLabel.text
                 Accessible.description: ToolTip.text
             }
+
+            MySettingsLabel {
+                id: kvCacheTypeLabel
+                visible: !root.currentModelInfo.isOnline
+                text: qsTr("KV Cache Type")
+                Layout.row: 5
+                Layout.column: 0
+            }
+            MyComboBox {
+                id: kvCacheTypeBox
+                visible: !root.currentModelInfo.isOnline
+                model: ["f16", "q8_0", "q4_0"]
+                Layout.row: 5
+                Layout.column: 1
+                Layout.minimumWidth: 100
+                Layout.fillWidth: false
+                ToolTip.text: qsTr("Element type of the attention key cache. The quantized types use less memory for long contexts at some cost in quality.\nNOTE: Does not take effect until you reload the model.")
+                ToolTip.visible: hovered
+                function updateModel() {
+                    kvCacheTypeBox.currentIndex = root.currentModelInfo.kvCacheType
+                }
+                Component.onCompleted: {
+                    kvCacheTypeBox.updateModel()
+                }
+                Connections {
+                    target: MySettings
+                    function onKvCacheTypeChanged() {
+                        kvCacheTypeBox.updateModel()
+                    }
+                }
+                Connections {
+                    target: root
+                    function onCurrentModelInfoChanged() {
+                        kvCacheTypeBox.updateModel()
+                    }
+                }
+                onActivated: {
+                    MySettings.setModelKVCacheType(root.currentModelInfo, kvCacheTypeBox.currentIndex)
+                }
+                Accessible.role: Accessible.ComboBox
+                Accessible.name: kvCacheTypeLabel.text
+                Accessible.description: ToolTip.text
+            }
+
+            MySettingsLabel {
+                id: draftModelLabel
+                visible: !root.currentModelInfo.isOnline
+                text: qsTr("Draft Model")
+                Layout.row: 5
+                Layout.column: 2
+            }
+            MyTextField {
+                id: draftModelField
+                visible: !root.currentModelInfo.isOnline
+                text: root.currentModelInfo.draftModel
+                color: theme.textColor
+                font.pixelSize: theme.fontSizeLarge
+                placeholderText: qsTr("None")
+                ToolTip.text: qsTr("File name of a small installed model sharing this model's vocabulary. It proposes tokens which this model then verifies together, which speeds up generation without changing the output.")
+                ToolTip.visible: hovered
+                Layout.row: 5
+                Layout.column: 3
+                Connections {
+                    target: MySettings
+                    function onDraftModelChanged() {
+                        draftModelField.text = root.currentModelInfo.draftModel;
+                    }
+                }
+                Connections {
+                    target: root
+                    function onCurrentModelInfoChanged() {
+                        draftModelField.text = root.currentModelInfo.draftModel;
+                    }
+                }
+                onEditingFinished: {
+                    MySettings.setModelDraftModel(root.currentModelInfo, text.trim())
+                    focus = false
+                }
+                Accessible.role: Accessible.EditableText
+                Accessible.name: draftModelLabel.text
+                Accessible.description: ToolTip.text
+            }
+            MySettingsLabel {
+                id: draftTokensLabel
+                visible: !root.currentModelInfo.isOnline
+                text: qsTr("Draft Tokens")
+                Layout.row: 6
+                Layout.column: 2
+            }
+            MyTextField {
+                id: draftTokensField
+                visible: !root.currentModelInfo.isOnline
+                text: root.currentModelInfo.draftTokens
+                color: theme.textColor
+                font.pixelSize: theme.fontSizeLarge
+                ToolTip.text: qsTr("How many tokens the draft model or prompt lookup proposes at a time")
+                ToolTip.visible: hovered
+                Layout.row: 6
+                Layout.column: 3
+                validator: IntValidator {
+                    bottom: 1
+                }
+                Connections {
+                    target: MySettings
+                    function onDraftTokensChanged() {
+                        draftTokensField.text = root.currentModelInfo.draftTokens;
+                    }
+                }
+                Connections {
+                    target: root
+                    function onCurrentModelInfoChanged() {
+                        draftTokensField.text = root.currentModelInfo.draftTokens;
+                    }
+                }
+                onEditingFinished: {
+                    var val = parseInt(text)
+                    if (!isNaN(val)) {
+                        MySettings.setModelDraftTokens(root.currentModelInfo, val)
+                        focus = false
+                    } else {
+                        text = root.currentModelInfo.draftTokens
+                    }
+                }
+                Accessible.role: Accessible.EditableText
+                Accessible.name: draftTokensLabel.text
+                Accessible.description: ToolTip.text
+            }
+
+            MySettingsLabel {
+                id: promptLookupLabel
+                visible: !root.currentModelInfo.isOnline
+                text: qsTr("Prompt Lookup")
+                Layout.row: 6
+                Layout.column: 0
+            }
+            MyCheckBox {
+                id: promptLookupBox
+                visible: !root.currentModelInfo.isOnline
+                checked: root.currentModelInfo.promptLookup
+                Layout.row: 6
+                Layout.column: 1
+                ToolTip.text: qsTr("Without a draft model, propose tokens by finding the last few generated tokens in the context and copying what followed them. Speeds up responses that quote the context, such as summaries of LocalDocs excerpts.")
+                ToolTip.visible: hovered
+                Connections {
+                    target: MySettings
+                    function onPromptLookupChanged() {
+                        promptLookupBox.checked = root.currentModelInfo.promptLookup;
+                    }
+                }
+                Connections {
+                    target: root
+                    function onCurrentModelInfoChanged() {
+                        promptLookupBox.checked = root.currentModelInfo.promptLookup;
+                    }
+                }
+                onClicked: {
+                    MySettings.setModelPromptLookup(root.currentModelInfo, promptLookupBox.checked)
+                }
+            }
         }
 
         Rectangle {
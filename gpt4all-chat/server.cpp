@@ -1,5 +1,6 @@
 #include "server.h"
 #include "chat.h"
+#include "serverscheduler.h"
 #include "mysettings.h"
 #include "modellist.h"
 
@@ -11,35 +12,6 @@
 
 //#define DEBUG
 
-static inline QJsonObject modelToJson(const ModelInfo &info)
-{
-    QJsonObject model;
-    model.insert("id", info.name());
-    model.insert("object", "model");
-    model.insert("created", 0);
-    model.insert("owned_by", "humanity");
-    model.insert("root", info.name());
-    model.insert("parent", QJsonValue::Null);
-
-    QJsonArray permissions;
-    QJsonObject permissionObj;
-    permissionObj.insert("id", "foobarbaz");
-    permissionObj.insert("object", "model_permission");
-    permissionObj.insert("created", 0);
-    permissionObj.insert("allow_create_engine", false);
-    permissionObj.insert("allow_sampling", false);
-    permissionObj.insert("allow_logprobs", false);
-    permissionObj.insert("allow_search_indices", false);
-    permissionObj.insert("allow_view", true);
-    permissionObj.insert("allow_fine_tuning", false);
-    permissionObj.insert("organization", "*");
-    permissionObj.insert("group", QJsonValue::Null);
-    permissionObj.insert("is_blocking", false);
-    permissions.append(permissionObj);
-    model.insert("permissions", permissions);
-    return model;
-}
-
 static inline QJsonObject resultToJson(const ResultInfo &info)
 {
     QJsonObject result;
@@ -54,100 +26,125 @@ static inline QJsonObject resultToJson(const ResultInfo &info)
     return result;
 }
 
-Server::Server(Chat *chat)
+Server::Server(Chat *chat, bool isPrimary)
     : ChatLLM(chat, true /*isServer*/)
     , m_chat(chat)
-    , m_server(nullptr)
+    , m_scheduler(nullptr)
+    , m_responder(nullptr)
 {
-    connect(this, &Server::threadStarted, this, &Server::start);
     connect(this, &Server::databaseResultsChanged, this, &Server::handleDatabaseResultsChanged);
     connect(chat, &Chat::collectionListChanged, this, &Server::handleCollectionListChanged, Qt::QueuedConnection);
+
+    if (isPrimary) {
+        connect(this, &Server::requestServerNewPromptResponsePair, m_chat,
+            &Chat::serverNewPromptResponsePair, Qt::BlockingQueuedConnection);
+        m_scheduler = new ServerScheduler(chat, this);
+    }
 }
 
 Server::~Server()
 {
+    if (m_scheduler) {
+        // stop answering before the scheduler closes the connections
+        destroy();
+        delete m_scheduler;
+    }
 }
 
-void Server::start()
+void Server::handleRequest(const ServerRequest &request)
 {
-    m_server = new QHttpServer(this);
-    if (!m_server->listen(QHostAddress::LocalHost, MySettings::globalInstance()->networkPort())) {
-        qWarning() << "ERROR: Unable to start the server";
-        return;
-    }
+    m_responder = request.responder.get();
+    const ServerResponse response = handleCompletionRequest(request.body, request.path == "/v1/chat/completions",
+        m_responder);
+    if (!m_responder->isStreaming())
+        m_responder->write(response.status, response.mimeType, response.body);
+    m_responder = nullptr;
+    emit requestFinished();
+}
 
-    m_server->route("/v1/models", QHttpServerRequest::Method::Get,
-        [](const QHttpServerRequest &request) {
-            if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
-
-            const QList<ModelInfo> modelList = ModelList::globalInstance()->exportModelList();
-            QJsonObject root;
-            root.insert("object", "list");
-            QJsonArray data;
-            for (const ModelInfo &info : modelList) {
-                if (!info.installed)
-                    continue;
-                data.append(modelToJson(info));
-            }
-            root.insert("data", data);
-            return QHttpServerResponse(root);
-        }
-    );
-
-    m_server->route("/v1/models/<arg>", QHttpServerRequest::Method::Get,
-        [](const QString &model, const QHttpServerRequest &request) {
-            if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
-
-            const QList<ModelInfo> modelList = ModelList::globalInstance()->exportModelList();
-            QJsonObject object;
-            for (const ModelInfo &info : modelList) {
-                if (!info.installed)
-                    continue;
-
-                if (model == info.name()) {
-                    object = modelToJson(info);
-                    break;
-                }
-            }
-            return QHttpServerResponse(object);
-        }
-    );
+bool Server::handlePrompt(int32_t token)
+{
+    const bool result = ChatLLM::handlePrompt(token);
 
-    m_server->route("/v1/completions", QHttpServerRequest::Method::Post,
-        [this](const QHttpServerRequest &request) {
-            if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
-            return handleCompletionRequest(request, false);
-        }
-    );
+    // stop if the client has gone away
+    return result && (!m_responder || m_responder->isConnected());
+}
+
+bool Server::handleResponse(int32_t token, const std::string &response)
+{
+    const bool result = ChatLLM::handleResponse(token, response);
+    if (m_responder && !m_responder->isConnected())
+        return false;
+    if (!m_stream.responder || token < 0 || response.empty())
+        return result;
+
+    // drop the whitespace the response opens with, as response() does
+    QString text = QString::fromStdString(response);
+    if (!m_stream.sentText) {
+        qsizetype i = 0;
+        while (i < text.size() && text.at(i).isSpace())
+            ++i;
+        text.remove(0, i);
+        if (text.isEmpty())
+            return result;
+        m_stream.sentText = true;
+    }
 
-    m_server->route("/v1/chat/completions", QHttpServerRequest::Method::Post,
-        [this](const QHttpServerRequest &request) {
-            if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
-            return handleCompletionRequest(request, true);
+    return writeStreamEvent(text) && result;
+}
+
+bool Server::writeStreamEvent(const QString &text, const QString &finishReason, const QList<ResultInfo> &references)
+{
+    QJsonObject choice;
+    choice.insert("index", m_stream.index);
+    if (m_stream.isChat) {
+        QJsonObject delta;
+        if (!m_stream.sentRole) {
+            delta.insert("role", "assistant");
+            m_stream.sentRole = true;
         }
-    );
+        if (!text.isEmpty())
+            delta.insert("content", text);
+        choice.insert("delta", delta);
+    } else {
+        choice.insert("text", text);
+        choice.insert("logprobs", QJsonValue::Null); // We don't support
+    }
+    choice.insert("finish_reason", finishReason.isEmpty() ? QJsonValue(QJsonValue::Null) : QJsonValue(finishReason));
+    if (!references.isEmpty()) {
+        QJsonArray array;
+        for (const auto &ref : references)
+            array.append(resultToJson(ref));
+        choice.insert("references", array);
+    }
 
-    m_server->afterRequest([] (QHttpServerResponse &&resp) {
-        resp.addHeader("Access-Control-Allow-Origin", "*");
-        return std::move(resp);
-    });
+    QJsonObject chunk;
+    chunk.insert("id", m_stream.id);
+    chunk.insert("object", m_stream.isChat ? "chat.completion.chunk" : "text_completion");
+    chunk.insert("created", m_stream.created);
+    chunk.insert("model", m_stream.model);
+    chunk.insert("choices", QJsonArray { choice });
+    return m_stream.responder->writeEvent(QJsonDocument(chunk).toJson(QJsonDocument::Compact));
+}
 
-    connect(this, &Server::requestServerNewPromptResponsePair, m_chat,
-        &Chat::serverNewPromptResponsePair, Qt::BlockingQueuedConnection);
+// An OpenAI style error object, sent as an event as the stream has already begun
+bool Server::writeStreamError(const QString &message)
+{
+    QJsonObject error;
+    error.insert("message", message);
+    error.insert("type", "server_error");
+    error.insert("code", QJsonValue::Null);
+    return m_stream.responder->writeEvent(QJsonDocument(QJsonObject { { "error", error } }).toJson(QJsonDocument::Compact));
 }
 
-QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &request, bool isChat)
+ServerResponse Server::handleCompletionRequest(const QByteArray &requestBody, bool isChat, HttpResponder *responder)
 {
     // We've been asked to do a completion...
     QJsonParseError err;
-    const QJsonDocument document = QJsonDocument::fromJson(request.body(), &err);
+    const QJsonDocument document = QJsonDocument::fromJson(requestBody, &err);
     if (err.error || !document.isObject()) {
         std::cerr << "ERROR: invalid json in completions body" << std::endl;
-        return QHttpServerResponse(QHttpServerResponder::StatusCode::NoContent);
+        return { 204 };
     }
 #if defined(DEBUG)
     printf("/v1/completions %s\n", qPrintable(document.toJson(QJsonDocument::Indented)));
@@ -156,13 +153,13 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     const QJsonObject body = document.object();
     if (!body.contains("model")) { // required
         std::cerr << "ERROR: completions contains no model" << std::endl;
-        return QHttpServerResponse(QHttpServerResponder::StatusCode::NoContent);
+        return { 204 };
     }
     QJsonArray messages;
     if (isChat) {
         if (!body.contains("messages")) {
             std::cerr << "ERROR: chat completions contains no messages" << std::endl;
-            return QHttpServerResponse(QHttpServerResponder::StatusCode::NoContent);
+            return { 204 };
         }
         messages = body["messages"].toArray();
     }
@@ -221,26 +218,25 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     if (body.contains("echo"))
         echo = body["echo"].toBool();
 
-    // We currently don't support any of the following...
-#if 0
-    // FIXME: Need configurable reverse prompts
-    QList<QString> stop;
+    bool stream = false;
+    if (body.contains("stream"))
+        stream = body["stream"].toBool();
+
+    std::vector<std::string> stop;
     if (body.contains("stop")) {
         QJsonValue stopValue = body["stop"];
         if (stopValue.isString())
-            stop.append(stopValue.toString());
+            stop.push_back(stopValue.toString().toStdString());
         else {
             QJsonArray array = stopValue.toArray();
             for (QJsonValue v : array)
-                stop.append(v.toString());
+                stop.push_back(v.toString().toStdString());
         }
+        std::erase_if(stop, [](const std::string &s) { return s.empty(); });
     }
 
-    // FIXME: QHttpServer doesn't support server-sent events
-    bool stream = false;
-    if (body.contains("stream"))
-        stream = body["stream"].toBool();
-
+    // We currently don't support any of the following...
+#if 0
     // FIXME: What does this do?
     QString suffix;
     if (body.contains("suffix"))
@@ -290,14 +286,15 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
 
     if (modelInfo.filename().isEmpty()) {
         std::cerr << "ERROR: couldn't load default model " << modelRequested.toStdString() << std::endl;
-        return QHttpServerResponse(QHttpServerResponder::StatusCode::BadRequest);
+        return { 400 };
     } else if (!loadModel(modelInfo)) {
         std::cerr << "ERROR: couldn't load model " << modelInfo.name().toStdString() << std::endl;
-        return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+        return { 500 };
     }
 
     // don't remember any context
     resetContext();
+    m_ctx.stop = stop;
 
     const QString promptTemplate    = modelInfo.promptTemplate();
     const float top_k               = modelInfo.topK();
@@ -305,10 +302,33 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     const float repeat_penalty      = modelInfo.repeatPenalty();
     const int repeat_last_n         = modelInfo.repeatPenaltyTokens();
 
+    // restore the longest prefix of the prompt an earlier request has decoded, but not with localdocs
+    // as its context goes in front of the prompt
+    const bool usePrefixCache = m_collections.isEmpty();
+
+    if (stream) {
+        m_stream = Stream();
+        m_stream.responder = responder;
+        m_stream.isChat = isChat;
+        m_stream.id = "foobarbaz";
+        m_stream.model = modelInfo.name();
+        m_stream.created = QDateTime::currentSecsSinceEpoch();
+        responder->beginEventStream();
+    }
+
     int promptTokens = 0;
     int responseTokens = 0;
     QList<QPair<QString, QList<ResultInfo>>> responses;
     for (int i = 0; i < n; ++i) {
+        if (stream) {
+            m_stream.index = i;
+            m_stream.sentRole = false;
+            m_stream.sentText = false;
+            if (echo && !isChat)
+                writeStreamEvent(QString("%1\n").arg(actualPrompt));
+        }
+        if (usePrefixCache)
+            restorePromptPrefix(m_prefixCache, actualPrompt, promptTemplate);
         if (!promptInternal(
             m_collections,
             actualPrompt,
@@ -323,19 +343,41 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
             repeat_last_n)) {
 
             std::cerr << "ERROR: couldn't prompt model " << modelInfo.name().toStdString() << std::endl;
-            return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+            if (stream) {
+                // the status has already been sent, end the stream with an error event instead
+                writeStreamError("couldn't prompt model " + modelInfo.name());
+                responder->writeEvent("[DONE]");
+                m_stream = Stream();
+                return { 200 };
+            }
+            return { 500 };
         }
+        if (usePrefixCache)
+            savePromptPrefix(m_prefixCache);
         QString echoedPrompt = actualPrompt;
         if (!echoedPrompt.endsWith("\n"))
             echoedPrompt += "\n";
         responses.append(qMakePair((echo ? QString("%1\n").arg(actualPrompt) : QString()) + response(), m_databaseResults));
         if (!promptTokens)
             promptTokens += m_promptTokens;
-        responseTokens += m_promptResponseTokens - m_promptTokens;
+        const int choiceTokens = m_promptResponseTokens - m_promptTokens;
+        responseTokens += choiceTokens;
+        if (stream) {
+            const bool showReferences = MySettings::globalInstance()->localDocsShowReferences();
+            if (!writeStreamEvent(QString(), choiceTokens >= max_tokens ? "length" : "stop",
+                showReferences ? m_databaseResults : QList<ResultInfo>()))
+                break;
+        }
         if (i != n - 1)
             resetResponse();
     }
 
+    if (stream) {
+        responder->writeEvent("[DONE]");
+        m_stream = Stream();
+        return { 200 };
+    }
+
     QJsonObject responseObject;
     responseObject.insert("id", "foobarbaz");
     responseObject.insert("object", "text_completion");
@@ -398,5 +440,5 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     fflush(stdout);
 #endif
 
-    return QHttpServerResponse(responseObject);
+    return { 200, "application/json", QJsonDocument(responseObject).toJson(QJsonDocument::Compact) };
 }
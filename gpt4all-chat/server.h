@@ -2,34 +2,82 @@
 #define SERVER_H
 
 #include "chatllm.h"
+#include "httplistener.h"
 
 #include <QObject>
-#include <QtHttpServer/QHttpServer>
 
+#include <memory>
+
+class ServerScheduler;
+
+// A completion request read by the scheduler and answered by one of the workers
+struct ServerRequest {
+    QTcpSocket *socket = nullptr;
+    QByteArray path;
+    QByteArray body;
+    QString client;
+    QString model;
+    std::shared_ptr<HttpResponder> responder;
+};
+
+// The status and body of a response that isn't streamed
+struct ServerResponse {
+    int status = 200;
+    QByteArray mimeType;
+    QByteArray body;
+};
+
+// A worker answering completion requests with its own model. The primary worker belongs to the
+// server chat, shows its requests in the gui and owns the scheduler, which creates the others.
 class Server : public ChatLLM
 {
     Q_OBJECT
 
 public:
-    Server(Chat *parent);
+    Server(Chat *parent, bool isPrimary = true);
     virtual ~Server();
 
-public Q_SLOTS:
-    void start();
+    // Answers the request on the worker's thread and then emits requestFinished()
+    void handleRequest(const ServerRequest &request);
 
 Q_SIGNALS:
     void requestServerNewPromptResponsePair(const QString &prompt);
+    void requestFinished();
+
+protected:
+    bool handlePrompt(int32_t token) override;
+    bool handleResponse(int32_t token, const std::string &response) override;
 
 private Q_SLOTS:
-    QHttpServerResponse handleCompletionRequest(const QHttpServerRequest &request, bool isChat);
     void handleDatabaseResultsChanged(const QList<ResultInfo> &results) { m_databaseResults = results; }
     void handleCollectionListChanged(const QList<QString> &collectionList) { m_collections = collectionList; }
 
 private:
+    ServerResponse handleCompletionRequest(const QByteArray &requestBody, bool isChat,
+        HttpResponder *responder);
+    bool writeStreamError(const QString &message);
+    bool writeStreamEvent(const QString &text, const QString &finishReason = QString(),
+        const QList<ResultInfo> &references = QList<ResultInfo>());
+
+    // State of the completion being streamed, if any
+    struct Stream {
+        HttpResponder *responder = nullptr;
+        bool isChat = false;
+        QString id;
+        QString model;
+        qint64 created = 0;
+        int index = 0;
+        bool sentRole = false;
+        bool sentText = false;
+    };
+
     Chat *m_chat;
-    QHttpServer *m_server;
+    ServerScheduler *m_scheduler;
+    HttpResponder *m_responder;
+    Stream m_stream;
     QList<ResultInfo> m_databaseResults;
     QList<QString> m_collections;
+    PrefixCache m_prefixCache;
 };
 
 #endif // SERVER_H
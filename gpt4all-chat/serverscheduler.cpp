@@ -0,0 +1,224 @@
+#include "serverscheduler.h"
+#include "modellist.h"
+#include "mysettings.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QMetaObject>
+
+#include <algorithm>
+#include <iostream>
+
+// Requests beyond these are refused with 429 rather than queued
+static constexpr int MAX_QUEUED_REQUESTS = 32;
+static constexpr int MAX_QUEUED_REQUESTS_PER_CLIENT = 8;
+
+static inline QJsonObject modelToJson(const ModelInfo &info)
+{
+    QJsonObject model;
+    model.insert("id", info.name());
+    model.insert("object", "model");
+    model.insert("created", 0);
+    model.insert("owned_by", "humanity");
+    model.insert("root", info.name());
+    model.insert("parent", QJsonValue::Null);
+
+    QJsonArray permissions;
+    QJsonObject permissionObj;
+    permissionObj.insert("id", "foobarbaz");
+    permissionObj.insert("object", "model_permission");
+    permissionObj.insert("created", 0);
+    permissionObj.insert("allow_create_engine", false);
+    permissionObj.insert("allow_sampling", false);
+    permissionObj.insert("allow_logprobs", false);
+    permissionObj.insert("allow_search_indices", false);
+    permissionObj.insert("allow_view", true);
+    permissionObj.insert("allow_fine_tuning", false);
+    permissionObj.insert("organization", "*");
+    permissionObj.insert("group", QJsonValue::Null);
+    permissionObj.insert("is_blocking", false);
+    permissions.append(permissionObj);
+    model.insert("permissions", permissions);
+    return model;
+}
+
+ServerScheduler::ServerScheduler(Chat *chat, Server *primary)
+    : QObject(nullptr)
+    , m_listener(nullptr)
+    , m_queued(0)
+{
+    m_workers.append(primary);
+    const int workers = std::max(1, MySettings::globalInstance()->serverWorkers());
+    for (int i = 1; i < workers; ++i) {
+        Server *worker = new Server(chat, false /*isPrimary*/);
+        m_workers.append(worker);
+        m_ownedWorkers.append(worker);
+    }
+
+    for (Server *worker : m_workers) {
+        connect(worker, &Server::requestFinished, this, [this, worker] { handleRequestFinished(worker); },
+            Qt::QueuedConnection);
+    }
+    m_idleWorkers = m_workers;
+
+    moveToThread(&m_thread);
+    connect(&m_thread, &QThread::started, this, &ServerScheduler::start);
+    m_thread.setObjectName("server");
+    m_thread.start();
+}
+
+ServerScheduler::~ServerScheduler()
+{
+    m_thread.quit();
+    m_thread.wait();
+
+    // the workers may still be writing to connections owned by the listener
+    qDeleteAll(m_ownedWorkers);
+}
+
+void ServerScheduler::start()
+{
+    m_listener = new HttpListener(this);
+    if (!m_listener->listen(QHostAddress::LocalHost, MySettings::globalInstance()->networkPort())) {
+        qWarning() << "ERROR: Unable to start the server";
+        return;
+    }
+
+    connect(m_listener, &HttpListener::requestReceived, this, &ServerScheduler::handleRequestReceived);
+}
+
+void ServerScheduler::handleRequestReceived(QTcpSocket *socket, const QByteArray &method, const QByteArray &path,
+    const QByteArray &body)
+{
+    auto responder = std::make_shared<HttpResponder>(socket);
+    if (!MySettings::globalInstance()->serverChat()) {
+        responder->write(401);
+        return;
+    }
+
+    if (method == "GET") {
+        handleModelsRequest(*responder, path);
+        return;
+    }
+
+    if (method != "POST" || (path != "/v1/completions" && path != "/v1/chat/completions")) {
+        responder->write(404);
+        return;
+    }
+
+    const QJsonObject object = QJsonDocument::fromJson(body).object();
+    ServerRequest request;
+    request.socket = socket;
+    request.path = path;
+    request.body = body;
+    request.model = object["model"].toString();
+    request.client = object["user"].toString();
+    if (request.client.isEmpty())
+        request.client = socket->peerAddress().toString();
+    request.responder = responder;
+
+    const int clientQueued = m_queues.value(request.client).size();
+    if (m_queued >= MAX_QUEUED_REQUESTS || clientQueued >= MAX_QUEUED_REQUESTS_PER_CLIENT) {
+        std::cerr << "ERROR: too many requests queued, refusing request from "
+                  << request.client.toStdString() << std::endl;
+        responder->write(429);
+        return;
+    }
+
+    if (!clientQueued)
+        m_clients.append(request.client);
+    m_queues[request.client].enqueue(request);
+    ++m_queued;
+    connect(socket, &QTcpSocket::disconnected, this, [this, socket] { handleDisconnected(socket); });
+    dispatch();
+}
+
+void ServerScheduler::handleModelsRequest(HttpResponder &responder, const QByteArray &path)
+{
+    const QList<ModelInfo> modelList = ModelList::globalInstance()->exportModelList();
+    QJsonObject object;
+    if (path == "/v1/models") {
+        object.insert("object", "list");
+        QJsonArray data;
+        for (const ModelInfo &info : modelList) {
+            if (!info.installed)
+                continue;
+            data.append(modelToJson(info));
+        }
+        object.insert("data", data);
+    } else if (path.startsWith("/v1/models/")) {
+        const QString model = QString::fromUtf8(QByteArray::fromPercentEncoding(path.mid(11)));
+        for (const ModelInfo &info : modelList) {
+            if (!info.installed)
+                continue;
+
+            if (model == info.name()) {
+                object = modelToJson(info);
+                break;
+            }
+        }
+    } else {
+        responder.write(404);
+        return;
+    }
+
+    responder.write(200, "application/json", QJsonDocument(object).toJson(QJsonDocument::Compact));
+}
+
+void ServerScheduler::handleDisconnected(QTcpSocket *socket)
+{
+    // the client went away while its request was still queued
+    for (auto it = m_queues.begin(); it != m_queues.end(); ++it) {
+        QQueue<ServerRequest> &queue = it.value();
+        for (qsizetype i = 0; i < queue.size(); ++i) {
+            if (queue.at(i).socket != socket)
+                continue;
+            queue.removeAt(i);
+            --m_queued;
+            if (queue.isEmpty()) {
+                m_clients.removeOne(it.key());
+                m_queues.erase(it);
+            }
+            return;
+        }
+    }
+}
+
+void ServerScheduler::handleRequestFinished(Server *worker)
+{
+    m_idleWorkers.append(worker);
+    dispatch();
+}
+
+void ServerScheduler::dispatch()
+{
+    while (!m_idleWorkers.isEmpty() && !m_clients.isEmpty()) {
+        const QString client = m_clients.takeFirst();
+        auto it = m_queues.find(client);
+        const ServerRequest request = it->dequeue();
+        --m_queued;
+        if (it->isEmpty())
+            m_queues.erase(it);
+        else
+            m_clients.append(client);
+
+        // from here on the worker notices a disconnect through the responder
+        disconnect(request.socket, &QTcpSocket::disconnected, this, nullptr);
+
+        // prefer a worker that already has the requested model loaded
+        Server *worker = m_idleWorkers.first();
+        for (Server *idle : m_idleWorkers) {
+            if (m_workerModels.value(idle) == request.model) {
+                worker = idle;
+                break;
+            }
+        }
+        m_idleWorkers.removeOne(worker);
+        m_workerModels.insert(worker, request.model);
+
+        QMetaObject::invokeMethod(worker, [worker, request] { worker->handleRequest(request); },
+            Qt::QueuedConnection);
+    }
+}
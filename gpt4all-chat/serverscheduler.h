@@ -0,0 +1,47 @@
+#ifndef SERVERSCHEDULER_H
+#define SERVERSCHEDULER_H
+
+#include "server.h"
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QQueue>
+#include <QThread>
+
+class Chat;
+
+// Accepts the api server's connections on its own thread and queues completion requests for a pool
+// of workers. Clients are admitted round-robin so that one busy client can't starve the others,
+// requests are dropped when their client disconnects and refused with 429 once the queue is full.
+class ServerScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    ServerScheduler(Chat *chat, Server *primary);
+    virtual ~ServerScheduler();
+
+private Q_SLOTS:
+    void start();
+    void handleRequestReceived(QTcpSocket *socket, const QByteArray &method, const QByteArray &path,
+        const QByteArray &body);
+
+private:
+    void handleModelsRequest(HttpResponder &responder, const QByteArray &path);
+    void handleDisconnected(QTcpSocket *socket);
+    void handleRequestFinished(Server *worker);
+    void dispatch();
+
+    QThread m_thread;
+    HttpListener *m_listener;
+    QList<Server*> m_workers;
+    QList<Server*> m_ownedWorkers;
+    QList<Server*> m_idleWorkers;
+    QHash<Server*, QString> m_workerModels;
+    QHash<QString, QQueue<ServerRequest>> m_queues;
+    QList<QString> m_clients;
+    int m_queued;
+};
+
+#endif // SERVERSCHEDULER_H
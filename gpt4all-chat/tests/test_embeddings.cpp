@@ -0,0 +1,163 @@
+#include "embeddings.h"
+#include "test.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
+
+#include <algorithm>
+
+static const int s_dim = 384;
+
+static std::vector<float> unitVector(int axis)
+{
+    std::vector<float> v(s_dim, 0.0f);
+    v[axis] = 1.0f;
+    return v;
+}
+
+int main()
+{
+    QTemporaryDir dir;
+    CHECK(dir.isValid());
+    const QString dirPath = dir.path() + "/";
+    const QString logPath = dirPath + "embeddings_v0.log";
+
+    // the changes are appended to the log, well before the index is checkpointed
+    {
+        Embeddings embeddings(dirPath, nullptr);
+        CHECK(!embeddings.fileExists());
+        CHECK(embeddings.load());
+        CHECK(embeddings.add(unitVector(0), 1));
+        CHECK(embeddings.add(unitVector(1), 2));
+        CHECK(embeddings.add(unitVector(2), 3));
+        embeddings.remove(2);
+        CHECK(embeddings.save());
+        CHECK(embeddings.fileExists());
+        CHECK(!QFile::exists(dirPath + "embeddings_v0.dat"));
+    }
+    const qint64 logSize = QFileInfo(logPath).size();
+    CHECK(logSize > 0);
+
+    // replaying the log restores the adds and removes
+    {
+        Embeddings embeddings(dirPath, nullptr);
+        CHECK(embeddings.load());
+        std::vector<qint64> found = embeddings.search(unitVector(0), 3);
+        CHECK_EQ(found.size(), size_t(2));
+        CHECK(!found.empty() && found.front() == 1);
+        CHECK(std::find(found.begin(), found.end(), 2) == found.end());
+        found = embeddings.search(unitVector(2), 1);
+        CHECK(found.size() == 1 && found.front() == 3);
+    }
+
+    // a record cut short by a crash is dropped and the log truncated to the records before it
+    {
+        QFile log(logPath);
+        CHECK(log.open(QIODevice::Append));
+        const char partial[] = { 'a', 4, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3 };
+        log.write(partial, sizeof(partial));
+    }
+    {
+        Embeddings embeddings(dirPath, nullptr);
+        CHECK(embeddings.load());
+        CHECK_EQ(QFileInfo(logPath).size(), logSize);
+        const std::vector<qint64> found = embeddings.search(unitVector(1), 3);
+        CHECK_EQ(found.size(), size_t(2));
+        CHECK(std::find(found.begin(), found.end(), 4) == found.end());
+
+        // records written after the truncation are replayed too
+        CHECK(embeddings.add(unitVector(3), 5));
+        CHECK(embeddings.save());
+    }
+    {
+        Embeddings embeddings(dirPath, nullptr);
+        CHECK(embeddings.load());
+        const std::vector<qint64> found = embeddings.search(unitVector(3), 1);
+        CHECK(found.size() == 1 && found.front() == 5);
+    }
+
+    // once enough records are logged the index is checkpointed and the log dropped
+    QTemporaryDir checkpointDir;
+    CHECK(checkpointDir.isValid());
+    const QString checkpointDirPath = checkpointDir.path() + "/";
+    const QString indexPath = checkpointDirPath + "embeddings_v0.dat";
+    const QString checkpointPath = indexPath + ".tmp";
+    const QString checkpointLogPath = checkpointDirPath + "embeddings_v0.log";
+    {
+        Embeddings embeddings(checkpointDirPath, nullptr);
+        embeddings.setMinCheckpointRecords(4);
+        CHECK(embeddings.load());
+        for (int i = 0; i < 3; ++i)
+            CHECK(embeddings.add(unitVector(i), i + 1));
+        CHECK(embeddings.save());
+        CHECK(!QFile::exists(indexPath));
+        CHECK(embeddings.add(unitVector(3), 4));
+        embeddings.remove(2);
+        CHECK(embeddings.save());
+        CHECK(QFile::exists(indexPath));
+        CHECK(!QFile::exists(checkpointPath));
+        CHECK(!QFile::exists(checkpointLogPath));
+    }
+    const auto checkIndex = [&](const QString &path) {
+        Embeddings embeddings(path, nullptr);
+        CHECK(embeddings.load());
+        const std::vector<qint64> found = embeddings.search(unitVector(3), 4);
+        CHECK_EQ(found.size(), size_t(3));
+        CHECK(!found.empty() && found.front() == 4);
+        CHECK(std::find(found.begin(), found.end(), 2) == found.end());
+    };
+    checkIndex(checkpointDirPath);
+
+    // a checkpoint that was written in full but not yet renamed into place is promoted
+    CHECK(QFile::rename(indexPath, checkpointPath));
+    checkIndex(checkpointDirPath);
+    CHECK(QFile::exists(indexPath));
+    CHECK(!QFile::exists(checkpointPath));
+
+    // an index loaded from the mapping takes its own copy of the base layer to grow, and the mapping
+    // is released before the next checkpoint replaces the file
+    {
+        Embeddings embeddings(checkpointDirPath, nullptr);
+        embeddings.setMinCheckpointRecords(4);
+        CHECK(embeddings.load());
+        for (int i = 4; i < 12; ++i)
+            CHECK(embeddings.add(unitVector(i), i + 1));
+        // the log has to grow as large as the index before it is checkpointed
+        for (int label = 5; label <= 8; ++label)
+            embeddings.remove(label);
+        CHECK(embeddings.save());
+        CHECK(!QFile::exists(checkpointLogPath));
+        const std::vector<qint64> found = embeddings.search(unitVector(11), 1);
+        CHECK(found.size() == 1 && found.front() == 12);
+    }
+    {
+        Embeddings embeddings(checkpointDirPath, nullptr);
+        CHECK(embeddings.load());
+        for (int i = 0; i < 12; ++i) {
+            const bool removed = i == 1 || (i >= 4 && i < 8);
+            const std::vector<qint64> found = embeddings.search(unitVector(i), 1);
+            CHECK(found.size() == 1 && (found.front() == i + 1) != removed);
+        }
+    }
+
+    // a first checkpoint cut short by a crash is dropped and the log replayed instead
+    {
+        QFile index(indexPath);
+        CHECK(index.open(QIODevice::ReadOnly));
+        QFile checkpoint(logPath + ".tmp");
+        CHECK(checkpoint.open(QIODevice::WriteOnly));
+        checkpoint.write(index.read(index.size() / 2));
+    }
+    CHECK(QFile::rename(logPath + ".tmp", dirPath + "embeddings_v0.dat.tmp"));
+    {
+        Embeddings embeddings(dirPath, nullptr);
+        CHECK(embeddings.load());
+        CHECK(!QFile::exists(dirPath + "embeddings_v0.dat"));
+        CHECK(!QFile::exists(dirPath + "embeddings_v0.dat.tmp"));
+        const std::vector<qint64> found = embeddings.search(unitVector(3), 1);
+        CHECK(found.size() == 1 && found.front() == 5);
+    }
+
+    return test_result();
+}
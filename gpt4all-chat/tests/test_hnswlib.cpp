@@ -0,0 +1,92 @@
+#include "hnswlib/hnswlib.h"
+#include "test.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static const int s_dim = 16;
+
+static std::vector<char> readFile(const std::string &path)
+{
+    std::ifstream input(path, std::ios::binary);
+    return { std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>() };
+}
+
+// every point is its own nearest neighbor
+static bool findsAll(hnswlib::HierarchicalNSW<float> &hnsw, const std::vector<std::vector<float>> &points)
+{
+    for (size_t i = 0; i < points.size(); ++i) {
+        auto result = hnsw.searchKnn(points[i].data(), 1);
+        if (result.size() != 1 || result.top().second != i)
+            return false;
+    }
+    return true;
+}
+
+int main()
+{
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist;
+    std::vector<std::vector<float>> points(200, std::vector<float>(s_dim));
+    for (auto &point : points) {
+        for (auto &x : point)
+            x = dist(rng);
+    }
+
+    const std::string path = (std::filesystem::temp_directory_path() / "test_hnswlib.dat").string();
+    hnswlib::L2Space space(s_dim);
+    {
+        hnswlib::HierarchicalNSW<float> hnsw(&space, 100);
+        for (size_t i = 0; i < 100; ++i)
+            hnsw.addPoint(points[i].data(), i);
+        hnsw.saveIndex(path);
+    }
+
+    // the buffer stands in for the mapping of the file
+    std::vector<char> buffer = readFile(path);
+    {
+        hnswlib::HierarchicalNSW<float> hnsw(&space, buffer.data(), buffer.size());
+        CHECK(hnsw.data_level0_borrowed_);
+        CHECK_EQ(hnsw.cur_element_count.load(), size_t(100));
+        CHECK(findsAll(hnsw, { points.begin(), points.begin() + 100 }));
+
+        // the base layer is full, so adding resizes the index, which copies it out of the buffer
+        for (size_t i = 100; i < 200; ++i) {
+            if (hnsw.cur_element_count == hnsw.max_elements_)
+                hnsw.resizeIndex(hnsw.max_elements_ + 50);
+            hnsw.addPoint(points[i].data(), i);
+        }
+        CHECK(!hnsw.data_level0_borrowed_);
+        std::fill(buffer.begin(), buffer.end(), char(0xff));
+        CHECK(findsAll(hnsw, points));
+
+        hnsw.saveIndex(path);
+    }
+
+    buffer = readFile(path);
+    {
+        hnswlib::HierarchicalNSW<float> hnsw(&space, buffer.data(), buffer.size());
+        CHECK(findsAll(hnsw, points));
+        hnsw.markDelete(7);
+        auto result = hnsw.searchKnn(points[7].data(), 1);
+        CHECK(result.size() == 1 && result.top().second != 7);
+    }
+
+    // a truncated file is refused rather than read past its end
+    bool refused = false;
+    try {
+        hnswlib::HierarchicalNSW<float> hnsw(&space, buffer.data(), buffer.size() / 2);
+    } catch (const std::runtime_error &) {
+        refused = true;
+    }
+    CHECK(refused);
+
+    std::remove(path.c_str());
+    return test_result();
+}
@@ -0,0 +1,73 @@
+#include "prefixcache.h"
+#include "test.h"
+
+#include <numeric>
+
+// tokens 0, 1, 2, ... with the ones from diverge on offset by 1000
+static std::vector<int32_t> tokens(size_t n, size_t diverge = SIZE_MAX)
+{
+    std::vector<int32_t> result(n);
+    std::iota(result.begin(), result.end(), 0);
+    for (size_t i = diverge; i < n; ++i)
+        result[i] += 1000;
+    return result;
+}
+
+int main()
+{
+    PrefixCache cache;
+    cache.setModel("model");
+
+    // nothing is cached for fewer tokens than a block
+    cache.insert(tokens(10), QByteArray("short"));
+    CHECK(!cache.longestPrefix(tokens(10)));
+
+    cache.insert(tokens(40, 35), QByteArray("a"));
+    cache.insert(tokens(100, 70), QByteArray("b"));
+
+    // a prompt must share at least one whole block
+    CHECK(!cache.longestPrefix(tokens(31)));
+    CHECK(!cache.longestPrefix(tokens(64, 20)));
+
+    // the entry sharing the most blocks wins, also over one that holds the same first block
+    const PrefixCache::Entry *entry = cache.longestPrefix(tokens(200));
+    CHECK(entry && entry->state == "b");
+    entry = cache.longestPrefix(tokens(200, 50));
+    CHECK(entry && entry->state == "b");
+    entry = cache.longestPrefix(tokens(200, 33));
+    CHECK(entry && entry->state == "b");
+
+    // an entry that is a prefix of a new one is replaced by it
+    cache.insert(tokens(128, 70), QByteArray("c"));
+    entry = cache.longestPrefix(tokens(100, 70));
+    CHECK(entry && entry->state == "c");
+    entry = cache.longestPrefix(tokens(200, 70));
+    CHECK(entry && entry->state == "c" && entry->tokens.size() == 128);
+
+    // the least recently used entries are evicted to stay within the limit
+    PrefixCache small(2);
+    small.insert(tokens(32), QByteArray("x"));
+    small.insert(tokens(32, 0), QByteArray("y"));
+    CHECK(small.longestPrefix(tokens(32)));
+    small.insert(tokens(32, 16), QByteArray("z"));
+    CHECK(!small.longestPrefix(tokens(32, 0)));
+    CHECK(small.longestPrefix(tokens(32)));
+    CHECK(small.longestPrefix(tokens(32, 16)));
+
+    // evicting one of two entries that share their first block leaves the other reachable
+    PrefixCache shared(2);
+    shared.insert(tokens(64, 40), QByteArray("p"));
+    shared.insert(tokens(64, 50), QByteArray("q"));
+    CHECK(shared.longestPrefix(tokens(64, 40))); // p is now the most recently used
+    shared.insert(tokens(32, 0), QByteArray("r"));
+    entry = shared.longestPrefix(tokens(64));
+    CHECK(entry && entry->state == "p");
+    entry = shared.longestPrefix(tokens(64, 50));
+    CHECK(entry && entry->state == "p");
+
+    // states are dropped with the model that produced them
+    cache.setModel("other");
+    CHECK(!cache.longestPrefix(tokens(200)));
+
+    return test_result();
+}